@@ -19,8 +19,13 @@ install(
     COMPONENT simrex_Development
 )
 
+set(simrex_install_targets simrex_simrex simrex_header_only simrex_stream)
+if(TARGET simrex_onig_alloc)
+    list(APPEND simrex_install_targets simrex_onig_alloc)
+endif()
+
 install(
-    TARGETS simrex_simrex
+    TARGETS ${simrex_install_targets}
     EXPORT simrexTargets
     RUNTIME #
     COMPONENT simrex_Runtime
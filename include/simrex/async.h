@@ -0,0 +1,351 @@
+/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Асинхронный поиск и замена на корутинах C++20.
+* Тяжёлые операции выполняются на исполнителе порциями по несколько вхождений. Между порциями корутина
+* заново ставится в очередь исполнителя и проверяет std::stop_token, поэтому не занимает поток надолго
+* и может быть отменена.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace simrex {
+
+/*!
+ * @brief Исполнитель корутин: принимает хэндл корутины и когда-нибудь возобновляет её, обычно в другом потоке
+ *      или на следующем витке цикла событий.
+ */
+template<typename E>
+concept RexExecutor = requires(E& executor, std::coroutine_handle<> handle) {
+    executor.post(handle);
+};
+
+/*!
+ * @brief Простейший исполнитель - очередь корутин, которую разбирает владелец, например, цикл событий.
+ * @details post можно вызывать из любого потока.
+ */
+class RexRunQueue {
+public:
+    void post(std::coroutine_handle<> handle) {
+        std::lock_guard lock{mutex_};
+        queue_.push_back(handle);
+    }
+    /// Возобновить одну корутину из очереди. false, если очередь пуста.
+    bool run_one() {
+        std::coroutine_handle<> handle;
+        {
+            std::lock_guard lock{mutex_};
+            if (queue_.empty()) {
+                return false;
+            }
+            handle = queue_.front();
+            queue_.pop_front();
+        }
+        handle.resume();
+        return true;
+    }
+    /// Разбирать очередь, пока она не опустеет. Возвращает количество возобновлённых корутин.
+    size_t run() {
+        size_t count = 0;
+        while (run_one()) {
+            count++;
+        }
+        return count;
+    }
+
+protected:
+    std::mutex mutex_;
+    std::deque<std::coroutine_handle<>> queue_;
+};
+
+/*!
+ * @brief Ленивая задача-корутина с результатом T.
+ * @details Начинает выполняться, когда её ожидают через co_await или sync_wait. Исключение из корутины
+ *      пробрасывается ожидающему.
+ */
+template<typename T>
+class [[nodiscard]] RexTask {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        RexTask get_return_object() {
+            return RexTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        auto final_suspend() noexcept {
+            struct awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    return handle.promise().continuation;
+                }
+                void await_resume() noexcept {}
+            };
+            return awaiter{};
+        }
+        template<typename U>
+        void return_value(U&& value_) {
+            value.emplace(std::forward<U>(value_));
+        }
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+    };
+
+    RexTask(RexTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    RexTask& operator=(RexTask&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    ~RexTask() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return handle_.done();
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() {
+        auto& promise = handle_.promise();
+        if (promise.error) {
+            std::rethrow_exception(promise.error);
+        }
+        return std::move(*promise.value);
+    }
+
+protected:
+    explicit RexTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/// Ожидание, переставляющее корутину в очередь исполнителя.
+template<RexExecutor E>
+struct RexSchedule {
+    E& executor;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+        executor.post(handle);
+    }
+    void await_resume() const noexcept {}
+};
+
+/// Перейти на исполнитель: `co_await rex_schedule(executor);`.
+template<RexExecutor E>
+RexSchedule<E> rex_schedule(E& executor) {
+    return {executor};
+}
+
+namespace detail {
+
+struct RexSyncState {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+
+    void finish() {
+        // Уведомляем под блокировкой: после её снятия ожидающий поток может уничтожить состояние.
+        std::lock_guard lock{mutex};
+        done = true;
+        cv.notify_all();
+    }
+    bool is_done() {
+        std::lock_guard lock{mutex};
+        return done;
+    }
+};
+
+struct RexSyncDriver {
+    struct promise_type {
+        RexSyncState* state = nullptr;
+
+        RexSyncDriver get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        auto final_suspend() noexcept {
+            struct awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+                void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    handle.promise().state->finish();
+                }
+                void await_resume() noexcept {}
+            };
+            return awaiter{};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Исключения задачи сохраняются в самой задаче, поэтому драйвер их только переносит в out.
+template<typename T>
+RexSyncDriver rex_sync_drive(RexTask<T>& task, std::optional<T>& out, std::exception_ptr& error) {
+    try {
+        out.emplace(co_await task);
+    } catch (...) {
+        error = std::current_exception();
+    }
+}
+
+template<typename T>
+T rex_sync_wait(RexTask<T>& task, RexRunQueue* queue) {
+    std::optional<T> result;
+    std::exception_ptr error;
+    RexSyncState state;
+    RexSyncDriver driver = rex_sync_drive(task, result, error);
+    driver.handle.promise().state = &state;
+    driver.handle.resume();
+    if (queue) {
+        while (!state.is_done()) {
+            if (!queue->run_one()) {
+                std::this_thread::yield();
+            }
+        }
+    } else {
+        std::unique_lock lock{state.mutex};
+        state.cv.wait(lock, [&] { return state.done; });
+    }
+    driver.handle.destroy();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return std::move(*result);
+}
+
+} // namespace detail
+
+/*!
+ * @brief Дождаться результата задачи, блокируя текущий поток.
+ * @details Подходит для исполнителей, которые возобновляют корутины в других потоках.
+ */
+template<typename T>
+T sync_wait(RexTask<T> task) {
+    return detail::rex_sync_wait(task, nullptr);
+}
+
+/*!
+ * @brief Дождаться результата задачи, разбирая очередь queue в текущем потоке.
+ */
+template<typename T>
+T sync_wait(RexTask<T> task, RexRunQueue& queue) {
+    return detail::rex_sync_wait(task, &queue);
+}
+
+/*!
+ * @brief Асинхронно получить всю информацию о всех найденных вхождениях.
+ * @param executor - исполнитель, на котором идёт поиск.
+ * @param rex - регулярное выражение. Должно жить до завершения задачи.
+ * @param text - текст, в котором ищем. Должен жить, пока используется результат.
+ * @param stop - токен отмены. Проверяется перед каждой порцией поиска.
+ * @param batch - количество вхождений, после которого корутина уступает исполнитель.
+ * @param offset -  начальная позиция поиска (по умолчанию 0).
+ * @param maxCount - максимальное количество для ограничения поиска.
+ * @return RexTask - вхождения в том же виде, что и OnigRegexp::all_matches, или std::nullopt, если поиск отменён.
+ *      Для не участвовавшей в совпадении подгруппы позиция равна MatchSpan::npos, а текст пустой.
+ */
+template<typename K, RexExecutor E>
+RexTask<std::optional<std::vector<std::vector<std::pair<size_t, simple_str<K>>>>>> all_matches_async(E& executor, const OnigRegexp<K>& rex,
+    std::type_identity_t<simple_str<K>> text, std::stop_token stop = {}, size_t batch = 1024, size_t offset = 0, size_t maxCount = -1) {
+    co_await rex_schedule(executor);
+    std::vector<std::vector<std::pair<size_t, simple_str<K>>>> result;
+    const size_t stride = rex.groups_count();
+    std::vector<MatchSpan> spans(stride * std::max<size_t>(batch, 1));
+    for (size_t at = offset; stride && at != MatchSpan::npos && result.size() < maxCount;) {
+        if (stop.stop_requested()) {
+            co_return std::nullopt;
+        }
+        size_t count;
+        at = rex.all_matches_into(text, spans, count, at, maxCount - result.size());
+        for (size_t m = 0; m < count; m++) {
+            auto& match = result.emplace_back();
+            match.reserve(stride);
+            for (const MatchSpan& span: std::span<const MatchSpan>{spans.data() + m * stride, stride}) {
+                if (span.matched()) {
+                    match.emplace_back(span.begin, simple_str<K>{text.symbols() + span.begin, span.length()});
+                } else {
+                    match.emplace_back(MatchSpan::npos, simple_str<K>{});
+                }
+            }
+        }
+        if (at != MatchSpan::npos) {
+            co_await rex_schedule(executor);
+        }
+    }
+    co_return result;
+}
+
+/*!
+ * @brief Асинхронно заменить вхождения на заданный текст.
+ * @tparam T - тип результата, строка, владеющая текстом (sstring, lstring).
+ * @param executor - исполнитель, на котором идёт поиск.
+ * @param rex - регулярное выражение. Должно жить до завершения задачи.
+ * @param text - исходный текст. Должен жить до завершения задачи.
+ * @param replText - текст замены с подстановкой подгрупп, как в OnigRegexp::replace. Должен жить до завершения задачи.
+ * @param stop - токен отмены. Проверяется перед каждой порцией поиска.
+ * @param batch - количество вхождений, после которого корутина уступает исполнитель.
+ * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп.
+ * @return RexTask - текст с заменёнными вхождениями, или std::nullopt, если замена отменена.
+ * @details Вхождения ищутся порциями, как в all_matches_async, а результат собирается одним проходом в конце.
+ *      Вхождения те же, что возвращает OnigRegexp::all_matches.
+ */
+template<typename T, typename K, RexExecutor E> requires storable_str<T, K>
+RexTask<std::optional<T>> replace_async(E& executor, const OnigRegexp<K>& rex, std::type_identity_t<simple_str<K>> text,
+    std::type_identity_t<simple_str<K>> replText, std::stop_token stop = {}, size_t batch = 1024, bool substGroups = true) {
+    co_await rex_schedule(executor);
+    const size_t stride = rex.groups_count();
+    std::vector<MatchSpan> matches, spans(stride * std::max<size_t>(batch, 1));
+    for (size_t at = 0; stride && at != MatchSpan::npos;) {
+        if (stop.stop_requested()) {
+            co_return std::nullopt;
+        }
+        size_t count;
+        at = rex.all_matches_into(text, spans, count, at);
+        matches.insert(matches.end(), spans.begin(), spans.begin() + count * stride);
+        if (at != MatchSpan::npos) {
+            co_await rex_schedule(executor);
+        }
+    }
+    if (matches.empty()) {
+        co_return T{text};
+    }
+    std::vector<simple_str<K>> parts = rex.replace_parts(text, matches, replText, substGroups);
+    co_return T{expr_join<K, std::vector<simple_str<K>>, 0, false, false>{parts, nullptr}};
+}
+
+} // namespace simrex
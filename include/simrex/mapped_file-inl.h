@@ -0,0 +1,81 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация MappedFile - отображения файла индекса TrigramIndex в память.
+* Подключается из src/mapped_file.cpp, а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h. Только здесь
+* подключаются системные заголовки, в варианте с библиотекой они не видны пользователям simrex.
+*/
+#pragma once
+#include <simrex/onig.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace simrex::detail {
+
+SIMREX_INLINE bool MappedFile::open(const std::filesystem::path& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_) {
+            data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+            if (data_) {
+                size_ = size_t(fileSize.QuadPart);
+            } else {
+                CloseHandle(mapping_);
+                mapping_ = nullptr;
+            }
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            data_ = data;
+            size_ = size_t(st.st_size);
+        }
+    }
+    ::close(fd);
+#endif
+    return data_ != nullptr;
+}
+
+SIMREX_INLINE void MappedFile::close() {
+    if (!data_) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    mapping_ = nullptr;
+#else
+    munmap(data_, size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+} // namespace simrex::detail
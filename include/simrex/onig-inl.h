@@ -0,0 +1,1212 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация OnigRegexp, MultiReplacer и MatchIndex.
+* Подключается из src/onig.cpp, а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace simrex {
+
+namespace detail {
+
+struct OnigRegionDeleter {
+    void operator()(OnigRegion* region) const {
+        onig_region_free(region, 1);
+    }
+};
+using RegionPtr = std::unique_ptr<OnigRegion, OnigRegionDeleter>;
+
+// Регион для поиска без выделения памяти, переиспользуется всеми вызовами в потоке.
+SIMREX_INLINE OnigRegion* thread_region() {
+    thread_local RegionPtr region{onig_region_new()};
+    return region.get();
+}
+
+#ifdef SIMREX_ONIG_ALLOCATOR
+// При первом использовании кодировки oniguruma выделяет глобальные таблицы. Компилируем один раз пустой шаблон,
+// чтобы эта память не попала в memory_usage первого регэкспа с этой кодировкой.
+SIMREX_INLINE void warm_up_encoding(OnigEncoding enc) {
+    static std::mutex mutex;
+    static std::vector<OnigEncoding> warmed;
+    std::lock_guard lock{mutex};
+    if (std::find(warmed.begin(), warmed.end(), enc) != warmed.end()) {
+        return;
+    }
+    warmed.push_back(enc);
+    const OnigUChar empty[1] = {};
+    OnigRegex temp = nullptr;
+    if (ONIG_NORMAL == onig_new(&temp, empty, empty, ONIG_OPTION_DEFAULT, enc, ONIG_SYNTAX_DEFAULT, nullptr)) {
+        onig_free(temp);
+    }
+}
+#endif
+
+} // namespace detail
+
+#ifndef SIMREX_ONIG_ALLOCATOR
+// oniguruma выделяет память сама, перенаправлять и учитывать нечего.
+SIMREX_INLINE bool set_onig_allocator(const OnigAllocator&) {
+    return false;
+}
+
+SIMREX_INLINE OnigMemoryStats onig_memory_stats() {
+    return {};
+}
+#endif
+
+SIMREX_INLINE void OnigRexDeleter::operator()(OnigRegex rex) const {
+    onig_free(rex);
+}
+
+SIMREX_INLINE void OnigRegSetDeleter::operator()(OnigRegSet* regset) const {
+    onig_regset_free(regset);
+}
+
+SIMREX_INLINE OnigRegex OnigRegExpBase::create_regex(const OnigUChar* pattern, size_t length, OnigEncoding enc, size_t* memory) {
+    const OnigUChar *end = pattern + length;
+    OnigRegex temp = nullptr;
+#ifdef SIMREX_ONIG_ALLOCATOR
+    ptrdiff_t before = 0;
+    if (memory) {
+        detail::warm_up_encoding(enc);
+        before = onig_memory_stats().thread;
+    }
+#endif
+    if (ONIG_NORMAL != onig_new(&temp, pattern, end, ONIG_OPTION_DEFAULT, enc, ONIG_SYNTAX_DEFAULT, nullptr)) {
+        return nullptr;
+    }
+#ifdef SIMREX_ONIG_ALLOCATOR
+    if (memory) {
+        *memory = size_t(std::max<ptrdiff_t>(onig_memory_stats().thread - before, 0));
+    }
+#else
+    (void)memory;
+#endif
+    return temp;
+}
+
+SIMREX_INLINE int OnigRegExpBase::search(const OnigUChar* start, size_t length, size_t offset) const {
+    if (!regexp_) {
+        return ONIG_MISMATCH;
+    }
+    const OnigUChar* end = start + length;
+    if (cache_) {
+        return search_first(start, end, start + offset, nullptr);
+    }
+    return onig_search(*this, start, end, start + offset, end, nullptr, ONIG_OPTION_NONE);
+}
+
+SIMREX_INLINE int OnigRegExpBase::search_backward(const OnigUChar* start, size_t length, OnigRegion* region) const {
+    if (!regexp_) {
+        return ONIG_MISMATCH;
+    }
+    // range меньше start - Oniguruma ищет назад, проверяя позиции от start до range.
+    const OnigUChar* end = start + length;
+    return onig_search(*this, start, end, end, start, region, ONIG_OPTION_NONE);
+}
+
+namespace detail {
+
+struct MatchCache {
+    static constexpr size_t shardsCount = 16;
+
+    struct Key {
+        size_t hash;
+        size_t offset;
+        std::string_view text;
+
+        bool operator==(const Key& other) const {
+            return hash == other.hash && offset == other.offset && text == other.text;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return key.hash;
+        }
+    };
+    struct Entry {
+        std::string text;
+        size_t offset;
+        size_t hash;
+        // Пары начало/конец для всех групп, пусто - вхождения нет.
+        std::vector<int> regs;
+    };
+    // Каждая часть кэша - свой LRU список под своим мьютексом, чтобы потоки реже ждали друг друга.
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+    };
+
+    MatchCache(size_t capacity, size_t maxTextLength)
+        : shardCapacity((capacity + shardsCount - 1) / shardsCount), maxTextLength(maxTextLength) {}
+
+    size_t shardCapacity;
+    size_t maxTextLength;
+    std::array<Shard, shardsCount> shards;
+    std::atomic<size_t> hits{0}, misses{0};
+};
+
+} // namespace detail
+
+SIMREX_INLINE void MatchCacheDeleter::operator()(detail::MatchCache* cache) const {
+    delete cache;
+}
+
+SIMREX_INLINE void OnigRegExpBase::enable_cache(size_t capacity, size_t maxTextLength) {
+    cache_.reset(capacity ? new detail::MatchCache(capacity, maxTextLength) : nullptr);
+}
+
+SIMREX_INLINE MatchCacheStats OnigRegExpBase::cache_stats() const {
+    MatchCacheStats stats;
+    if (cache_) {
+        stats.hits = cache_->hits.load(std::memory_order_relaxed);
+        stats.misses = cache_->misses.load(std::memory_order_relaxed);
+        stats.capacity = cache_->shardCapacity * detail::MatchCache::shardsCount;
+        for (auto& shard: cache_->shards) {
+            std::lock_guard lock{shard.mutex};
+            stats.size += shard.lru.size();
+        }
+    }
+    return stats;
+}
+
+SIMREX_INLINE int OnigRegExpBase::search_first(const OnigUChar* start, const OnigUChar* end, const OnigUChar* at, OnigRegion* region) const {
+    if (!cache_ || size_t(end - start) > cache_->maxTextLength) {
+        return onig_search(*this, start, end, at, end, region, ONIG_OPTION_NONE);
+    }
+    if (!region) {
+        region = detail::thread_region();
+    }
+    std::string_view text{reinterpret_cast<const char*>(start), size_t(end - start)};
+    size_t offset = size_t(at - start);
+    detail::MatchCache::Key key{std::hash<std::string_view>{}(text) ^ (offset * 0x9E3779B97F4A7C15ull), offset, text};
+    detail::MatchCache::Shard& shard = cache_->shards[key.hash % detail::MatchCache::shardsCount];
+    {
+        std::lock_guard lock{shard.mutex};
+        if (auto it = shard.map.find(key); it != shard.map.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            const std::vector<int>& regs = it->second->regs;
+            cache_->hits.fetch_add(1, std::memory_order_relaxed);
+            if (regs.empty()) {
+                return ONIG_MISMATCH;
+            }
+            onig_region_resize(region, int(regs.size() / 2));
+            for (size_t i = 0; i < regs.size(); i += 2) {
+                onig_region_set(region, int(i / 2), regs[i], regs[i + 1]);
+            }
+            return regs[0];
+        }
+    }
+    cache_->misses.fetch_add(1, std::memory_order_relaxed);
+    int result = onig_search(*this, start, end, at, end, region, ONIG_OPTION_NONE);
+    if (result < 0 && result != ONIG_MISMATCH) {
+        return result;
+    }
+    detail::MatchCache::Entry entry{std::string{text}, offset, key.hash, {}};
+    if (result >= 0) {
+        entry.regs.reserve(size_t(region->num_regs) * 2);
+        for (int i = 0; i < region->num_regs; i++) {
+            entry.regs.push_back(region->beg[i]);
+            entry.regs.push_back(region->end[i]);
+        }
+    }
+    std::lock_guard lock{shard.mutex};
+    if (!shard.map.contains(key)) {
+        auto& added = shard.lru.emplace_front(std::move(entry));
+        shard.map.emplace(detail::MatchCache::Key{added.hash, added.offset, added.text}, shard.lru.begin());
+        if (shard.lru.size() > cache_->shardCapacity) {
+            const detail::MatchCache::Entry& last = shard.lru.back();
+            shard.map.erase(detail::MatchCache::Key{last.hash, last.offset, last.text});
+            shard.lru.pop_back();
+        }
+    }
+    return result;
+}
+
+template<typename K>
+size_t OnigRegexp<K>::count_of(const str_type& text, size_t maxCount, size_t offset) const {
+    size_t matches = 0;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                matches++;
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+typename OnigRegexp<K>::str_type OnigRegexp<K>::first_founded_str(str_type text, size_t offset) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end());
+        detail::RegionPtr region{onig_region_new()};
+        if (search_first(start, end, start + rt::toLen(offset), region.get()) >= 0) {
+            return str_type{rt::fromChar(start + region->beg[0]), rt::fromLen(region->end[0] - region->beg[0])};
+        }
+    }
+    return simple_str_nt<K>::empty_str;
+}
+
+template<typename K>
+typename OnigRegexp<K>::str_type OnigRegexp<K>::last_founded_str(str_type text, size_t before) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin());
+        OnigRegion* region = detail::thread_region();
+        if (search_backward(start, rt::toLen(std::min(before, text.length())), region) >= 0) {
+            return str_type{rt::fromChar(start + region->beg[0]), rt::fromLen(region->end[0] - region->beg[0])};
+        }
+    }
+    return simple_str_nt<K>::empty_str;
+}
+
+template<typename K>
+std::vector<std::pair<size_t, typename OnigRegexp<K>::str_type>> OnigRegexp<K>::last_match(str_type text, size_t before) const {
+    std::vector<std::pair<size_t, str_type>> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin());
+        OnigRegion* region = detail::thread_region();
+        if (search_backward(start, rt::toLen(std::min(before, text.length())), region) >= 0) {
+            matches.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                matches.emplace_back(
+                    rt::fromLen(region->beg[i]),
+                    str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+std::vector<typename OnigRegexp<K>::str_type> OnigRegexp<K>::texts_in_first_match(str_type text, size_t offset) const {
+    std::vector<str_type> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end());
+        detail::RegionPtr region{onig_region_new()};
+        if (search_first(start, end, start + rt::toLen(offset), region.get()) >= 0) {
+            matches.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                matches.emplace_back(str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+void OnigRegexp<K>::for_first_match(str_type text, size_t offset, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end());
+        detail::RegionPtr region{onig_region_new()};
+        if (search_first(start, end, start + rt::toLen(offset), region.get()) >= 0) {
+            func(region.get(), start, res);
+        }
+    }
+}
+
+template<typename K>
+void OnigRegexp<K>::all_founded_str(str_type text, size_t offset, size_t maxCount, void* result, void(*func)(str_type, void*)) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                func(str_type{rt::fromChar(start + region->beg[0]), rt::fromLen(region->end[0] - region->beg[0])}, result);
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+template<typename K>
+std::vector<typename OnigRegexp<K>::str_type> OnigRegexp<K>::all_founded(str_type text, size_t offset, size_t maxCount) const {
+    std::vector<str_type> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                matches.emplace_back(rt::fromChar(start + region->beg[0]), rt::fromLen(region->end[0] - region->beg[0]));
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+std::vector<std::vector<typename OnigRegexp<K>::str_type>> OnigRegexp<K>::texts_in_all_matches(str_type text, size_t offset, size_t maxCount) const {
+    std::vector<std::vector<str_type>> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                auto& match = matches.emplace_back();
+                match.reserve(region->num_regs);
+                for (int i = 0; i < region->num_regs; i++) {
+                    match.emplace_back(str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+                }
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+void OnigRegexp<K>::for_all_match(str_type text, size_t offset, size_t maxCount, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                func(region.get(), start, res);
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+template<typename K>
+std::vector<std::pair<size_t, typename OnigRegexp<K>::str_type>> OnigRegexp<K>::first_match(str_type text, size_t offset) const {
+    std::vector<std::pair<size_t, str_type>> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end());
+        detail::RegionPtr region{onig_region_new()};
+        int result = search_first(start, end, start + rt::toLen(offset), region.get());
+        if (result >= 0) {
+            matches.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                matches.emplace_back(
+                    rt::fromLen(region->beg[i]),
+                    str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        }
+    }
+    return matches;
+}
+
+template<typename K>
+std::vector<std::vector<std::pair<size_t, typename OnigRegexp<K>::str_type>>> OnigRegexp<K>::all_matches(str_type text, size_t offset, size_t maxCount) const {
+    std::vector<std::vector<std::pair<size_t, str_type>>> matches;
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        detail::RegionPtr region{onig_region_new()};
+        for (size_t count = 0; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region.get(), ONIG_OPTION_NONE) >= 0) {
+                auto& match = matches.emplace_back();
+                match.reserve(region->num_regs);
+                for (int i = 0; i < region->num_regs; i++) {
+                    match.emplace_back(
+                        rt::fromLen(region->beg[i]),
+                        str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+                }
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+namespace detail {
+
+template<typename K>
+void region_to_spans(OnigRegion* region, MatchSpan* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (region->beg[i] == ONIG_REGION_NOTPOS) {
+            out[i] = MatchSpan{};
+        } else {
+            out[i] = MatchSpan{RexTraits<K>::fromLen(region->beg[i]), RexTraits<K>::fromLen(region->end[i])};
+        }
+    }
+}
+
+} // namespace detail
+
+template<typename K>
+size_t OnigRegexp<K>::first_match_into(str_type text, std::span<MatchSpan> groups, size_t offset) const {
+    if (isValid()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end());
+        OnigRegion* region = detail::thread_region();
+        if (search_first(start, end, start + rt::toLen(offset), region) >= 0) {
+            size_t found = size_t(region->num_regs);
+            detail::region_to_spans<K>(region, groups.data(), std::min(found, groups.size()));
+            return found;
+        }
+    }
+    return 0;
+}
+
+template<typename K>
+size_t OnigRegexp<K>::all_matches_into(str_type text, std::span<MatchSpan> out, size_t& count, size_t offset, size_t maxCount) const {
+    count = 0;
+    // В буфер меньше одного совпадения ничего не записать, а продолжение с той же позиции зациклило бы вызывающего.
+    if (isValid() && out.size() >= groups_count()) {
+        const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = start + rt::toLen(offset);
+        OnigRegion* region = detail::thread_region();
+        size_t stride = groups_count(), written = 0;
+        for (; count < maxCount; count++) {
+            if (onig_search(*this, start, end, at, end, region, ONIG_OPTION_NONE) >= 0) {
+                if (written + stride > out.size()) {
+                    return rt::fromLen(int(at - start));
+                }
+                detail::region_to_spans<K>(region, out.data() + written, stride);
+                written += stride;
+                const OnigUChar* newAt = start + region->end[0];
+                if (newAt <= at || newAt >= end) {
+                    count++;
+                    break;
+                }
+                at = newAt;
+            } else {
+                break;
+            }
+        }
+    }
+    return MatchSpan::npos;
+}
+
+template<typename K>
+std::vector<MatchSpan> OnigRegexp<K>::all_matches_segments(std::span<const str_type> segments, size_t window, size_t offset, size_t maxCount) const {
+    std::vector<MatchSpan> result;
+    if (!isValid() || !maxCount || segments.empty()) {
+        return result;
+    }
+    window = std::max<size_t>(window, 1);
+    // Начала кусков в общем тексте и зоны склейки вокруг границ. Между зонами склейки поиск идёт прямо по куску.
+    std::vector<size_t> starts;
+    starts.reserve(segments.size());
+    size_t total = 0;
+    for (const str_type& segment: segments) {
+        starts.push_back(total);
+        total += segment.length();
+    }
+    std::vector<std::pair<size_t, size_t>> zones;
+    for (size_t b: starts) {
+        if (b == 0 || b == total) {
+            continue;
+        }
+        size_t from = b > window ? b - window : 0, to = std::min(b + window, total);
+        if (!zones.empty() && from <= zones.back().second) {
+            zones.back().second = std::max(zones.back().second, to);
+        } else {
+            zones.emplace_back(from, to);
+        }
+    }
+    const size_t stride = groups_count();
+    OnigRegion* region = detail::thread_region();
+    std::basic_string<K> scratch;
+    size_t scratchZone = -1, zone = 0;
+    for (size_t pos = offset, count = 0; count < maxCount && pos <= total;) {
+        while (zone < zones.size() && (zones[zone].second < pos || (zones[zone].second == pos && pos < total))) {
+            zone++;
+        }
+        const K* base;
+        size_t baseLength, basePos, limit;
+        if (zone < zones.size() && zones[zone].first <= pos) {
+            // Зона склейки: копируем её вместе с окном контекста с каждой стороны.
+            basePos = zones[zone].first > window ? zones[zone].first - window : 0;
+            limit = zones[zone].second;
+            if (scratchZone != zone) {
+                scratchZone = zone;
+                scratch.clear();
+                size_t to = std::min(limit + window, total);
+                size_t seg = std::upper_bound(starts.begin(), starts.end(), basePos) - starts.begin() - 1;
+                for (size_t at = basePos; at < to; seg++) {
+                    size_t from = at - starts[seg], len = std::min(segments[seg].length() - from, to - at);
+                    scratch.append(segments[seg].symbols() + from, len);
+                    at += len;
+                }
+            }
+            base = scratch.data();
+            baseLength = scratch.length();
+        } else {
+            // Внутри куска, дальше window от его границ.
+            size_t seg = std::upper_bound(starts.begin(), starts.end(), pos) - starts.begin() - 1;
+            while (seg > 0 && starts[seg] == total) {
+                seg--;
+            }
+            base = segments[seg].symbols();
+            baseLength = segments[seg].length();
+            basePos = starts[seg];
+            limit = zone < zones.size() ? zones[zone].first : total;
+        }
+        const OnigUChar *start = rt::toChar(base), *end = start + rt::toLen(baseLength);
+        int found = onig_search(*this, start, end, start + rt::toLen(pos - basePos), end, region, ONIG_OPTION_NONE);
+        if (found < 0 || basePos + rt::fromLen(found) > limit || (basePos + rt::fromLen(found) == limit && limit < total)) {
+            if (limit >= total) {
+                break;
+            }
+            pos = limit;
+            continue;
+        }
+        if (size_t baseEnd = basePos + baseLength; baseEnd < total && basePos + rt::fromLen(region->end[0]) + window > baseEnd) {
+            // Вхождение дошло до края куска или окна: конец куска для движка - конец текста, и вхождение могло
+            // оборваться на нём, а $, \b и просмотр вперёд - сработать ложно. Ищем заново от pos во временном буфере,
+            // расширяя его, пока вхождение не окажется дальше window от его конца.
+            size_t from = pos > window ? pos - window : 0, to = std::min(total, basePos + rt::fromLen(region->end[0]) + 2 * window);
+            for (;;) {
+                scratch.clear();
+                scratchZone = -1;
+                size_t seg = std::upper_bound(starts.begin(), starts.end(), from) - starts.begin() - 1;
+                for (size_t at = from; at < to; seg++) {
+                    size_t segFrom = at - starts[seg], len = std::min(segments[seg].length() - segFrom, to - at);
+                    scratch.append(segments[seg].symbols() + segFrom, len);
+                    at += len;
+                }
+                start = rt::toChar(scratch.data());
+                end = start + rt::toLen(scratch.length());
+                found = onig_search(*this, start, end, start + rt::toLen(pos - from), end, region, ONIG_OPTION_NONE);
+                if (found >= 0 && to < total && from + rt::fromLen(region->end[0]) + window > to) {
+                    to = std::min(total, to + (to - from));
+                    continue;
+                }
+                break;
+            }
+            if (found < 0) {
+                if (to >= total) {
+                    break;
+                }
+                pos = to - window;
+                continue;
+            }
+            basePos = from;
+        }
+        size_t at = result.size();
+        result.resize(at + stride);
+        detail::region_to_spans<K>(region, result.data() + at, stride);
+        for (size_t i = at; i < at + stride; i++) {
+            if (result[i].matched()) {
+                result[i].begin += basePos;
+                result[i].end += basePos;
+            }
+        }
+        count++;
+        size_t newPos = result[at].end;
+        if (newPos <= pos || newPos >= total) {
+            break;
+        }
+        pos = newPos;
+    }
+    return result;
+}
+
+namespace detail {
+
+template<typename K>
+size_t find_newline(const K* text, size_t from, size_t length) {
+    const K* nl = std::char_traits<K>::find(text + from, length - from, K('\n'));
+    return nl ? size_t(nl - text) : length;
+}
+
+} // namespace detail
+
+template<typename K>
+size_t OnigRegexp<K>::for_grep_line(str_type text, const GrepOptions& options, void* res, void(*func)(const GrepLine<K>&, void*)) const {
+    if (!isValid() || !options.maxCount) {
+        return 0;
+    }
+    const K* symbols = text.symbols();
+    const size_t length = text.length();
+    const OnigUChar *start = rt::toChar(symbols), *end = rt::toChar(symbols + length);
+    size_t lineStart = 0, lineNumber = 1, countedTo = 0, found = 0;
+    // Позиция конца текста принадлежит последней строке, если текст не заканчивается переводом строки.
+    // После завершающего перевода строки строк нет, и пустое совпадение там не относится ни к одной строке.
+    const bool openLastLine = length && symbols[length - 1] != K('\n');
+
+    auto emit = [&](size_t from, size_t to) {
+        if (options.lineNumbers) {
+            lineNumber += size_t(std::count(symbols + countedTo, symbols + from, K('\n')));
+            countedTo = from;
+        }
+        func(GrepLine<K>{options.lineNumbers ? lineNumber : 0, from, str_type{symbols + from, to - from}}, res);
+        return ++found < options.maxCount;
+    };
+
+    while (lineStart < length) {
+        int r = onig_search(*this, start, end, start + rt::toLen(lineStart), end, nullptr, ONIG_OPTION_NONE);
+        size_t matchPos = r >= 0 ? std::min(rt::fromLen(r), length) : length;
+        const bool matched = r >= 0 && (matchPos < length || openLastLine);
+        if (options.invert) {
+            // Все строки до строки с совпадением - без совпадений.
+            while (lineStart < length) {
+                size_t lineEnd = detail::find_newline(symbols, lineStart, length);
+                if (matched && lineEnd >= matchPos) {
+                    lineStart = lineEnd + 1;
+                    break;
+                }
+                if (!emit(lineStart, lineEnd)) {
+                    return found;
+                }
+                lineStart = lineEnd + 1;
+            }
+        } else {
+            if (!matched) {
+                break;
+            }
+            size_t lineEnd = detail::find_newline(symbols, matchPos, length);
+            // Начало строки ищем назад от совпадения, но не дальше начала текущей позиции поиска.
+            size_t nl = std::basic_string_view<K>{symbols + lineStart, matchPos - lineStart}.rfind(K('\n'));
+            if (nl != std::basic_string_view<K>::npos) {
+                lineStart += nl + 1;
+            }
+            if (!emit(lineStart, lineEnd)) {
+                return found;
+            }
+            lineStart = lineEnd + 1;
+        }
+    }
+    return found;
+}
+
+template<typename K>
+void OnigRegexp<K>::extract_row(const OnigUChar* start, const OnigUChar* end, size_t base, ColumnarMatches& result) const {
+    size_t row = result.rows++;
+    if ((row % 64) == 0) {
+        result.unmatched.push_back(0);
+    }
+    OnigRegion* region = detail::thread_region();
+    if (onig_search(*this, start, end, start, end, region, ONIG_OPTION_NONE) >= 0) {
+        for (size_t i = 0; i < result.columns.size(); i++) {
+            MatchSpan& span = result.columns[i].emplace_back();
+            if (region->beg[i] != ONIG_REGION_NOTPOS) {
+                span.begin = base + rt::fromLen(region->beg[i]);
+                span.end = base + rt::fromLen(region->end[i]);
+            }
+        }
+    } else {
+        result.unmatched.back() |= uint64_t(1) << (row % 64);
+        for (auto& column: result.columns) {
+            column.emplace_back();
+        }
+    }
+}
+
+template<typename K>
+ColumnarMatches OnigRegexp<K>::extract_columns(str_type text, K separator) const {
+    ColumnarMatches result;
+    if (!isValid()) {
+        return result;
+    }
+    const K* symbols = text.symbols();
+    const size_t length = text.length();
+    size_t rows = size_t(std::count(symbols, symbols + length, separator)) + 1;
+    result.columns.resize(groups_count());
+    for (auto& column: result.columns) {
+        column.reserve(rows);
+    }
+    result.unmatched.reserve((rows + 63) / 64);
+    for (size_t lineStart = 0; lineStart < length;) {
+        const K* sep = std::char_traits<K>::find(symbols + lineStart, length - lineStart, separator);
+        size_t lineEnd = sep ? size_t(sep - symbols) : length;
+        extract_row(rt::toChar(symbols + lineStart), rt::toChar(symbols + lineEnd), lineStart, result);
+        lineStart = lineEnd + 1;
+    }
+    return result;
+}
+
+template<typename K>
+ColumnarMatches OnigRegexp<K>::extract_columns(std::span<const str_type> records) const {
+    ColumnarMatches result;
+    if (!isValid()) {
+        return result;
+    }
+    result.columns.resize(groups_count());
+    for (auto& column: result.columns) {
+        column.reserve(records.size());
+    }
+    result.unmatched.reserve((records.size() + 63) / 64);
+    for (const str_type& record: records) {
+        extract_row(rt::toChar(record.begin()), rt::toChar(record.end()), 0, result);
+    }
+    return result;
+}
+
+template<typename K>
+std::vector<GrepLine<K>> OnigRegexp<K>::grep_lines(str_type text, const GrepOptions& options) const {
+    std::vector<GrepLine<K>> lines;
+    for_grep_line(text, options, &lines, [](const GrepLine<K>& line, void* res) {
+        static_cast<std::vector<GrepLine<K>>*>(res)->push_back(line);
+    });
+    return lines;
+}
+
+template<typename K>
+std::vector<std::pair<int, simple_str<K>>> parse_replaces(simple_str<K> replText, bool substGroups) {
+    std::vector<std::pair<int, simple_str<K>>> replaces;
+    size_t dollar = -1;
+    if (!substGroups || (dollar = replText.find(K('$'))) == str::npos) {
+        replaces.emplace_back(-1, replText);
+    } else {
+        const K *start = replText.symbols(), *fnd = start + dollar, *startGroup = nullptr, *endRepl = start + replText.length();
+        int state = 0, numOfGroup = 0;
+        while (fnd < endRepl) {
+            switch (state) {
+            case 0:
+                startGroup = fnd;
+                state = 1;
+                break;
+            case 1:
+                if (*fnd == '{') {
+                    state = 2;
+                } else if (*fnd >= '0' && *fnd <= '9') {
+                    if (startGroup > start)
+                        replaces.emplace_back(-1, simple_str<K>{start, size_t(startGroup - start)});
+                    replaces.emplace_back(*fnd - '0', simple_str_nt<K>::empty_str);
+                    state = 0;
+                    start = fnd + 1;
+                } else if (*fnd == '$') {
+                    replaces.emplace_back(-1, simple_str<K>{start, size_t(fnd - start)});
+                    state = 0;
+                    start = fnd + 1;
+                } else {
+                    state = 0;
+                }
+                break;
+            case 2:
+                if (*fnd >= '0' && *fnd <= '9') {
+                    numOfGroup = *fnd - '0';
+                    state = 3;
+                } else {
+                    state = 0;
+                }
+                break;
+            case 3:
+                if (*fnd >= '0' && *fnd <= '9') {
+                    numOfGroup = numOfGroup * 10 + *fnd - '0';
+                } else if (*fnd == '}') {
+                    if (startGroup > start)
+                        replaces.emplace_back(-1, simple_str<K>{start, size_t(startGroup - start)});
+                    replaces.emplace_back(numOfGroup, simple_str_nt<K>::empty_str);
+                    state = 0;
+                    start = fnd + 1;
+                } else {
+                    state = 0;
+                }
+            }
+            fnd++;
+            if (state == 0) {
+                dollar = replText.find(K('$'), fnd - replText.str);
+                if (dollar == str::npos) {
+                    fnd = endRepl;
+                } else {
+                    fnd = replText.str + dollar;
+                }
+            }
+        }
+        if (fnd > start) {
+            replaces.emplace_back(-1, simple_str<K>{start, size_t(fnd - start)});
+        }
+    }
+    return replaces;
+}
+
+template<typename K>
+void OnigRegexp<K>::do_replace(str_type text, str_type replText, size_t offset, size_t maxCount, bool substGroups, void* res, repl_result_func func) const {
+    if (!regexp_) {
+        return;
+    }
+
+    auto replaces = parse_replaces(replText, substGroups);
+
+    std::vector<str_type> parts;
+    size_t delta = 0;
+    const OnigUChar *starto = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = starto + rt::toLen(offset),
+                    *prevStart = starto;
+    detail::RegionPtr region{onig_region_new()};
+    for (size_t count = 0; count < maxCount; count++) {
+        int result = onig_search(*this, starto, end, at, end, region.get(), ONIG_OPTION_NONE);
+        if (result >= 0) {
+            delta = rt::fromLen(int(starto + region->beg[0] - prevStart));
+            if (delta) {
+                parts.emplace_back(rt::fromChar(prevStart), delta);
+            }
+            for (const auto& [idx, text]: replaces) {
+                if (idx < 0) {
+                    parts.emplace_back(text);
+                } else if (idx < region->num_regs) {
+                    delta = rt::fromLen(region->end[idx] - region->beg[idx]);
+                    if (delta) {
+                        parts.emplace_back(rt::fromChar(starto + region->beg[idx]), delta);
+                    }
+                }
+            }
+            const OnigUChar* newAt = starto + region->end[0];
+            if (newAt <= at || at >= end) {
+                break;
+            }
+            at = prevStart = newAt;
+        } else {
+            break;
+        }
+    }
+    if (!parts.empty()) {
+        if (at < end) {
+            parts.emplace_back(rt::fromChar(at), rt::fromLen(int(end - at)));
+        }
+        func(parts, res);
+    }
+}
+
+template<typename K>
+std::vector<typename OnigRegexp<K>::str_type> OnigRegexp<K>::replace_parts(str_type text, std::span<const MatchSpan> matches, str_type replText, bool substGroups) const {
+    std::vector<str_type> parts;
+    const size_t stride = groups_count();
+    if (!stride || matches.size() < stride) {
+        return parts;
+    }
+    auto replaces = parse_replaces(replText, substGroups);
+    parts.reserve(matches.size() / stride * (replaces.size() + 1) + 1);
+    size_t last = 0;
+    for (size_t m = 0; m + stride <= matches.size(); m += stride) {
+        const MatchSpan* match = matches.data() + m;
+        if (match[0].begin > last) {
+            parts.emplace_back(text.symbols() + last, match[0].begin - last);
+        }
+        for (const auto& [idx, part]: replaces) {
+            if (idx < 0) {
+                parts.emplace_back(part);
+            } else if (size_t(idx) < stride && match[idx].matched() && match[idx].length()) {
+                parts.emplace_back(text.symbols() + match[idx].begin, match[idx].length());
+            }
+        }
+        last = match[0].end;
+    }
+    if (last < text.length()) {
+        parts.emplace_back(text.symbols() + last, text.length() - last);
+    }
+    return parts;
+}
+
+template<typename K>
+void OnigRegexp<K>::do_replace_parallel(str_type text, str_type replText, K separator, const ParallelOptions& options, bool substGroups, void* res, par_result_func func) const {
+    if (!regexp_) {
+        return;
+    }
+    unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    const size_t length = text.length();
+    const K* symbols = text.symbols();
+
+    // Границы частей - сразу после разделителя, ближайшего к равным долям текста.
+    std::vector<size_t> bounds{0};
+    size_t chunkSize = std::max(options.minChunk, length / threads + 1);
+    while (bounds.back() < length) {
+        size_t from = bounds.back() + chunkSize;
+        if (from >= length) {
+            bounds.push_back(length);
+            break;
+        }
+        const K* sep = std::char_traits<K>::find(symbols + from, length - from, separator);
+        bounds.push_back(sep ? size_t(sep - symbols) + 1 : length);
+    }
+    const size_t chunks = bounds.size() - 1;
+
+    std::vector<std::vector<str_type>> results(chunks);
+    std::vector<char> replaced(chunks, 0), fallback(chunks, 0);
+    auto replaces = parse_replaces(replText, substGroups);
+
+    auto process = [&](size_t idx) {
+        const OnigUChar *start = rt::toChar(symbols), *end = rt::toChar(symbols + length),
+                        *chunkStart = rt::toChar(symbols + bounds[idx]), *chunkEnd = rt::toChar(symbols + bounds[idx + 1]);
+        const OnigUChar *at = chunkStart, *prevStart = chunkStart;
+        std::vector<str_type>& parts = results[idx];
+        OnigRegion* region = detail::thread_region();
+        while (at < chunkEnd && onig_search(*this, start, end, at, chunkEnd, region, ONIG_OPTION_NONE) >= 0) {
+            const OnigUChar *matchBegin = start + region->beg[0], *matchEnd = start + region->end[0];
+            if (matchBegin >= chunkEnd) {
+                break;
+            }
+            if (matchEnd <= matchBegin || matchEnd > chunkEnd) {
+                fallback[idx] = 1;
+                return;
+            }
+            if (matchBegin > prevStart) {
+                parts.emplace_back(rt::fromChar(prevStart), rt::fromLen(int(matchBegin - prevStart)));
+            }
+            for (const auto& [group, text]: replaces) {
+                if (group < 0) {
+                    parts.emplace_back(text);
+                } else if (group < region->num_regs && region->end[group] > region->beg[group]) {
+                    parts.emplace_back(rt::fromChar(start + region->beg[group]), rt::fromLen(region->end[group] - region->beg[group]));
+                }
+            }
+            replaced[idx] = 1;
+            at = prevStart = matchEnd;
+        }
+        if (prevStart < chunkEnd) {
+            parts.emplace_back(rt::fromChar(prevStart), rt::fromLen(int(chunkEnd - prevStart)));
+        }
+    };
+
+    if (chunks > 1) {
+        std::vector<std::thread> workers;
+        workers.reserve(chunks - 1);
+        for (size_t idx = 1; idx < chunks; idx++) {
+            workers.emplace_back(process, idx);
+        }
+        process(0);
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    } else if (chunks) {
+        process(0);
+    }
+
+    if (std::find(fallback.begin(), fallback.end(), 1) != fallback.end()) {
+        std::pair<par_result_func, void*> call{func, res};
+        do_replace(text, replText, 0, -1, substGroups, &call, [](const std::vector<str_type>& parts, void* res) {
+            auto [func, result] = *static_cast<std::pair<par_result_func, void*>*>(res);
+            func(std::vector<std::vector<str_type>>{parts}, 1, result);
+        });
+        return;
+    }
+    if (std::find(replaced.begin(), replaced.end(), 1) != replaced.end()) {
+        func(results, threads, res);
+    }
+}
+
+template<typename K>
+void OnigRegexp<K>::place_parallel(const std::vector<std::vector<str_type>>& chunks, const std::vector<size_t>& offsets, K* dest, unsigned threads) {
+    auto copy = [&](size_t idx) {
+        K* p = dest + offsets[idx];
+        for (const auto& part: chunks[idx]) {
+            std::char_traits<K>::copy(p, part.symbols(), part.length());
+            p += part.length();
+        }
+    };
+    if (chunks.size() < 2 || threads < 2) {
+        for (size_t idx = 0; idx < chunks.size(); idx++) {
+            copy(idx);
+        }
+        return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(chunks.size() - 1);
+    for (size_t idx = 1; idx < chunks.size(); idx++) {
+        workers.emplace_back(copy, idx);
+    }
+    copy(0);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+template<typename K>
+OnigEncoding OnigRegexp<K>::rex_encoding() {
+    if constexpr (sizeof(K) == 2) {
+        return std::endian::native == std::endian::big ? ONIG_ENCODING_UTF16_BE : ONIG_ENCODING_UTF16_LE;
+    }
+    if constexpr (sizeof(K) == 4) {
+        return std::endian::native == std::endian::big ? ONIG_ENCODING_UTF32_BE : ONIG_ENCODING_UTF32_LE;
+    }
+    return ONIG_ENCODING_UTF8;
+}
+
+template<typename K>
+bool MultiReplacer<K>::add(str_type pattern, str_type replText, bool substGroups) {
+    RegexPtr regex{OnigRegexp<K>::create_regex(rt::toChar(pattern.symbols()), rt::toLen(pattern.length()), OnigRegexp<K>::rex_encoding())};
+    if (!regex) {
+        return false;
+    }
+    if (!regset_) {
+        OnigRegSet* regset = nullptr;
+        if (onig_regset_new(&regset, 0, nullptr) != ONIG_NORMAL) {
+            return false;
+        }
+        regset_.reset(regset);
+    }
+    if (onig_regset_add(regset_.get(), regex.get()) != ONIG_NORMAL) {
+        return false;
+    }
+    // Теперь регэксп принадлежит набору и будет освобождён вместе с ним.
+    regex.release();
+    Rule& rule = rules_.emplace_back();
+    rule.replText.assign(replText.begin(), replText.end());
+    rule.replaces = parse_replaces(str_type{rule.replText.data(), rule.replText.size()}, substGroups);
+    return true;
+}
+
+template<typename K>
+void MultiReplacer<K>::do_replace(str_type text, size_t offset, size_t maxCount, void* res, repl_result_func func) {
+    if (rules_.empty()) {
+        return;
+    }
+    std::vector<str_type> parts;
+    size_t delta = 0;
+    const OnigUChar *starto = rt::toChar(text.begin()), *end = rt::toChar(text.end()), *at = starto + rt::toLen(offset),
+                    *prevStart = starto;
+    for (size_t count = 0; count < maxCount; count++) {
+        int matchPos = 0;
+        int idx = onig_regset_search(regset_.get(), starto, end, at, end, ONIG_REGSET_POSITION_LEAD, ONIG_OPTION_NONE, &matchPos);
+        if (idx >= 0) {
+            OnigRegion* region = onig_regset_get_region(regset_.get(), idx);
+            delta = rt::fromLen(int(starto + region->beg[0] - prevStart));
+            if (delta) {
+                parts.emplace_back(rt::fromChar(prevStart), delta);
+            }
+            for (const auto& [group, text]: rules_[idx].replaces) {
+                if (group < 0) {
+                    parts.emplace_back(text);
+                } else if (group < region->num_regs) {
+                    delta = rt::fromLen(region->end[group] - region->beg[group]);
+                    if (delta) {
+                        parts.emplace_back(rt::fromChar(starto + region->beg[group]), delta);
+                    }
+                }
+            }
+            const OnigUChar* newAt = starto + region->end[0];
+            if (newAt <= at || at >= end) {
+                break;
+            }
+            at = prevStart = newAt;
+        } else {
+            break;
+        }
+    }
+    if (!parts.empty()) {
+        if (at < end) {
+            parts.emplace_back(rt::fromChar(at), rt::fromLen(int(end - at)));
+        }
+        func(parts, res);
+    }
+}
+
+template<typename K>
+void MatchIndex<K>::build(str_type text) {
+    spans_.clear();
+    rescan(text, 0, 0, 0);
+}
+
+template<typename K>
+MatchIndexUpdate MatchIndex<K>::edit(str_type text, size_t pos, size_t removed, size_t inserted) {
+    const size_t oldCount = size();
+    // Совпадения, которые вместе с просмотром за их конец заканчиваются до правки, не меняются.
+    size_t lo = 0, hi = oldCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (spans_[mid * groups_].end + lookAround_ < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t keep = lo;
+    if (keep) {
+        // Пустое совпадение в позиции начала поиска останавливает поиск, дальше ничего не изменится.
+        const MatchSpan& last = spans_[(keep - 1) * groups_];
+        if (last.begin == last.end && last.begin == (keep > 1 ? spans_[(keep - 2) * groups_].end : 0)) {
+            spans_.resize(keep * groups_);
+            return {keep, oldCount - keep, 0};
+        }
+    }
+    size_t tail = rescan(text, keep, pos + inserted, std::ptrdiff_t(inserted) - std::ptrdiff_t(removed));
+    return {keep, oldCount - keep - tail, size() - keep - tail};
+}
+
+template<typename K>
+size_t MatchIndex<K>::rescan(str_type text, size_t keep, size_t editEnd, std::ptrdiff_t delta) {
+    using rt = RexTraits<K>;
+    if (!regexp_->isValid()) {
+        spans_.clear();
+        return 0;
+    }
+    const size_t oldCount = size();
+    std::vector<MatchSpan> found;
+    const OnigUChar *start = rt::toChar(text.begin()), *end = rt::toChar(text.end()),
+        *at = start + rt::toLen(keep ? spans_[(keep - 1) * groups_].end : 0);
+    OnigRegion* region = detail::thread_region();
+    size_t old = keep, tail = 0;
+    MatchSpan* row = nullptr;
+    for (;;) {
+        if (onig_search(*regexp_, start, end, at, end, region, ONIG_OPTION_NONE) < 0) {
+            break;
+        }
+        found.resize(found.size() + groups_);
+        row = found.data() + found.size() - groups_;
+        detail::region_to_spans<K>(region, row, groups_);
+        if (row->begin >= editEnd + lookAround_) {
+            // Ищем старое совпадение, которое после сдвига встаёт на то же место.
+            while (old < oldCount && std::ptrdiff_t(spans_[old * groups_].begin) + delta < std::ptrdiff_t(row->begin)) {
+                old++;
+            }
+            bool same = old < oldCount;
+            for (size_t i = 0; same && i < groups_; i++) {
+                const MatchSpan& o = spans_[old * groups_ + i];
+                same = o.matched() ? row[i].begin == o.begin + delta && row[i].end == o.end + delta : !row[i].matched();
+            }
+            if (same) {
+                // Дальше поиск идёт по тому же тексту с той же позиции - остаток старых совпадений верен.
+                found.resize(found.size() - groups_);
+                tail = oldCount - old;
+                for (size_t i = old * groups_; i < spans_.size(); i++) {
+                    if (spans_[i].matched()) {
+                        spans_[i].begin += delta;
+                        spans_[i].end += delta;
+                    }
+                }
+                break;
+            }
+        }
+        const OnigUChar* newAt = start + region->end[0];
+        if (newAt <= at || newAt >= end) {
+            break;
+        }
+        at = newAt;
+    }
+    spans_.erase(spans_.begin() + keep * groups_, spans_.begin() + (oldCount - tail) * groups_);
+    spans_.insert(spans_.begin() + keep * groups_, found.begin(), found.end());
+    return tail;
+}
+
+} // namespace simrex
@@ -5,10 +5,23 @@
 #pragma once
 #include <simstr/sstring.h>
 #include <oniguruma.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
 
-#ifdef SIMREX_IN_SHARED
+#ifdef SIMREX_HEADER_ONLY
+    // Реализации подключаются в конце этого заголовка и компилируются в каждой единице трансляции.
+    #define SIMREX_API
+    #define SIMREX_INLINE inline
+#elif defined(SIMREX_IN_SHARED)
     #if defined(_MSC_VER) || (defined(__clang__) && __has_declspec_attribute(dllexport))
         #ifdef SIMREX_EXPORT
             #define SIMREX_API __declspec(dllexport)
@@ -24,6 +37,31 @@
     #define SIMREX_API
 #endif
 
+#ifndef SIMREX_INLINE
+    #define SIMREX_INLINE
+#endif
+
+// С опцией SIMREX_ONIG_ALLOCATOR перенаправление памяти oniguruma живёт в отдельной библиотеке simrex_onig_alloc,
+// от которой зависит и сама oniguruma, чтобы функции выделения и счётчики были в программе в одном экземпляре.
+// Без опции функции учёта памяти - заглушки из onig-inl.h, как и остальные реализации.
+#ifndef SIMREX_ONIG_ALLOCATOR
+    #define SIMREX_ALLOC_API SIMREX_API
+#elif defined(SIMREX_ALLOC_SHARED)
+    #ifdef _WIN32
+        #ifdef SIMREX_ALLOC_EXPORT
+            #define SIMREX_ALLOC_API __declspec(dllexport)
+        #else
+            #define SIMREX_ALLOC_API __declspec(dllimport)
+        #endif
+    #elif defined(__GNUC__) || defined(__GNUG__)
+        #define SIMREX_ALLOC_API __attribute__((visibility("default")))
+    #else
+        #define SIMREX_ALLOC_API
+    #endif
+#else
+    #define SIMREX_ALLOC_API
+#endif
+
 namespace simrex {
 using namespace simstr;
 using namespace simstr::literals;
@@ -34,6 +72,76 @@ struct OnigRexDeleter {
 
 using RegexPtr = std::unique_ptr<OnigRegexType, OnigRexDeleter>;
 
+struct OnigRegSetDeleter {
+    SIMREX_API void operator()(OnigRegSet* regset) const;
+};
+
+using RegSetPtr = std::unique_ptr<OnigRegSet, OnigRegSetDeleter>;
+
+namespace detail {
+struct MatchCache;
+} // namespace detail
+
+struct MatchCacheDeleter {
+    SIMREX_API void operator()(detail::MatchCache* cache) const;
+};
+
+/// Статистика кэша результатов поиска.
+struct MatchCacheStats {
+    /// Количество поисков, результат которых взят из кэша.
+    size_t hits = 0;
+    /// Количество поисков, выполненных движком.
+    size_t misses = 0;
+    /// Текущее количество записей в кэше.
+    size_t size = 0;
+    /// Максимальное количество записей в кэше.
+    size_t capacity = 0;
+
+    double hit_rate() const {
+        return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+    }
+};
+
+/*!
+ * @brief Функции выделения памяти для внутренних структур oniguruma: скомпилированных программ, регионов, стека поиска.
+ * @details Функции вызываются из любых потоков и должны быть потокобезопасны.
+ */
+struct OnigAllocator {
+    void* (*allocate)(size_t size, void* context) = nullptr;
+    void* (*reallocate)(void* ptr, size_t size, void* context) = nullptr;
+    void (*deallocate)(void* ptr, void* context) = nullptr;
+    /// Передаётся во все функции, например, арена или счётчик арендатора.
+    void* context = nullptr;
+};
+
+/// Учёт памяти, выделенной oniguruma.
+struct OnigMemoryStats {
+    /// Сейчас выделено байт.
+    size_t bytes = 0;
+    /// Сейчас выделено блоков.
+    size_t blocks = 0;
+    /// Наибольшее значение bytes.
+    size_t peak = 0;
+    /// Выделено минус освобождено в текущем потоке. Разность двух значений - сколько памяти осталось занято
+    /// после действия в этом потоке. Отрицательно, если поток освободил больше, чем выделил, например,
+    /// удалил регэкспы, скомпилированные в других потоках.
+    ptrdiff_t thread = 0;
+};
+
+/*!
+ * @brief Направить выделение памяти oniguruma в заданные функции.
+ * @param allocator - функции выделения памяти. Пустые функции - вернуть malloc, realloc и free.
+ * @return bool - false, если oniguruma собрана без перенаправления памяти (опция CMake SIMREX_ONIG_ALLOCATOR),
+ *      уже есть выделенные oniguruma блоки, которые надо было бы освободить прежними функциями, или функции
+ *      в этот момент меняются из другого потока.
+ * @details Вызывать до создания регэкспов. Выделения, начатые во время замены, ждут её окончания.
+ *      Учёт памяти onig_memory_stats ведётся при любых функциях.
+ */
+SIMREX_ALLOC_API bool set_onig_allocator(const OnigAllocator& allocator);
+
+/// Получить учёт памяти, выделенной oniguruma. Без перенаправления памяти (SIMREX_ONIG_ALLOCATOR) все значения нулевые.
+SIMREX_ALLOC_API OnigMemoryStats onig_memory_stats();
+
 class OnigRegExpBase {
 public:
     OnigRegExpBase(const OnigRegExpBase&) = delete;
@@ -47,19 +155,308 @@ public:
         return (bool)regexp_;
     }
 
+    /*!
+     * @brief Включить кэш результатов поиска первого вхождения.
+     * @param capacity - максимальное количество запоминаемых текстов, 0 - выключить кэш.
+     * @param maxTextLength - тексты длиннее этого (в байтах) не кэшируются.
+     * @details Кэш запоминает для текста и начальной позиции положения вхождения и подгрупп (или отсутствие
+     *      вхождения), и при повторном поиске по такому же тексту возвращает их без запуска движка, за время
+     *      вычисления хэша текста. Используется в search, first_founded, first_match, texts_in_first_match и
+     *      first_match_into. Кэш хранит копии текстов, поэтому расход памяти пропорционален их суммарной длине.
+     *      Поиск с кэшем можно одновременно выполнять из разных потоков, но вызов enable_cache не должен идти
+     *      одновременно с поиском: включать и выключать кэш надо до того, как объект стал доступен другим потокам.
+     *      Для OnigRegexpShared кэш задаётся при создании хэндла. Вытеснение - по давности использования.
+     */
+    SIMREX_API void enable_cache(size_t capacity, size_t maxTextLength = 4096);
+
+    /// Получить статистику кэша результатов поиска.
+    SIMREX_API MatchCacheStats cache_stats() const;
+
+    /*!
+     * @brief Память, занятая скомпилированной программой регэкспа.
+     * @return size_t - байты, оставшиеся выделенными oniguruma после компиляции шаблона, без кэша результатов.
+     *      0, если oniguruma собрана без перенаправления памяти (опция CMake SIMREX_ONIG_ALLOCATOR).
+     * @details Глобальные таблицы, которые oniguruma создаёт при первом использовании кодировки, сюда не входят.
+     *      Таблицы, которые строятся при первом использовании отдельных возможностей шаблонов (например,
+     *      имён свойств Unicode), учитываются в регэкспе, который первым их задействовал.
+     */
+    size_t memory_usage() const {
+        return memory_;
+    }
+
 protected:
     OnigRegExpBase() = default;
-    OnigRegExpBase(const OnigUChar* pattern, size_t length, OnigEncoding enc) : regexp_{create_regex(pattern, length, enc)} {}
+    OnigRegExpBase(const OnigUChar* pattern, size_t length, OnigEncoding enc) : regexp_{create_regex(pattern, length, enc, &memory_)} {}
 
-    SIMREX_API static OnigRegex create_regex(const OnigUChar* pattern, size_t length, OnigEncoding enc);
+    // Если memory не nullptr, в него записывается размер памяти скомпилированной программы.
+    SIMREX_API static OnigRegex create_regex(const OnigUChar* pattern, size_t length, OnigEncoding enc, size_t* memory = nullptr);
 
     OnigRegExpBase(OnigRegExpBase&& other) noexcept = default;
     ~OnigRegExpBase() = default;
     OnigRegExpBase& operator=(OnigRegExpBase&& other) noexcept = default;
 
     SIMREX_API int search(const OnigUChar* start, size_t length, size_t offset) const;
+    // Поиск от конца текста к началу.
+    SIMREX_API int search_backward(const OnigUChar* start, size_t length, OnigRegion* region) const;
+    // Поиск первого вхождения с учётом кэша. Если region == nullptr, используется регион потока.
+    SIMREX_API int search_first(const OnigUChar* start, const OnigUChar* end, const OnigUChar* at, OnigRegion* region) const;
 
+    // Объявлен до regexp_, чтобы инициализироваться раньше, чем create_regex запишет в него размер.
+    size_t memory_ = 0;
     RegexPtr regexp_;
+    std::unique_ptr<detail::MatchCache, MatchCacheDeleter> cache_;
+};
+
+/// Уровень риска катастрофического перебора при поиске по регулярному выражению.
+enum class RexRisk : unsigned char {
+    None,        ///< Опасных конструкций не найдено.
+    Polynomial,  ///< На подобранном тексте время поиска растёт полиномиально от длины текста.
+    Exponential, ///< На подобранном тексте время поиска растёт экспоненциально от длины текста.
+};
+
+/// Вид найденной опасной конструкции.
+enum class RexRiskKind : unsigned char {
+    NestedQuantifier,       ///< Вложенные неограниченные повторения, например `(a+)+`.
+    OverlappingAlternation, ///< Повторение пересекающихся альтернатив, например `(a|aa)*`.
+    AdjacentQuantifiers,    ///< Идущие друг за другом пересекающиеся повторения, например `\d+\d+`.
+};
+
+/// Описание одной опасной конструкции в шаблоне.
+struct RexRiskFinding {
+    RexRisk risk;
+    RexRiskKind kind;
+    /// Позиция квантификатора в шаблоне, в символах.
+    size_t pos;
+};
+
+/// Результат анализа шаблона на риск катастрофического перебора.
+struct RexRiskReport {
+    /// Наибольший риск среди найденных конструкций.
+    RexRisk risk = RexRisk::None;
+    /// false, если шаблон не удалось разобрать или он слишком сложен для полного анализа.
+    bool complete = true;
+    std::vector<RexRiskFinding> findings;
+};
+
+/// Положение вхождения или подгруппы в тексте, в символах.
+struct MatchSpan {
+    static constexpr size_t npos = size_t(-1);
+    /// Начало, npos - если подгруппа не участвовала в совпадении.
+    size_t begin = npos;
+    /// Конец (позиция за последним символом).
+    size_t end = npos;
+
+    bool matched() const {
+        return begin != npos;
+    }
+    size_t length() const {
+        return end - begin;
+    }
+};
+
+/*!
+ * @brief Перевод позиций в кодовых единицах (байтах UTF-8, 16-битных единицах UTF-16) в позиции в символах.
+ * @tparam K - тип символов. Для символов размером 4 байта позиции совпадают.
+ * @details Помнит последнюю переведённую позицию и считает символы только между ней и новой позицией,
+ *      поэтому перевод возрастающих позиций, например, всех вхождений по порядку, занимает линейное время
+ *      от длины текста.
+ */
+template<typename K>
+class CodePointCounter {
+public:
+    CodePointCounter(simple_str<K> text) : text_(text.symbols()) {}
+
+    /// Количество символов в тексте до позиции pos в кодовых единицах.
+    size_t to_cp(size_t pos) {
+        if (pos >= unit_) {
+            cp_ += count(text_ + unit_, text_ + pos);
+        } else {
+            cp_ -= count(text_ + pos, text_ + unit_);
+        }
+        unit_ = pos;
+        return cp_;
+    }
+
+    /// Количество символов в диапазоне кодовых единиц [from, to).
+    static size_t count(const K* from, const K* to) {
+        if constexpr (sizeof(K) == 1) {
+            size_t result = 0;
+            for (; from < to; from++) {
+                result += (static_cast<unsigned char>(*from) & 0xC0) != 0x80;
+            }
+            return result;
+        } else if constexpr (sizeof(K) == 2) {
+            size_t result = 0;
+            for (; from < to; from++) {
+                result += (static_cast<uint16_t>(*from) & 0xFC00) != 0xDC00;
+            }
+            return result;
+        } else {
+            return size_t(to - from);
+        }
+    }
+
+protected:
+    const K* text_;
+    size_t unit_ = 0;
+    size_t cp_ = 0;
+};
+
+/*!
+ * @brief Выборочный индекс текста для перевода позиций между кодовыми единицами и символами в произвольном порядке.
+ * @tparam K - тип символов.
+ * @details Хранит количество символов перед каждой step-той кодовой единицей, поэтому перевод любой позиции
+ *      просматривает не больше step кодовых единиц. Индекс можно строить один раз для текста и переиспользовать.
+ */
+template<typename K>
+class CodePointIndex {
+public:
+    /*!
+     * @brief Построить индекс.
+     * @param text - текст. Должен жить, пока используется индекс.
+     * @param step - шаг выборки в кодовых единицах.
+     */
+    CodePointIndex(simple_str<K> text, size_t step = 256) : text_(text), step_(std::max<size_t>(step, 1)) {
+        samples_.reserve(text.length() / step_ + 1);
+        size_t cp = 0;
+        for (size_t pos = 0; pos <= text.length(); pos += step_) {
+            samples_.push_back(cp);
+            cp += CodePointCounter<K>::count(text.symbols() + pos, text.symbols() + std::min(pos + step_, text.length()));
+        }
+    }
+
+    /// Количество символов в тексте до позиции pos в кодовых единицах.
+    size_t to_cp(size_t pos) const {
+        pos = std::min(pos, text_.length());
+        size_t sample = pos / step_;
+        return samples_[sample] + CodePointCounter<K>::count(text_.symbols() + sample * step_, text_.symbols() + pos);
+    }
+
+    /// Позиция в кодовых единицах начала символа с номером cp, или длина текста, если символов меньше.
+    size_t to_unit(size_t cp) const {
+        size_t sample = std::upper_bound(samples_.begin(), samples_.end(), cp) - samples_.begin() - 1;
+        size_t pos = sample * step_, cur = samples_[sample];
+        for (; pos < text_.length(); pos++) {
+            if (CodePointCounter<K>::count(text_.symbols() + pos, text_.symbols() + pos + 1)) {
+                if (cur == cp) {
+                    break;
+                }
+                cur++;
+            }
+        }
+        return pos;
+    }
+
+protected:
+    simple_str<K> text_;
+    size_t step_;
+    std::vector<size_t> samples_;
+};
+
+/// Параметры параллельной замены OnigRegexp::replace_parallel.
+struct ParallelOptions {
+    /// Количество потоков, 0 - по количеству ядер.
+    unsigned threads = 0;
+    /// Минимальный размер части текста в символах. Тексты короче обрабатываются в одном потоке.
+    size_t minChunk = 65536;
+};
+
+/// Параметры построчного поиска OnigRegexp::grep_lines.
+struct GrepOptions {
+    /// Выдавать строки, в которых нет совпадений.
+    bool invert = false;
+    /// Максимальное количество выдаваемых строк.
+    size_t maxCount = size_t(-1);
+    /// Вычислять номера строк. Без этого GrepLine::number не заполняется.
+    bool lineNumbers = false;
+};
+
+/// Строка текста, найденная OnigRegexp::grep_lines.
+template<typename K>
+struct GrepLine {
+    /// Номер строки, начиная с 1, или 0, если номера не запрошены.
+    size_t number;
+    /// Позиция начала строки в тексте.
+    size_t pos;
+    /// Текст строки без завершающего перевода строки.
+    simple_str<K> text;
+};
+
+/// Текстовая колонка: тексты всех строк подряд в одном буфере и смещения их начал.
+template<typename K>
+struct StringColumn {
+    /// Тексты всех строк колонки подряд.
+    std::vector<K> arena;
+    /// Смещения начала текста каждой строки в arena, плюс завершающее смещение конца.
+    std::vector<size_t> offsets;
+
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+    simple_str<K> operator[](size_t row) const {
+        return {arena.data() + offsets[row], offsets[row + 1] - offsets[row]};
+    }
+};
+
+/*!
+ * @brief Результат извлечения полей по колонкам, OnigRegexp::extract_columns.
+ * @details Для каждой группы (0 - всё вхождение, далее подгруппы) - своя колонка с положением группы
+ *      в каждой строке. Строки без совпадения отмечаются в битовой карте unmatched, их положения пустые.
+ */
+struct ColumnarMatches {
+    /// Количество строк.
+    size_t rows = 0;
+    /// columns[group][row] - положение группы в строке row.
+    std::vector<std::vector<MatchSpan>> columns;
+    /// Битовая карта строк без совпадения, бит row % 64 в элементе row / 64.
+    std::vector<uint64_t> unmatched;
+
+    bool matched(size_t row) const {
+        return !(unmatched[row / 64] & (uint64_t(1) << (row % 64)));
+    }
+
+    /*!
+     * @brief Скопировать тексты колонки в один буфер.
+     * @param text - текст, из которого извлекались поля.
+     * @param column - номер колонки.
+     * @return StringColumn<K> - тексты колонки. Для строк без совпадения и неучаствовавших групп - пустые.
+     */
+    template<typename K>
+    StringColumn<K> string_column(simple_str<K> text, size_t column) const {
+        return make_string_column<K>(column, [&](size_t) { return text; });
+    }
+    /*!
+     * @brief Скопировать тексты колонки в один буфер.
+     * @param records - записи, из которых извлекались поля.
+     * @param column - номер колонки.
+     * @return StringColumn<K> - тексты колонки. Для строк без совпадения и неучаствовавших групп - пустые.
+     */
+    template<typename K>
+    StringColumn<K> string_column(std::span<const simple_str<K>> records, size_t column) const {
+        return make_string_column<K>(column, [&](size_t row) { return records[row]; });
+    }
+
+protected:
+    template<typename K>
+    StringColumn<K> make_string_column(size_t column, auto source) const {
+        StringColumn<K> result;
+        const std::vector<MatchSpan>& spans = columns[column];
+        size_t total = 0;
+        for (const MatchSpan& span: spans) {
+            total += span.matched() ? span.length() : 0;
+        }
+        result.arena.reserve(total);
+        result.offsets.reserve(rows + 1);
+        result.offsets.push_back(0);
+        for (size_t row = 0; row < rows; row++) {
+            if (spans[row].matched()) {
+                simple_str<K> from = source(row);
+                result.arena.insert(result.arena.end(), from.symbols() + spans[row].begin, from.symbols() + spans[row].end);
+            }
+            result.offsets.push_back(result.arena.size());
+        }
+        return result;
+    }
 };
 
 template<typename K>
@@ -78,9 +475,15 @@ struct RexTraits {
     }
 };
 
+template<typename K>
+class MultiReplacer;
+
 /*!
  * @brief Класс для работы с oniguruma регэкспами
  * @tparam K - тип символов
+ * @details Все const методы не изменяют скомпилированное регулярное выражение, а для каждого вызова создают
+ *      свои данные поиска, поэтому один объект можно одновременно использовать для поиска из разных потоков.
+ *      Для совместного владения одним регэкспом из нескольких потоков удобно использовать OnigRegexpShared.
  */
 template<typename K>
 class OnigRegexp : public OnigRegExpBase {
@@ -102,15 +505,40 @@ public:
      */
     OnigRegexp(str_type pattern) : OnigRegExpBase(rt::toChar(pattern.symbols()), rt::toLen(pattern.length()), rex_encoding()) {}
 
+    /*!
+     * @brief Создает объект Onig Regexp с предварительным анализом шаблона на риск катастрофического перебора.
+     * @param pattern - регулярное выражение.
+     * @param report - сюда записывается результат анализа шаблона.
+     * @param maxRisk - максимально допустимый риск. Если шаблон опаснее, он не компилируется и объект остаётся невалидным.
+     */
+    OnigRegexp(str_type pattern, RexRiskReport& report, RexRisk maxRisk = RexRisk::Polynomial) {
+        report = analyze_risk(pattern);
+        if (report.risk <= maxRisk) {
+            regexp_.reset(create_regex(rt::toChar(pattern.symbols()), rt::toLen(pattern.length()), rex_encoding(), &memory_));
+        }
+    }
+
     OnigRegexp& operator=(OnigRegexp&& other) noexcept = default;
 
+    /*!
+     * @brief Статический анализ шаблона на риск катастрофического перебора (ReDoS).
+     * @param pattern - регулярное выражение.
+     * @return RexRiskReport - найденные опасные конструкции и общий уровень риска.
+     * @details Шаблон разбирается в автомат Глушкова, в котором ищутся неоднозначности: два разных пути
+     *      по одному и тому же тексту, замыкающиеся в цикл (экспоненциальный риск), или два последовательных цикла,
+     *      которые могут совпасть с одним и тем же текстом (полиномиальный риск). Анализ консервативен:
+     *      атомарные группы и possessive квантификаторы считаются обычными, ограниченные повторения с большой
+     *      верхней границей - неограниченными.
+     */
+    SIMREX_API static RexRiskReport analyze_risk(str_type pattern);
+
     /*!
      * @brief Поиск положения первого вхождения.
      * @param text - текст, в котором ищем.
      * @param offset -  начальная позиция поиска (по умолчанию 0).
      * @return size_t - позицию найденного вхождения, -1, если не найдено.
      */
-    size_t search(str_type text, size_t offset = 0) {
+    size_t search(str_type text, size_t offset = 0) const {
         int res = OnigRegExpBase::search(rt::toChar(text.symbols()), rt::toLen(text.length()), rt::toLen(offset));
         return res < 0 ? (size_t)res : rt::fromLen(res);
     }
@@ -121,7 +549,7 @@ public:
      * @param offset -  начальная позиция поиска (по умолчанию 0).
      * @return количество найденных вхождений.
      */
-    SIMREX_API size_t count_of(const str_type& text, size_t maxCount = -1, size_t offset = 0);
+    SIMREX_API size_t count_of(const str_type& text, size_t maxCount = -1, size_t offset = 0) const;
     /*!
      * @brief Текст первого найденного вхождения.
      * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
@@ -133,6 +561,41 @@ public:
     T first_founded(str_type text, size_t offset = 0) const {
         return first_founded_str(text, offset);
     }
+    /*!
+     * @brief Поиск положения последнего вхождения, поиск идёт от конца текста к началу.
+     * @param text - текст, в котором ищем.
+     * @param before - позиция, до которой ищется вхождение (по умолчанию - конец текста). Поиск ведётся в тексте
+     *      до этой позиции, так что вхождение заканчивается не дальше before.
+     * @return size_t - позицию найденного вхождения, -1, если не найдено.
+     * @details Возвращает наибольшую позицию, с которой начинается вхождение, а не начало последнего из вхождений,
+     *      которые выдаёт all_founded. Например, для `a+` в тексте "xaaa" all_founded найдёт "aaa" в позиции 1,
+     *      а search_last - "a" в позиции 3.
+     *      Движок проверяет позиции от before к началу и останавливается на первой подходящей, поэтому
+     *      поиск последнего вхождения в конце большого текста не просматривает весь текст.
+     */
+    size_t search_last(str_type text, size_t before = -1) const {
+        int res = OnigRegExpBase::search_backward(rt::toChar(text.symbols()), rt::toLen(std::min(before, text.length())), nullptr);
+        return res < 0 ? (size_t)res : rt::fromLen(res);
+    }
+    /*!
+     * @brief Текст последнего найденного вхождения, поиск идёт от конца текста к началу.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param text - текст, в котором ищем.
+     * @param before - позиция, до которой ищется вхождение (по умолчанию - конец текста).
+     * @return T - текст найденного вхождения, или пустую строку, если не найдено.
+     */
+    template<StrType<K> T = str_type>
+    T last_founded(str_type text, size_t before = -1) const {
+        return last_founded_str(text, before);
+    }
+    /*!
+     * @brief Получить всю информацию о последнем найденном вхождении, поиск идёт от конца текста к началу.
+     * @param text - текст, в котором ищем.
+     * @param before - позиция, до которой ищется вхождение (по умолчанию - конец текста).
+     * @return std::vector<std::pair<size_t, simple_str<K>>> - массив, в котором первый элемент описывает всё вхождение,
+     *      а следующие - подгруппы вхождения, так же, как в first_match.
+     */
+    SIMREX_API std::vector<std::pair<size_t, str_type>> last_match(str_type text, size_t before = -1) const;
     /*!
      * @brief Получить тексты всех найденных вхождений, без разделения на подгруппы.
      * @param text - текст, в котором ищем.
@@ -287,81 +750,637 @@ public:
     }
 
     /*!
-     * @brief Заменить вхождения на заданный текст.
-     * @tparam U - тип исходного текста, выводится из аргумента.
-     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
-     * @param text - исходный текст, в котором ищем.
-     * @param replText - текст, которым заменять найденные вхождения.
+     * @brief Получить всю информацию о первом найденном вхождении с позициями в символах.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска в кодовых единицах (по умолчанию 0).
+     * @return std::vector<std::pair<size_t, simple_str<K>>> - как в first_match, но позиции отсчитываются в символах,
+     *      а не в кодовых единицах. Для не участвовавшей в совпадении подгруппы позиция равна MatchSpan::npos.
+     */
+    std::vector<std::pair<size_t, str_type>> first_match_cp(str_type text, size_t offset = 0) const {
+        std::pair<CodePointCounter<K>, std::vector<std::pair<size_t, str_type>>> ctx{text, {}};
+        for_first_match(text, offset, &ctx, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            auto& [counter, match] = *static_cast<std::pair<CodePointCounter<K>, std::vector<std::pair<size_t, str_type>>>*>(res);
+            add_cp_groups(counter, region, start, match);
+        });
+        return std::move(ctx.second);
+    }
+    /*!
+     * @brief Получить всю информацию о всех найденных вхождениях с позициями в символах.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска в кодовых единицах (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::vector<std::vector<std::pair<size_t, simple_str<K>>>> - как в all_matches, но позиции отсчитываются
+     *      в символах. Для не участвовавшей в совпадении подгруппы позиция равна MatchSpan::npos.
+     * @details Позиции переводятся по ходу поиска через CodePointCounter, поэтому общее время линейно от длины текста.
+     */
+    std::vector<std::vector<std::pair<size_t, str_type>>> all_matches_cp(str_type text, size_t offset = 0, size_t maxCount = -1) const {
+        std::pair<CodePointCounter<K>, std::vector<std::vector<std::pair<size_t, str_type>>>> ctx{text, {}};
+        for_all_match(text, offset, maxCount, &ctx, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            auto& [counter, matches] = *static_cast<std::pair<CodePointCounter<K>, std::vector<std::vector<std::pair<size_t, str_type>>>>*>(res);
+            add_cp_groups(counter, region, start, matches.emplace_back());
+        });
+        return std::move(ctx.second);
+    }
+
+    /*!
+     * @brief Количество групп в каждом совпадении - всё вхождение плюс подгруппы.
+     * @return size_t - количество элементов MatchSpan, записываемых на одно совпадение, 0 для невалидного регэкспа.
+     */
+    size_t groups_count() const {
+        return isValid() ? size_t(onig_number_of_captures(*this)) + 1 : 0;
+    }
+
+    /*!
+     * @brief Записать положения первого найденного вхождения и его подгрупп в буфер вызывающего.
+     * @param text - текст, в котором ищем.
+     * @param groups - буфер для результата. В первый элемент записывается всё вхождение, далее подгруппы.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @return size_t - количество групп в совпадении, 0 если не найдено. Если результат больше размера буфера,
+     *      записаны только первые groups.size() групп.
+     * @details Не выделяет память при повторных вызовах в одном потоке.
+     */
+    SIMREX_API size_t first_match_into(str_type text, std::span<MatchSpan> groups, size_t offset = 0) const;
+
+    /*!
+     * @brief Записать положения всех найденных вхождений и их подгрупп в буфер вызывающего.
+     * @param text - текст, в котором ищем.
+     * @param out - буфер для результата. Каждое совпадение занимает groups_count() элементов подряд:
+     *      всё вхождение, затем подгруппы. Буфер должен вмещать хотя бы одно совпадение, иначе поиск не выполняется.
+     * @param count - сюда записывается количество совпадений, помещённых в буфер.
      * @param offset -  начальная позиция поиска (по умолчанию 0).
      * @param maxCount - максимальное количество для ограничения поиска.
-     * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп.
-     * @return текст, полученный из исходного текста заменой найденных вхождений на заданный шаблон.
-     *      При substGroups == true, в шаблоне помимо постоянного текста можно указывать номера подгрупп, вместо них будут
-     *      вставлены найденные подгруппы:
-     *      $N - подгруппы от 0 до 9 ($1, $2 и т.п.).
-     *      ${NNN} - подгруппы от 0 до N (${10}, ${12} и т.п.).
-     *      $$ - вставляет один $.
-     *      $Любые другие варианты - вставляются как есть.
+     * @return size_t - позиция, с которой надо продолжить поиск, если буфер закончился раньше, чем совпадения,
+     *      или MatchSpan::npos, если поиск завершён или буфер меньше groups_count().
+     * @details Не выделяет память при повторных вызовах в одном потоке. Пример цикла с продолжением:
+     *      @code
+     *      std::array<MatchSpan, 64> buf;
+     *      for (size_t count, at = 0; at != MatchSpan::npos;) {
+     *          at = rex.all_matches_into(text, buf, count, at);
+     *          // обработать count совпадений
+     *      }
+     *      @endcode
      */
-    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
-    T replace(U&& text, str_type replText, size_t offset = 0, size_t maxCount = -1, bool substGroups = true) const {
-        std::optional<T> result;
-        do_replace(text, replText, offset, maxCount, substGroups, &result, [](const std::vector<str_type>& parts, void* res) {
-            std::optional<T>& result = *static_cast<std::optional<T>*>(res);
-            result = expr_join<K, std::vector<str_type>, 0, false, false>{parts, nullptr};
+    SIMREX_API size_t all_matches_into(str_type text, std::span<MatchSpan> out, size_t& count, size_t offset = 0, size_t maxCount = -1) const;
+
+    /*!
+     * @brief Найти все вхождения в тексте, составленном из нескольких кусков, не склеивая текст целиком.
+     * @param segments - куски текста в порядке следования.
+     * @param window - размер окна вокруг границ кусков в символах. Вхождение, пересекающее границу, находится так же,
+     *      как в склеенном тексте, если оно вместе с проверяемым контекстом (просмотр вперёд и назад, \\b) не длиннее window.
+     * @param offset -  начальная позиция поиска в общем тексте (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::vector<MatchSpan> - по groups_count() элементов на совпадение: всё вхождение, затем подгруппы.
+     *      Положения отсчитываются от начала общего текста.
+     * @details Вдали от границ поиск идёт прямо по памяти кусков, а во временный буфер копируется только окно
+     *      вокруг каждой границы. Если куски короче окна, соседние окна сливаются. Вхождение, которое доходит
+     *      до края куска или окна, ищется заново в буфере, расширяемом до его конца, поэтому длинные вхождения
+     *      не обрываются на границах.
+     */
+    SIMREX_API std::vector<MatchSpan> all_matches_segments(std::span<const str_type> segments, size_t window = 256, size_t offset = 0, size_t maxCount = -1) const;
+    /*!
+     * @brief Поиск положения первого вхождения в тексте, составленном из нескольких кусков.
+     * @param segments - куски текста в порядке следования.
+     * @param window - размер окна вокруг границ кусков в символах, как в all_matches_segments.
+     * @param offset -  начальная позиция поиска в общем тексте (по умолчанию 0).
+     * @return size_t - позиция вхождения в общем тексте, или -1 если не найдено.
+     */
+    size_t search_segments(std::span<const str_type> segments, size_t window = 256, size_t offset = 0) const {
+        std::vector<MatchSpan> found = all_matches_segments(segments, window, offset, 1);
+        return found.empty() ? MatchSpan::npos : found[0].begin;
+    }
+
+    /*!
+     * @brief Получить тексты только выбранных групп первого найденного вхождения.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param text - текст, в котором ищем.
+     * @param groups - номера нужных групп, 0 - всё вхождение.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @return std::vector<T> - тексты групп в порядке groups, пустой массив, если не найдено. Для не участвовавшей
+     *      в совпадении или несуществующей группы - пустая строка.
+     */
+    template<StrType<K> T = str_type>
+    std::vector<T> groups_in_first_match(str_type text, std::span<const unsigned> groups, size_t offset = 0) const {
+        std::pair<std::span<const unsigned>, std::vector<T>> ctx{groups, {}};
+        for_first_match(text, offset, &ctx, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            auto& [groups, match] = *static_cast<std::pair<std::span<const unsigned>, std::vector<T>>*>(res);
+            match.reserve(groups.size());
+            for (unsigned g: groups) {
+                match.emplace_back(group_text(region, start, g));
+            }
         });
-        if (!result) {
-            return text;
-        }
-        return std::move(result).value();
+        return std::move(ctx.second);
     }
     /*!
-     * @brief Заменить вхождения на текст, возвращаемый из функции обработчика.
-     * @tparam U - тип исходного текста, выводится из аргумента.
-     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
-     * @param text - исходный текст, в котором ищем.
-     * @param replacer - функция, получающая информацию о вхождении и возвращающая текст, которым будет заменено вхождение.
+     * @brief Получить тексты выбранных групп первого найденного вхождения, номера групп задаются при компиляции.
+     * @tparam G - номера нужных групп, 0 - всё вхождение.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @return std::optional<std::array<simple_str<K>, sizeof...(G)>> - тексты групп в порядке G, или std::nullopt, если не найдено.
+     */
+    template<unsigned... G>
+    std::optional<std::array<str_type, sizeof...(G)>> groups_in_first_match(str_type text, size_t offset = 0) const {
+        std::optional<std::array<str_type, sizeof...(G)>> match;
+        for_first_match(text, offset, &match, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            static_cast<std::optional<std::array<str_type, sizeof...(G)>>*>(res)->emplace(std::array<str_type, sizeof...(G)>{group_text(region, start, G)...});
+        });
+        return match;
+    }
+    /*!
+     * @brief Получить тексты только выбранных групп всех найденных вхождений.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param text - текст, в котором ищем.
+     * @param groups - номера нужных групп, 0 - всё вхождение.
      * @param offset -  начальная позиция поиска (по умолчанию 0).
      * @param maxCount - максимальное количество для ограничения поиска.
-     * @return текст, полученный из исходного текста заменой найденных вхождений на текст, возвращаемый функцией обработчиком.
-     * @details функция обработчик получает информацию о вхождении в виде вектора пар, первый элемент вектора - описывает всё
-     *      вхождение, последующие - подгруппы вхождения. Каждая пара содержит позицию начала текста, и сам найденный текст.
-     *      Вернуть же она должна текст, который будет вставлен вместо вхождения.
+     * @return std::vector<std::vector<T>> - для каждого вхождения тексты групп в порядке groups. Для не участвовавшей
+     *      в совпадении или несуществующей группы - пустая строка.
+     * @details В отличии от texts_in_all_matches копируются только нужные группы. Чтобы движок не сохранял
+     *      положения лишних групп, регэксп можно создать через capture_subset.
      */
-    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
-    T replace_cb(U&& text, auto replacer, size_t offset = 0, size_t maxCount = -1) const {
-        str_type from = text;
-        auto matches = all_matches(from, offset, maxCount);
-        if (matches.empty()) {
-            return text;
-        }
-        std::vector<str_type> parts;
-        using replacer_ret_t = decltype(replacer(std::declval<std::vector<std::pair<size_t, str_type>>>()));
-        std::vector<replacer_ret_t> calcParts;
-        parts.reserve(matches.size() * 2 + 1);
-        calcParts.reserve(matches.size());
-        size_t last = 0;
-        for (const auto& match: matches) {
-            size_t delta = match[0].first - last;
-            if (delta) {
-                parts.emplace_back(from(last, delta));
+    template<StrType<K> T = str_type>
+    std::vector<std::vector<T>> groups_in_all_matches(str_type text, std::span<const unsigned> groups, size_t offset = 0, size_t maxCount = -1) const {
+        std::pair<std::span<const unsigned>, std::vector<std::vector<T>>> ctx{groups, {}};
+        for_all_match(text, offset, maxCount, &ctx, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            auto& [groups, matches] = *static_cast<std::pair<std::span<const unsigned>, std::vector<std::vector<T>>>*>(res);
+            auto& match = matches.emplace_back();
+            match.reserve(groups.size());
+            for (unsigned g: groups) {
+                match.emplace_back(group_text(region, start, g));
             }
-            parts.emplace_back(calcParts.emplace_back(replacer(match)));
-            last = match[0].first + match[0].second.len;
-        }
-        if (last < from.len) {
-            parts.emplace_back(from(last));
-        }
-        return expr_join<K, std::vector<str_type>, 0, false, false>{parts, nullptr};
+        });
+        return std::move(ctx.second);
     }
-protected:
-    using repl_result_func = void(*)(const std::vector<str_type>&, void* result);
-    SIMREX_API str_type first_founded_str(str_type text, size_t offset) const;
-    SIMREX_API void all_founded_str(str_type text, size_t offset, size_t maxCount, void* result, void(*func)(str_type, void*)) const;
-    SIMREX_API void for_first_match(str_type text, size_t offset, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const;
-    SIMREX_API void for_all_match(str_type text, size_t offset, size_t maxCount, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const;
-    SIMREX_API void do_replace(str_type text, str_type replText, size_t offset, size_t maxCount, bool substGroups, void* res, repl_result_func func) const;
-    SIMREX_API static OnigEncoding rex_encoding();
+    /*!
+     * @brief Получить тексты выбранных групп всех найденных вхождений, номера групп задаются при компиляции.
+     * @tparam G - номера нужных групп, 0 - всё вхождение.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::vector<std::array<simple_str<K>, sizeof...(G)>> - для каждого вхождения тексты групп в порядке G.
+     * @details Пример: `for (auto [key, value]: rex.groups_in_all_matches<2, 5>(text))`.
+     */
+    template<unsigned... G>
+    std::vector<std::array<str_type, sizeof...(G)>> groups_in_all_matches(str_type text, size_t offset = 0, size_t maxCount = -1) const {
+        std::vector<std::array<str_type, sizeof...(G)>> matches;
+        for_all_match(text, offset, maxCount, &matches, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            static_cast<std::vector<std::array<str_type, sizeof...(G)>>*>(res)->push_back({group_text(region, start, G)...});
+        });
+        return matches;
+    }
+
+    /*!
+     * @brief Создать регэксп, в котором захватывающими остаются только выбранные группы шаблона.
+     * @param pattern - регулярное выражение.
+     * @param groups - номера групп шаблона, которые надо оставить захватывающими.
+     * @return OnigRegexp - регэксп, в котором остальные группы стали незахватывающими. Оставленные группы
+     *      нумеруются заново с 1 в порядке возрастания их номеров в исходном шаблоне. Меньше групп - меньше регион
+     *      и меньше работы движка на каждое совпадение.
+     *      Если в шаблоне есть обратные ссылки, вызовы подвыражений или условные конструкции, по номеру или по имени,
+     *      перенумеровать группы нельзя, и возвращается невалидный регэксп.
+     *      Если в шаблоне есть именованные группы, захватывающими считаются только они, как в oniguruma. Когда убраны
+     *      все именованные группы, обычные группы тоже делаются незахватывающими.
+     */
+    SIMREX_API static OnigRegexp capture_subset(str_type pattern, std::span<const unsigned> groups);
+
+    /*!
+     * @brief Извлечь поля из каждой строки текста сразу по колонкам.
+     * @param text - текст, разделённый на строки.
+     * @param separator - разделитель строк (по умолчанию перевод строки).
+     * @return ColumnarMatches - колонки положений групп первого совпадения в каждой строке. Положения отсчитываются
+     *      от начала text. Совпадение ищется только внутри строки.
+     */
+    SIMREX_API ColumnarMatches extract_columns(str_type text, K separator = K('\n')) const;
+    /*!
+     * @brief Извлечь поля из каждой записи сразу по колонкам.
+     * @param records - записи.
+     * @return ColumnarMatches - колонки положений групп первого совпадения в каждой записи. Положения отсчитываются
+     *      от начала своей записи.
+     */
+    SIMREX_API ColumnarMatches extract_columns(std::span<const str_type> records) const;
+
+    /*!
+     * @brief Построчный поиск - получить строки текста, в которых есть совпадение.
+     * @param text - текст, в котором ищем. Строки разделяются символом '\n'.
+     * @param options - параметры поиска: инверсия, ограничение количества, номера строк.
+     * @return std::vector<GrepLine<K>> - найденные строки.
+     * @details Поиск ведётся по всему тексту, а строкой совпадения считается строка, в которой начинается вхождение.
+     *      После совпадения поиск сразу продолжается со следующей строки. Переводы строк ищутся через
+     *      std::char_traits<K>::find, то есть для char и wchar_t через векторизованные memchr/wmemchr.
+     */
+    SIMREX_API std::vector<GrepLine<K>> grep_lines(str_type text, const GrepOptions& options = {}) const;
+
+    /*!
+     * @brief Построчный поиск с передачей найденных строк в функтор, без накопления результата.
+     * @param text - текст, в котором ищем. Строки разделяются символом '\n'.
+     * @param options - параметры поиска: инверсия, ограничение количества, номера строк.
+     * @param func - функтор, вызываемый для каждой найденной строки с параметром const GrepLine<K>&.
+     * @return size_t - количество найденных строк.
+     */
+    size_t grep_lines(str_type text, const GrepOptions& options, auto func) const {
+        return for_grep_line(text, options, &func, [](const GrepLine<K>& line, void* res) {
+            (*static_cast<decltype(func)*>(res))(line);
+        });
+    }
+
+    /*!
+     * @brief Получить тексты всех найденных вхождений, размещая результат в заданном memory_resource.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param mr - memory_resource, из которого выделяется память под результат.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::pmr::vector<T> - вектор с текстами всех найденных вхождений.
+     */
+    template<StrType<K> T = str_type>
+    std::pmr::vector<T> all_founded(std::pmr::memory_resource* mr, str_type text, size_t offset = 0, size_t maxCount = -1) const {
+        std::pmr::vector<T> matches{mr};
+        all_founded_str(text, offset, maxCount, &matches, [](str_type word, void* res) {
+            static_cast<std::pmr::vector<T>*>(res)->emplace_back(word);
+        });
+        return matches;
+    }
+    /*!
+     * @brief Получить текст первого найденного вхождения вместе с текстами подгрупп, размещая результат в заданном memory_resource.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param mr - memory_resource, из которого выделяется память под результат.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @return std::pmr::vector<T> - массив с текстами найденного вхождения - в первом элементе массива возвращает
+     *      текст всего найденного вхождения, а далее тексты подгрупп.
+     */
+    template<StrType<K> T = str_type>
+    std::pmr::vector<T> texts_in_first_match(std::pmr::memory_resource* mr, str_type text, size_t offset = 0) const {
+        std::pmr::vector<T> matches{mr};
+        for_first_match(text, offset, &matches, [](OnigRegion* region, const OnigUChar *start, void* res) {
+            std::pmr::vector<T>& matches = *static_cast<std::pmr::vector<T>*>(res);
+            matches.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                matches.emplace_back(str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        });
+        return matches;
+    }
+    /*!
+     * @brief Получить тексты всех найденных вхождений вместе с подгруппами, размещая результат в заданном memory_resource.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param mr - memory_resource, из которого выделяется память под результат, в том числе под вложенные массивы.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::pmr::vector<std::pmr::vector<T>> - массив с массивами, в которых в первом элементе находится
+     *      текст всего найденного вхождения, а далее тексты подгрупп.
+     */
+    template<StrType<K> T = str_type>
+    std::pmr::vector<std::pmr::vector<T>> texts_in_all_matches(std::pmr::memory_resource* mr, str_type text, size_t offset = 0, size_t maxCount = -1) const {
+        std::pmr::vector<std::pmr::vector<T>> matches{mr};
+        for_all_match(text, offset, maxCount, &matches, [](OnigRegion* region, const OnigUChar* start, void* res) {
+            std::pmr::vector<std::pmr::vector<T>>& matches = *static_cast<std::pmr::vector<std::pmr::vector<T>>*>(res);
+            auto& match = matches.emplace_back();
+            match.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                match.emplace_back(str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        });
+        return matches;
+    }
+    /*!
+     * @brief Получить всю информацию о первом найденном вхождении, размещая результат в заданном memory_resource.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param mr - memory_resource, из которого выделяется память под результат.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @return std::pmr::vector<std::pair<size_t, T>> - массив, в котором первый элемент описывает всё вхождение, а следующие -
+     *      подгруппы вхождения. Описание представляет собой пару, первый элемент которой - позиция начала вхождения,
+     *      второй - текст вхождения.
+     */
+    template<StrType<K> T = str_type>
+    std::pmr::vector<std::pair<size_t, T>> first_match(std::pmr::memory_resource* mr, str_type text, size_t offset = 0) const {
+        std::pmr::vector<std::pair<size_t, T>> match{mr};
+        for_first_match(text, offset, &match, [](OnigRegion* region, const OnigUChar *start, void* res) {
+            std::pmr::vector<std::pair<size_t, T>>& match = *static_cast<std::pmr::vector<std::pair<size_t, T>>*>(res);
+            match.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                match.emplace_back(
+                    rt::fromLen(region->beg[i]),
+                    str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        });
+        return match;
+    }
+    /*!
+     * @brief Получить всю информацию о всех найденных вхождениях, размещая результат в заданном memory_resource.
+     * @tparam T - тип текста в возвращаемом результате, по умолчанию simple_str<K>.
+     * @param mr - memory_resource, из которого выделяется память под результат, в том числе под вложенные массивы.
+     * @param text - текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return std::pmr::vector<std::pmr::vector<std::pair<size_t, T>>> - массив со всеми вхождениями, в котором каждый элемент -
+     *      массив, описывающий вхождение, в котором первый элемент описывает всё вхождение, а следующие -
+     *      подгруппы вхождения. Описание представляет собой пару, первый элемент которой - позиция начала вхождения,
+     *      второй - текст вхождения.
+     * @details Удобно использовать с std::pmr::monotonic_buffer_resource, чтобы вся память результата
+     *      освобождалась одним действием и не конкурировала за глобальный аллокатор.
+     */
+    template<StrType<K> T = str_type>
+    std::pmr::vector<std::pmr::vector<std::pair<size_t, T>>> all_matches(std::pmr::memory_resource* mr, str_type text, size_t offset = 0, size_t maxCount = -1) const {
+        std::pmr::vector<std::pmr::vector<std::pair<size_t, T>>> matches{mr};
+        for_all_match(text, offset, maxCount, &matches, [](OnigRegion* region, const OnigUChar* start, void* res){
+            std::pmr::vector<std::pmr::vector<std::pair<size_t, T>>>& matches = *static_cast<std::pmr::vector<std::pmr::vector<std::pair<size_t, T>>>*>(res);
+            auto& match = matches.emplace_back();
+            match.reserve(region->num_regs);
+            for (int i = 0; i < region->num_regs; i++) {
+                match.emplace_back(
+                    rt::fromLen(region->beg[i]),
+                    str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        });
+        return matches;
+    }
+
+    /*!
+     * @brief Заменить вхождения на заданный текст.
+     * @tparam U - тип исходного текста, выводится из аргумента.
+     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
+     * @param text - исходный текст, в котором ищем.
+     * @param replText - текст, которым заменять найденные вхождения.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп.
+     * @return текст, полученный из исходного текста заменой найденных вхождений на заданный шаблон.
+     *      При substGroups == true, в шаблоне помимо постоянного текста можно указывать номера подгрупп, вместо них будут
+     *      вставлены найденные подгруппы:
+     *      $N - подгруппы от 0 до 9 ($1, $2 и т.п.).
+     *      ${NNN} - подгруппы от 0 до N (${10}, ${12} и т.п.).
+     *      $$ - вставляет один $.
+     *      $Любые другие варианты - вставляются как есть.
+     */
+    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
+    T replace(U&& text, str_type replText, size_t offset = 0, size_t maxCount = -1, bool substGroups = true) const {
+        std::optional<T> result;
+        do_replace(text, replText, offset, maxCount, substGroups, &result, [](const std::vector<str_type>& parts, void* res) {
+            std::optional<T>& result = *static_cast<std::optional<T>*>(res);
+            result = expr_join<K, std::vector<str_type>, 0, false, false>{parts, nullptr};
+        });
+        if (!result) {
+            return text;
+        }
+        return std::move(result).value();
+    }
+    /*!
+     * @brief Заменить вхождения на текст, возвращаемый из функции обработчика.
+     * @tparam U - тип исходного текста, выводится из аргумента.
+     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
+     * @param text - исходный текст, в котором ищем.
+     * @param replacer - функция, получающая информацию о вхождении и возвращающая текст, которым будет заменено вхождение.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return текст, полученный из исходного текста заменой найденных вхождений на текст, возвращаемый функцией обработчиком.
+     * @details функция обработчик получает информацию о вхождении в виде вектора пар, первый элемент вектора - описывает всё
+     *      вхождение, последующие - подгруппы вхождения. Каждая пара содержит позицию начала текста, и сам найденный текст.
+     *      Вернуть же она должна текст, который будет вставлен вместо вхождения.
+     */
+    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
+    T replace_cb(U&& text, auto replacer, size_t offset = 0, size_t maxCount = -1) const {
+        std::optional<T> result;
+        replace_cb_parts(text, replacer, offset, maxCount, [&](const std::vector<str_type>& parts) {
+            result = expr_join<K, std::vector<str_type>, 0, false, false>{parts, nullptr};
+        });
+        if (!result) {
+            return text;
+        }
+        return std::move(result).value();
+    }
+    /*!
+     * @brief Заменить вхождения на заданный текст, обрабатывая части текста в нескольких потоках.
+     * @tparam U - тип исходного текста, выводится из аргумента.
+     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
+     * @param text - исходный текст, в котором ищем.
+     * @param replText - текст, которым заменять найденные вхождения, с подстановкой подгрупп как в replace.
+     * @param separator - разделитель, после которого можно разрезать текст на части (по умолчанию перевод строки).
+     * @param options - количество потоков и минимальный размер части.
+     * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп.
+     * @return текст, полученный из исходного текста заменой всех найденных вхождений.
+     * @details Текст режется на части по разделителю, вхождения в частях ищутся и заменяются параллельно.
+     *      Поиск в каждой части идёт по всему тексту как по субъекту, поэтому якоря и просмотр назад работают
+     *      так же, как в replace. Затем по размерам частей результата вычисляется общий размер, результат
+     *      выделяется один раз и части копируются в него тоже параллельно.
+     *      Результат совпадает с replace(text, replText), если вхождения не пересекают разделители.
+     *      Если вхождение всё же вышло за границу части или совпало с пустой строкой, вся замена выполняется
+     *      последовательно, так как результат replace тогда зависит от порядка обработки.
+     */
+    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
+    T replace_parallel(U&& text, str_type replText, K separator = K('\n'), const ParallelOptions& options = {}, bool substGroups = true) const {
+        std::optional<T> result;
+        do_replace_parallel(text, replText, separator, options, substGroups, &result, [](const std::vector<std::vector<str_type>>& chunks, unsigned threads, void* res) {
+            static_cast<std::optional<T>*>(res)->emplace(parallel_join{chunks, threads});
+        });
+        if (!result) {
+            return text;
+        }
+        return std::move(result).value();
+    }
+    /*!
+     * @brief Заменить вхождения на заданный текст прямо в строке target.
+     * @param target - строка, в которой делается замена. Результат записывается в неё же.
+     * @param replText - текст, которым заменять найденные вхождения.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп, как в replace.
+     * @return bool - true, если были замены.
+     * @details Если вхождений нет, строка не меняется и ничего не копируется. Иначе результат собирается
+     *      прямо в target, используя уже выделенную в ней память, если результат в неё помещается. Если одни
+     *      замены длиннее своих вхождений, а другие короче, результат сначала собирается во временном буфере.
+     */
+    template<size_t N, bool S, typename A>
+    bool replace_in(lstring<K, N, S, A>& target, str_type replText, size_t offset = 0, size_t maxCount = -1, bool substGroups = true) const {
+        std::pair<lstring<K, N, S, A>*, bool> res{&target, false};
+        do_replace(target, replText, offset, maxCount, substGroups, &res, [](const std::vector<str_type>& parts, void* res) {
+            auto& [target, replaced] = *static_cast<std::pair<lstring<K, N, S, A>*, bool>*>(res);
+            assign_parts(*target, parts);
+            replaced = true;
+        });
+        return res.second;
+    }
+    /*!
+     * @brief Заменить вхождения на текст, возвращаемый из функции обработчика, прямо в строке target.
+     * @param target - строка, в которой делается замена. Результат записывается в неё же.
+     * @param replacer - функция, получающая информацию о вхождении и возвращающая текст замены, как в replace_cb.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество для ограничения поиска.
+     * @return bool - true, если были замены.
+     * @details Память используется так же, как в replace_in.
+     */
+    template<size_t N, bool S, typename A>
+    bool replace_cb_in(lstring<K, N, S, A>& target, auto replacer, size_t offset = 0, size_t maxCount = -1) const {
+        bool replaced = false;
+        replace_cb_parts(target, replacer, offset, maxCount, [&](const std::vector<str_type>& parts) {
+            assign_parts(target, parts);
+            replaced = true;
+        });
+        return replaced;
+    }
+    /*!
+     * @brief Собрать части результата замены по заранее найденным вхождениям.
+     * @param text - исходный текст, в котором искали.
+     * @param matches - вхождения в формате all_matches_into: по groups_count() элементов на совпадение.
+     * @param replText - текст, которым заменять вхождения, с подстановкой подгрупп как в replace.
+     * @param substGroups - обрабатывать в тексте замены шаблон вставки подгрупп.
+     * @return std::vector<simple_str<K>> - части результата по порядку, ссылаются на text и replText.
+     *      Склеить их можно через expr_join.
+     */
+    SIMREX_API std::vector<str_type> replace_parts(str_type text, std::span<const MatchSpan> matches, str_type replText, bool substGroups = true) const;
+protected:
+    // Разбивает результат replace_cb на части и передаёт их в consume, если были вхождения.
+    void replace_cb_parts(str_type from, auto& replacer, size_t offset, size_t maxCount, auto&& consume) const {
+        auto matches = all_matches(from, offset, maxCount);
+        if (matches.empty()) {
+            return;
+        }
+        std::vector<str_type> parts;
+        using replacer_ret_t = decltype(replacer(std::declval<std::vector<std::pair<size_t, str_type>>>()));
+        std::vector<replacer_ret_t> calcParts;
+        parts.reserve(matches.size() * 2 + 1);
+        calcParts.reserve(matches.size());
+        size_t last = 0;
+        for (const auto& match: matches) {
+            size_t delta = match[0].first - last;
+            if (delta) {
+                parts.emplace_back(from(last, delta));
+            }
+            parts.emplace_back(calcParts.emplace_back(replacer(match)));
+            last = match[0].first + match[0].second.len;
+        }
+        if (last < from.len) {
+            parts.emplace_back(from(last));
+        }
+        consume(parts);
+    }
+
+    // Строковое выражение, собирающее части результата параллельной замены в нескольких потоках.
+    struct parallel_join {
+        using symb_type = K;
+        const std::vector<std::vector<str_type>>& chunks;
+        unsigned threads;
+        std::vector<size_t> offsets;
+
+        parallel_join(const std::vector<std::vector<str_type>>& c, unsigned t) : chunks(c), threads(t) {
+            offsets.reserve(chunks.size() + 1);
+            size_t total = 0;
+            offsets.push_back(0);
+            for (const auto& chunk: chunks) {
+                for (const auto& part: chunk) {
+                    total += part.length();
+                }
+                offsets.push_back(total);
+            }
+        }
+        size_t length() const {
+            return offsets.back();
+        }
+        K* place(K* p) const {
+            place_parallel(chunks, offsets, p, threads);
+            return p + length();
+        }
+    };
+    SIMREX_API static void place_parallel(const std::vector<std::vector<str_type>>& chunks, const std::vector<size_t>& offsets, K* dest, unsigned threads);
+
+    /*
+     * Части ссылаются на текст самой строки target. Если все части можно переложить на их места по порядку -
+     * слева направо, когда каждая часть ложится не правее своего места в исходном тексте (замены не длиннее
+     * вхождений), или справа налево в обратном случае, результат собирается прямо в памяти target.
+     * Иначе части собираются во временном буфере и копируются в target.
+     */
+    template<size_t N, bool S, typename A>
+    static void assign_parts(lstring<K, N, S, A>& target, const std::vector<str_type>& parts) {
+        const K* old = target.symbols();
+        const size_t oldLength = target.length();
+        // Смещение части в target или npos, если часть лежит в другой памяти.
+        auto source = [&](const str_type& part) {
+            std::less_equal<const K*> le;
+            return part.length() && le(old, part.symbols()) && le(part.symbols() + part.length(), old + oldLength)
+                ? size_t(part.symbols() - old) : str::npos;
+        };
+        size_t length = 0;
+        for (const str_type& part: parts) {
+            length += part.length();
+        }
+        // Слева направо: часть не должна затирать исходный текст следующих частей.
+        bool forward = true;
+        for (size_t i = parts.size(), after = 0, nextSource = str::npos; forward && i--; ) {
+            forward = length - after <= nextSource;
+            after += parts[i].length();
+            nextSource = std::min(nextSource, source(parts[i]));
+        }
+        // Справа налево: часть не должна затирать исходный текст предыдущих частей.
+        bool backward = !forward;
+        for (size_t i = 0, before = 0, prevEnd = 0; backward && i < parts.size(); i++) {
+            backward = before >= prevEnd;
+            before += parts[i].length();
+            if (size_t from = source(parts[i]); from != str::npos) {
+                prevEnd = std::max(prevEnd, from + parts[i].length());
+            }
+        }
+        if (!forward && !backward) {
+            std::vector<K> buffer(length);
+            K* p = buffer.data();
+            for (const str_type& part: parts) {
+                std::char_traits<K>::copy(p, part.symbols(), part.length());
+                p += part.length();
+            }
+            std::char_traits<K>::copy(target.set_size(length), buffer.data(), length);
+            return;
+        }
+        // При увеличении set_size сохраняет текст строки, возможно, перенося его в новую память.
+        K* out = target.set_size(std::max(length, oldLength));
+        auto move_part = [&](size_t i, size_t to) {
+            size_t from = source(parts[i]);
+            std::char_traits<K>::move(out + to, from == str::npos ? parts[i].symbols() : out + from, parts[i].length());
+        };
+        if (forward) {
+            for (size_t i = 0, to = 0; i < parts.size(); to += parts[i++].length()) {
+                move_part(i, to);
+            }
+        } else {
+            for (size_t i = parts.size(), to = length; i--; ) {
+                to -= parts[i].length();
+                move_part(i, to);
+            }
+        }
+        if (length < oldLength) {
+            target.set_size(length);
+        }
+    }
+
+    friend class MultiReplacer<K>;
+    using repl_result_func = void(*)(const std::vector<str_type>&, void* result);
+    static void add_cp_groups(CodePointCounter<K>& counter, OnigRegion* region, const OnigUChar* start, std::vector<std::pair<size_t, str_type>>& match) {
+        match.reserve(region->num_regs);
+        for (int i = 0; i < region->num_regs; i++) {
+            if (region->beg[i] == ONIG_REGION_NOTPOS) {
+                match.emplace_back(MatchSpan::npos, str_type{});
+            } else {
+                match.emplace_back(counter.to_cp(rt::fromLen(region->beg[i])),
+                    str_type{rt::fromChar(start + region->beg[i]), rt::fromLen(region->end[i] - region->beg[i])});
+            }
+        }
+    }
+    static str_type group_text(OnigRegion* region, const OnigUChar* start, unsigned group) {
+        if (group >= unsigned(region->num_regs) || region->beg[group] < 0) {
+            return {};
+        }
+        return {rt::fromChar(start + region->beg[group]), rt::fromLen(region->end[group] - region->beg[group])};
+    }
+    SIMREX_API str_type first_founded_str(str_type text, size_t offset) const;
+    SIMREX_API str_type last_founded_str(str_type text, size_t before) const;
+    SIMREX_API void all_founded_str(str_type text, size_t offset, size_t maxCount, void* result, void(*func)(str_type, void*)) const;
+    SIMREX_API void for_first_match(str_type text, size_t offset, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const;
+    SIMREX_API void for_all_match(str_type text, size_t offset, size_t maxCount, void* res, void(*func)(OnigRegion*, const OnigUChar*, void*)) const;
+    SIMREX_API void extract_row(const OnigUChar* start, const OnigUChar* end, size_t base, ColumnarMatches& result) const;
+    SIMREX_API size_t for_grep_line(str_type text, const GrepOptions& options, void* res, void(*func)(const GrepLine<K>&, void*)) const;
+    SIMREX_API void do_replace(str_type text, str_type replText, size_t offset, size_t maxCount, bool substGroups, void* res, repl_result_func func) const;
+    using par_result_func = void(*)(const std::vector<std::vector<str_type>>& chunks, unsigned threads, void* result);
+    SIMREX_API void do_replace_parallel(str_type text, str_type replText, K separator, const ParallelOptions& options, bool substGroups, void* res, par_result_func func) const;
+    SIMREX_API static OnigEncoding rex_encoding();
 };
 
 using OnigRex = OnigRegexp<u8s>;
@@ -369,4 +1388,573 @@ using OnigRexW = OnigRegexp<uws>;
 using OnigRexU = OnigRegexp<u16s>;
 using OnigRexUU = OnigRegexp<u32s>;
 
+/*!
+ * @brief Копируемый разделяемый хэндл неизменяемого скомпилированного регэкспа.
+ * @tparam K - тип символов
+ * @details Копирование хэндла только увеличивает счётчик ссылок, регэксп компилируется один раз.
+ *      Через хэндл доступны только const методы OnigRegexp, которые безопасно вызывать одновременно
+ *      из любого количества потоков. Хэндл, созданный по умолчанию, ссылается на пустой (невалидный) регэксп.
+ */
+template<typename K>
+class OnigRegexpShared {
+public:
+    using regexp_type = OnigRegexp<K>;
+    using str_type = typename regexp_type::str_type;
+
+    OnigRegexpShared() : regexp_{empty_regexp()} {}
+    /*!
+     * @brief Компилирует регулярное выражение и создаёт хэндл на него.
+     * @param pattern - регулярное выражение.
+     */
+    OnigRegexpShared(str_type pattern) : regexp_{std::make_shared<const regexp_type>(pattern)} {}
+    /*!
+     * @brief Создаёт хэндл, забирая уже скомпилированный регэксп.
+     * @param regexp - регэксп, владение которым переходит в хэндл.
+     */
+    OnigRegexpShared(regexp_type&& regexp) : regexp_{std::make_shared<const regexp_type>(std::move(regexp))} {}
+    /*!
+     * @brief Компилирует регулярное выражение с кэшем результатов поиска и создаёт хэндл на него.
+     * @param pattern - регулярное выражение.
+     * @param cacheCapacity - максимальное количество запоминаемых текстов, как в OnigRegexp::enable_cache.
+     * @param maxTextLength - тексты длиннее этого (в байтах) не кэшируются.
+     * @details Кэш включается до того, как регэксп становится доступен через хэндл, поэтому поиск
+     *      через все копии хэндла можно сразу выполнять из разных потоков.
+     */
+    OnigRegexpShared(str_type pattern, size_t cacheCapacity, size_t maxTextLength = 4096) : regexp_{with_cache(pattern, cacheCapacity, maxTextLength)} {}
+
+    bool isValid() const {
+        return regexp_->isValid();
+    }
+
+    const regexp_type& operator*() const {
+        return *regexp_;
+    }
+
+    const regexp_type* operator->() const {
+        return regexp_.get();
+    }
+
+    const regexp_type& get() const {
+        return *regexp_;
+    }
+
+    /// Количество хэндлов, ссылающихся на этот же регэксп.
+    long use_count() const {
+        return regexp_.use_count();
+    }
+
+protected:
+    static const std::shared_ptr<const regexp_type>& empty_regexp() {
+        static const std::shared_ptr<const regexp_type> empty = std::make_shared<const regexp_type>();
+        return empty;
+    }
+
+    static std::shared_ptr<const regexp_type> with_cache(str_type pattern, size_t cacheCapacity, size_t maxTextLength) {
+        auto regexp = std::make_shared<regexp_type>(pattern);
+        if (regexp->isValid()) {
+            regexp->enable_cache(cacheCapacity, maxTextLength);
+        }
+        return regexp;
+    }
+
+    std::shared_ptr<const regexp_type> regexp_;
+};
+
+using OnigRexShared = OnigRegexpShared<u8s>;
+using OnigRexSharedW = OnigRegexpShared<uws>;
+using OnigRexSharedU = OnigRegexpShared<u16s>;
+using OnigRexSharedUU = OnigRegexpShared<u32s>;
+
+/*!
+ * @brief Замена по нескольким регулярным выражениям за один проход по тексту.
+ * @tparam K - тип символов
+ * @details Хранит таблицу правил "регулярное выражение - шаблон замены". При замене в каждой позиции
+ *      ищется самое левое вхождение среди всех выражений сразу (onig_regset_search), при совпадении позиций
+ *      побеждает правило, добавленное раньше. Результат собирается за один проход, без промежуточных копий текста.
+ *      Шаблоны замены понимают те же подстановки подгрупп, что и OnigRegexp::replace.
+ *      Для поиска используются данные внутри набора регэкспов Oniguruma, поэтому методы замены не const,
+ *      и один объект нельзя одновременно использовать из разных потоков.
+ */
+template<typename K>
+class MultiReplacer {
+    using rt = RexTraits<K>;
+
+public:
+    using str_type = simple_str<K>;
+
+    MultiReplacer() = default;
+    /*!
+     * @brief Создаёт объект с заданной таблицей правил.
+     * @param rules - пары "регулярное выражение - шаблон замены". Правила с ошибочными выражениями пропускаются.
+     */
+    MultiReplacer(std::initializer_list<std::pair<str_type, str_type>> rules) {
+        for (const auto& [pattern, replText]: rules) {
+            add(pattern, replText);
+        }
+    }
+    MultiReplacer(MultiReplacer&&) noexcept = default;
+    MultiReplacer& operator=(MultiReplacer&&) noexcept = default;
+
+    /*!
+     * @brief Добавить правило замены.
+     * @param pattern - регулярное выражение.
+     * @param replText - шаблон замены.
+     * @param substGroups - обрабатывать в шаблоне замены подстановку подгрупп ($N, ${NNN}, $$).
+     * @return bool - true, если выражение скомпилировалось и правило добавлено.
+     */
+    SIMREX_API bool add(str_type pattern, str_type replText, bool substGroups = true);
+
+    /// Количество правил.
+    size_t size() const {
+        return rules_.size();
+    }
+
+    /*!
+     * @brief Заменить вхождения всех выражений на их шаблоны замены за один проход.
+     * @tparam U - тип исходного текста, выводится из аргумента.
+     * @tparam T - тип результата. По умолчанию имеет тип исходного текста, если исходный тип - владеющий (sstring, lstring).
+     * @param text - исходный текст, в котором ищем.
+     * @param offset -  начальная позиция поиска (по умолчанию 0).
+     * @param maxCount - максимальное количество замен.
+     * @return текст, полученный из исходного заменой найденных вхождений.
+     */
+    template<StrType<K> U, typename T = std::remove_cvref_t<U>> requires storable_str<T, K>
+    T replace(U&& text, size_t offset = 0, size_t maxCount = -1) {
+        std::optional<T> result;
+        do_replace(text, offset, maxCount, &result, [](const std::vector<str_type>& parts, void* res) {
+            std::optional<T>& result = *static_cast<std::optional<T>*>(res);
+            result = expr_join<K, std::vector<str_type>, 0, false, false>{parts, nullptr};
+        });
+        if (!result) {
+            return text;
+        }
+        return std::move(result).value();
+    }
+
+protected:
+    using repl_result_func = void(*)(const std::vector<str_type>&, void* result);
+    SIMREX_API void do_replace(str_type text, size_t offset, size_t maxCount, void* res, repl_result_func func);
+
+    struct Rule {
+        // Владеет текстом шаблона, на который ссылаются части replaces.
+        std::vector<K> replText;
+        std::vector<std::pair<int, str_type>> replaces;
+    };
+
+    RegSetPtr regset_;
+    std::vector<Rule> rules_;
+};
+
+using MultiReplacerA = MultiReplacer<u8s>;
+using MultiReplacerW = MultiReplacer<uws>;
+using MultiReplacerU = MultiReplacer<u16s>;
+using MultiReplacerUU = MultiReplacer<u32s>;
+
+/// Какие совпадения изменились после правки текста в MatchIndex.
+struct MatchIndexUpdate {
+    /// Индекс первого изменённого совпадения.
+    size_t first;
+    /// Сколько старых совпадений удалено, начиная с first.
+    size_t removed;
+    /// Сколько новых совпадений вставлено на их место.
+    size_t inserted;
+};
+
+/*!
+ * @brief Индекс всех совпадений регэкспа в тексте с инкрементальным обновлением после правок.
+ * @tparam K - тип символов
+ * @details Хранит положения всех совпадений и подгрупп, как их выдаёт OnigRegexp::all_matches. После замены
+ *      участка текста пересчитываются только совпадения рядом с правкой: поиск начинается с последнего совпадения,
+ *      которое не могло затронуть правку, и останавливается, как только найденное совпадение за правкой совпадёт
+ *      со старым, сдвинутым на разницу длин. Положения остальных совпадений просто сдвигаются.
+ *      lookAround - на сколько символов за границы совпадения может заглядывать регэксп (просмотр вперёд/назад,
+ *      якоря, неудачные попытки продлить жадное повторение). Для выражений, которые могут просматривать текст
+ *      на неограниченное расстояние (например `a.*b|a`), инкрементальный результат может отличаться от полного поиска.
+ *      Регэксп не копируется, он должен жить дольше индекса.
+ */
+template<typename K>
+class MatchIndex {
+public:
+    using str_type = simple_str<K>;
+
+    /*!
+     * @brief Создаёт пустой индекс.
+     * @param regexp - регэксп, совпадения которого индексируются.
+     * @param lookAround - граница просмотра за пределы совпадения, в символах.
+     */
+    MatchIndex(const OnigRegexp<K>& regexp, size_t lookAround = 0)
+        : regexp_(&regexp), lookAround_(lookAround), groups_(regexp.groups_count()) {}
+
+    /*!
+     * @brief Проиндексировать текст целиком.
+     * @param text - текст.
+     */
+    SIMREX_API void build(str_type text);
+
+    /*!
+     * @brief Обновить индекс после правки текста.
+     * @param text - текст уже после правки.
+     * @param pos - позиция правки.
+     * @param removed - сколько символов удалено с позиции pos в старом тексте.
+     * @param inserted - сколько символов вставлено на их место.
+     * @return MatchIndexUpdate - диапазон совпадений, заменённых при обновлении.
+     */
+    SIMREX_API MatchIndexUpdate edit(str_type text, size_t pos, size_t removed, size_t inserted);
+
+    /// Количество совпадений.
+    size_t size() const {
+        return groups_ ? spans_.size() / groups_ : 0;
+    }
+
+    /// Количество групп в каждом совпадении - всё вхождение плюс подгруппы.
+    size_t groups_count() const {
+        return groups_;
+    }
+
+    /*!
+     * @brief Получить совпадение.
+     * @param idx - индекс совпадения.
+     * @return std::span<const MatchSpan> - положение всего вхождения в первом элементе, далее подгрупп.
+     */
+    std::span<const MatchSpan> operator[](size_t idx) const {
+        return {spans_.data() + idx * groups_, groups_};
+    }
+
+protected:
+    SIMREX_API size_t rescan(str_type text, size_t keep, size_t editEnd, std::ptrdiff_t delta);
+
+    const OnigRegexp<K>* regexp_;
+    size_t lookAround_;
+    size_t groups_;
+    std::vector<MatchSpan> spans_;
+};
+
+struct RexPrefilter;
+
+struct RexPrefilterDeleter {
+    SIMREX_API void operator()(RexPrefilter* prefilter) const;
+};
+
+/*!
+ * @brief Набор регулярных выражений с общим литеральным префильтром.
+ * @tparam K - тип символов
+ * @details При создании из каждого шаблона извлекаются обязательные литералы - строки, хотя бы одна из которых
+ *      входит в любое совпадение (например, для `GET /api/(\w+)` это "GET /api/"). Литералы всех шаблонов
+ *      собираются в один автомат Ахо-Корасик, который за один проход по тексту отмечает шаблоны, чьи литералы
+ *      встретились. Поиск oniguruma запускается только для них и для шаблонов, в которых обязательных литералов
+ *      найти не удалось. Литералы с игнорированием регистра не извлекаются, чтобы не пропустить совпадения
+ *      по правилам сравнения регистра Unicode.
+ *      Набор не меняется после создания, поэтому его можно одновременно использовать из разных потоков.
+ */
+template<typename K>
+class RexSet {
+public:
+    using str_type = simple_str<K>;
+
+    RexSet() = default;
+    /*!
+     * @brief Компилирует набор выражений и строит префильтр.
+     * @param patterns - регулярные выражения. Индекс выражения в наборе совпадает с индексом в patterns.
+     *      Ошибочные выражения остаются в наборе невалидными и никогда не совпадают.
+     */
+    SIMREX_API RexSet(std::span<const str_type> patterns);
+    RexSet(std::initializer_list<str_type> patterns) : RexSet(std::span<const str_type>{patterns.begin(), patterns.size()}) {}
+    RexSet(RexSet&&) noexcept = default;
+    RexSet& operator=(RexSet&&) noexcept = default;
+
+    /// Количество выражений в наборе.
+    size_t size() const {
+        return regexps_.size();
+    }
+
+    const OnigRegexp<K>& operator[](size_t idx) const {
+        return regexps_[idx];
+    }
+
+    /*!
+     * @brief Индексы выражений, которые могут совпасть с текстом, по результату префильтра, без запуска поиска.
+     * @param text - текст.
+     * @return std::vector<size_t> - индексы выражений по возрастанию.
+     */
+    SIMREX_API std::vector<size_t> candidates(str_type text) const;
+
+    /*!
+     * @brief Индексы выражений, которые находят вхождение в тексте.
+     * @param text - текст.
+     * @return std::vector<size_t> - индексы выражений по возрастанию.
+     */
+    SIMREX_API std::vector<size_t> matching(str_type text) const;
+
+    /// Количество валидных выражений без обязательных литералов, которые проверяются для любого текста.
+    SIMREX_API size_t unfiltered() const;
+
+protected:
+    std::vector<OnigRegexp<K>> regexps_;
+    std::unique_ptr<RexPrefilter, RexPrefilterDeleter> prefilter_;
+};
+
+using RexSetA = RexSet<u8s>;
+using RexSetW = RexSet<uws>;
+using RexSetU = RexSet<u16s>;
+using RexSetUU = RexSet<u32s>;
+
+namespace detail {
+
+// Отображение файла в память только для чтения. Реализация в simrex/mapped_file-inl.h.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+    SIMREX_API bool open(const std::filesystem::path& path);
+    SIMREX_API void close();
+
+    const uint8_t* data() const {
+        return static_cast<const uint8_t*>(data_);
+    }
+    size_t size() const {
+        return size_;
+    }
+
+protected:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+    // HANDLE отображения в Windows.
+    void* mapping_ = nullptr;
+};
+
+} // namespace detail
+
+struct TrigramData;
+
+struct TrigramDataDeleter {
+    SIMREX_API void operator()(TrigramData* data) const;
+};
+
+/*!
+ * @brief Триграммный индекс по набору документов для отбора документов, в которых может совпасть регулярное выражение.
+ * @tparam K - тип символов
+ * @details Для каждой тройки подряд идущих символов индекс хранит список документов, в которых она встречается.
+ *      Из шаблона извлекаются обязательные литералы, как в RexSet, и документ становится кандидатом, только если
+ *      в нём есть все триграммы хотя бы одного из литералов. Поиск oniguruma нужен только для кандидатов.
+ *      Если у шаблона нет обязательных литералов длиной от трёх символов, кандидатами будут все документы.
+ *      Индекс строится параллельно, сохраняется в файл и загружается из него отображением в память, без чтения
+ *      и разбора. Файл в порядке байтов платформы, на которой он записан. Номера документов хранятся в 32 битах,
+ *      поэтому документов не больше maxDocuments.
+ *      Индекс не меняется после создания, поэтому его можно одновременно использовать из разных потоков.
+ */
+template<typename K>
+class TrigramIndex {
+public:
+    using str_type = simple_str<K>;
+
+    /// Наибольшее количество документов в индексе.
+    static constexpr size_t maxDocuments = UINT32_MAX;
+
+    TrigramIndex() = default;
+    /*!
+     * @brief Строит индекс.
+     * @param docs - документы. Номер документа в индексе совпадает с индексом в docs.
+     * @param options - количество потоков и минимальный объём текста в символах на поток.
+     * @details Если документов больше maxDocuments, индекс не строится и isValid() возвращает false.
+     */
+    SIMREX_API TrigramIndex(std::span<const str_type> docs, const ParallelOptions& options = {});
+    TrigramIndex(TrigramIndex&&) noexcept = default;
+    TrigramIndex& operator=(TrigramIndex&&) noexcept = default;
+
+    /// Индекс построен или загружен.
+    bool isValid() const {
+        return (bool)data_;
+    }
+
+    /// Количество документов в индексе.
+    SIMREX_API size_t documents() const;
+
+    /// Количество различных триграмм в индексе.
+    SIMREX_API size_t trigrams() const;
+
+    /*!
+     * @brief Номера документов, в которых может совпасть шаблон, без запуска поиска.
+     * @param pattern - регулярное выражение.
+     * @return std::vector<size_t> - номера документов по возрастанию.
+     */
+    SIMREX_API std::vector<size_t> candidates(str_type pattern) const;
+
+    /*!
+     * @brief Номера документов, в которых выражение находит вхождение.
+     * @param rex - регулярное выражение.
+     * @param pattern - шаблон, из которого скомпилировано rex.
+     * @param docs - те же документы, по которым строился индекс.
+     * @return std::vector<size_t> - номера документов по возрастанию.
+     */
+    SIMREX_API std::vector<size_t> matching(const OnigRegexp<K>& rex, str_type pattern, std::span<const str_type> docs) const;
+
+    /*!
+     * @brief Сохранить индекс в файл.
+     * @return bool - false при ошибке записи.
+     */
+    SIMREX_API bool save(const std::filesystem::path& path) const;
+
+    /*!
+     * @brief Загрузить индекс из файла, отобразив его в память.
+     * @return bool - false, если файл не открылся, повреждён или записан для другого типа символов.
+     *      При ошибке индекс не меняется.
+     */
+    SIMREX_API bool load(const std::filesystem::path& path);
+
+protected:
+    std::unique_ptr<TrigramData, TrigramDataDeleter> data_;
+};
+
+using TrigramIndexA = TrigramIndex<u8s>;
+using TrigramIndexW = TrigramIndex<uws>;
+using TrigramIndexU = TrigramIndex<u16s>;
+using TrigramIndexUU = TrigramIndex<u32s>;
+
+/// Токен, выделенный Lexer.
+template<typename K>
+struct LexToken {
+    /// Идентификатор токена из правил Lexer, или Lexer::error для нераспознанного текста.
+    int id;
+    /// Позиция начала токена в тексте.
+    size_t pos;
+    /// Текст токена.
+    simple_str<K> text;
+};
+
+/*!
+ * @brief Лексер: разбивает текст на токены по упорядоченному списку правил "идентификатор - регулярное выражение".
+ * @tparam K - тип символов
+ * @details В каждой позиции выбирается самое длинное совпадение среди всех правил, при равной длине - правило,
+ *      стоящее раньше в списке. Правила пробуются не все: при создании по разобранным шаблонам строится таблица
+ *      первых символов, и в позиции проверяются только правила, которые могут начаться с символа в этой позиции.
+ *      Символы, с которых не начинается ни один токен, собираются в токен с идентификатором error.
+ *      Совпадения нулевой длины токенами не считаются.
+ *      Лексер не меняется после создания, поэтому его можно одновременно использовать из разных потоков.
+ */
+template<typename K>
+class Lexer {
+public:
+    using str_type = simple_str<K>;
+    using token_type = LexToken<K>;
+    /// Идентификатор токена нераспознанного текста.
+    static constexpr int error = -1;
+
+    Lexer() = default;
+    /*!
+     * @brief Создаёт лексер.
+     * @param rules - пары "идентификатор токена - регулярное выражение" в порядке приоритета.
+     */
+    SIMREX_API Lexer(std::span<const std::pair<int, str_type>> rules);
+    Lexer(std::initializer_list<std::pair<int, str_type>> rules) : Lexer(std::span<const std::pair<int, str_type>>{rules.begin(), rules.size()}) {}
+    Lexer(Lexer&&) noexcept = default;
+    Lexer& operator=(Lexer&&) noexcept = default;
+
+    /// true, если все выражения правил скомпилировались.
+    bool isValid() const {
+        return valid_;
+    }
+
+    /*!
+     * @brief Выделить токен, начинающийся в позиции pos.
+     * @param text - текст.
+     * @param pos - позиция начала токена, меньше длины текста.
+     * @return LexToken<K> - самое длинное совпадение правил, или токен error до ближайшей позиции,
+     *      с которой начинается какой-либо токен.
+     */
+    SIMREX_API token_type token_at(str_type text, size_t pos) const;
+
+    /// Итератор по токенам текста. Токены вычисляются по мере продвижения.
+    class iterator {
+    public:
+        using value_type = token_type;
+        using difference_type = std::ptrdiff_t;
+        using iterator_concept = std::input_iterator_tag;
+
+        iterator() = default;
+        iterator(const Lexer* lexer, str_type text) : lexer_(lexer), text_(text) {
+            advance(0);
+        }
+        const token_type& operator*() const {
+            return token_;
+        }
+        const token_type* operator->() const {
+            return &token_;
+        }
+        iterator& operator++() {
+            advance(token_.pos + token_.text.length());
+            return *this;
+        }
+        void operator++(int) {
+            ++*this;
+        }
+        bool operator==(std::default_sentinel_t) const {
+            return done_;
+        }
+
+    protected:
+        void advance(size_t pos) {
+            done_ = pos >= text_.length();
+            if (!done_) {
+                token_ = lexer_->token_at(text_, pos);
+            }
+        }
+
+        const Lexer* lexer_ = nullptr;
+        str_type text_;
+        token_type token_{};
+        bool done_ = true;
+    };
+
+    /// Диапазон токенов текста для использования в range-for.
+    struct token_range {
+        const Lexer* lexer;
+        str_type text;
+
+        iterator begin() const {
+            return {lexer, text};
+        }
+        std::default_sentinel_t end() const {
+            return {};
+        }
+    };
+
+    /*!
+     * @brief Получить ленивую последовательность токенов текста.
+     * @param text - текст. Должен жить, пока используются токены.
+     * @return token_range - диапазон для range-for.
+     */
+    token_range tokens(str_type text) const {
+        return {this, text};
+    }
+
+protected:
+    // Самое длинное совпадение правил в позиции: индекс правила и длина в символах.
+    SIMREX_API std::pair<size_t, size_t> longest_at(str_type text, size_t pos) const;
+
+    std::vector<int> ids_;
+    std::vector<OnigRegexp<K>> rules_;
+    // Правила, которые могут начаться с ASCII символа, и последний элемент - с не ASCII символа.
+    std::vector<std::vector<uint32_t>> dispatch_;
+    bool valid_ = false;
+};
+
+using LexerA = Lexer<u8s>;
+using LexerW = Lexer<uws>;
+using LexerU = Lexer<u16s>;
+using LexerUU = Lexer<u32s>;
+
 } // namespace simrex
+
+#ifdef SIMREX_HEADER_ONLY
+#include <simrex/onig-inl.h>
+#include <simrex/mapped_file-inl.h>
+#include <simrex/rex_analysis-inl.h>
+#include <simrex/rex_lexer-inl.h>
+#include <simrex/rex_prefilter-inl.h>
+#include <simrex/rex_trigram-inl.h>
+#endif
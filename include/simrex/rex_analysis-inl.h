@@ -0,0 +1,462 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация статического анализа шаблонов: оценка риска перебора и выбор захватывающих групп.
+* Подключается из src/rex_analysis.cpp, а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <simrex/rex_syntax.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+namespace simrex {
+
+namespace detail {
+
+using syntax::CharSet;
+using syntax::RexNode;
+
+// Ограничения размера анализа: при их превышении отчёт помечается как неполный.
+constexpr size_t maxPositions = 160;
+// Повторения с верхней границей больше этой считаются неограниченными.
+constexpr unsigned boundAsInfinite = 16;
+// Сколько раз разворачивать обязательные и необязательные копии тела повторения.
+constexpr unsigned maxCopies = 2;
+// Предельная глубина рекурсии построения автомата.
+constexpr unsigned maxBuildNesting = 4 * syntax::maxNesting;
+
+/*
+ * Автомат Глушкова: каждое вхождение символа в шаблон - отдельное состояние.
+ * Переход в состояние помечен множеством символов этого состояния.
+ */
+class Glushkov {
+public:
+    struct Position {
+        CharSet set;
+        // Позиция в шаблоне самого внутреннего неограниченного повторения, содержащего состояние.
+        size_t loop;
+        // Количество неограниченных повторений, содержащих состояние.
+        unsigned depth;
+    };
+
+    struct Frag {
+        bool nullable = true;
+        std::vector<int> first, last;
+    };
+
+    std::vector<Position> positions;
+    std::vector<std::vector<int>> follow;
+    // Переходы, добавленные повторно разными повторениями, например во вложенных (a*)*.
+    std::vector<std::pair<int, int>> parallel;
+    bool overflow = false;
+
+    explicit Glushkov(const RexNode& root) {
+        collect_groups(root);
+        Frag f = build(root, size_t(-1), 0, 0);
+        first = std::move(f.first);
+    }
+
+    std::vector<int> first;
+
+protected:
+    std::map<std::pair<bool, unsigned>, const RexNode*> groups_;
+    unsigned nesting_ = 0;
+
+    void collect_groups(const RexNode& root) {
+        std::vector<const RexNode*> stack{&root};
+        while (!stack.empty()) {
+            const RexNode& node = *stack.back();
+            stack.pop_back();
+            if (node.kind == RexNode::Group && node.capture) {
+                groups_.emplace(std::make_pair(node.named, node.group), &node);
+            }
+            for (const auto& child: node.children) {
+                stack.push_back(&child);
+            }
+        }
+    }
+
+    static void append(std::vector<int>& to, const std::vector<int>& from) {
+        to.insert(to.end(), from.begin(), from.end());
+        std::sort(to.begin(), to.end());
+        to.erase(std::unique(to.begin(), to.end()), to.end());
+    }
+
+    void link(const std::vector<int>& from, const std::vector<int>& to) {
+        for (int f: from) {
+            for (int t: to) {
+                if (std::binary_search(follow[f].begin(), follow[f].end(), t)) {
+                    parallel.emplace_back(f, t);
+                }
+            }
+            append(follow[f], to);
+        }
+    }
+
+    Frag concat(Frag a, const Frag& b) {
+        link(a.last, b.first);
+        if (a.nullable) {
+            append(a.first, b.first);
+        }
+        if (b.nullable) {
+            append(a.last, b.last);
+        } else {
+            a.last = b.last;
+        }
+        a.nullable = a.nullable && b.nullable;
+        return a;
+    }
+
+    Frag build(const RexNode& node, size_t loop, unsigned depth, unsigned refDepth) {
+        Frag res;
+        // Глубину дерева ограничивает разборщик, но обратные ссылки вставляют копии групп - ограничиваем и здесь.
+        if (overflow || nesting_ >= maxBuildNesting) {
+            overflow = true;
+            return res;
+        }
+        struct Nesting {
+            unsigned& depth;
+            ~Nesting() {
+                depth--;
+            }
+        } nesting{++nesting_};
+        switch (node.kind) {
+        case RexNode::Empty:
+            break;
+        case RexNode::Set: {
+            if (positions.size() >= maxPositions) {
+                overflow = true;
+                break;
+            }
+            int p = int(positions.size());
+            positions.push_back({node.set, loop, depth});
+            follow.emplace_back();
+            res.nullable = false;
+            res.first.push_back(p);
+            res.last.push_back(p);
+            break;
+        }
+        case RexNode::Concat:
+            for (const auto& child: node.children) {
+                res = concat(std::move(res), build(child, loop, depth, refDepth));
+            }
+            break;
+        case RexNode::Alt:
+            res.nullable = false;
+            for (const auto& child: node.children) {
+                Frag f = build(child, loop, depth, refDepth);
+                res.nullable = res.nullable || f.nullable;
+                append(res.first, f.first);
+                append(res.last, f.last);
+            }
+            break;
+        case RexNode::Group:
+            if (!node.children.empty()) {
+                res = build(node.children[0], loop, depth, refDepth);
+            }
+            break;
+        case RexNode::Backref: {
+            // Обратную ссылку моделируем копией группы, на которую она ссылается.
+            auto it = groups_.find(std::make_pair(node.named, node.group));
+            if (it != groups_.end() && refDepth < 2) {
+                res = build(*it->second, loop, depth, refDepth + 1);
+            }
+            break;
+        }
+        case RexNode::Repeat: {
+            const RexNode& body = node.children[0];
+            bool unbounded = node.max == RexNode::inf || node.max > boundAsInfinite;
+            unsigned required = std::min(node.min, maxCopies);
+            unsigned optional = unbounded ? 0 : std::min(node.max - node.min, maxCopies);
+            for (unsigned i = 0; i < required; i++) {
+                res = concat(std::move(res), build(body, loop, depth, refDepth));
+            }
+            for (unsigned i = 0; i < optional; i++) {
+                Frag f = build(body, loop, depth, refDepth);
+                f.nullable = true;
+                res = concat(std::move(res), f);
+            }
+            if (unbounded) {
+                Frag f = build(body, node.pos, depth + 1, refDepth);
+                link(f.last, f.first);
+                f.nullable = true;
+                res = concat(std::move(res), f);
+            }
+            break;
+        }
+        }
+        return res;
+    }
+};
+
+// Поиск компонент сильной связности алгоритмом Тарьяна без рекурсии.
+template<typename Edges>
+std::vector<int> strong_components(size_t count, const std::vector<int>& roots, Edges&& edges, int& compCount) {
+    std::vector<int> index(count, -1), low(count, 0), comp(count, -1);
+    std::vector<char> onStack(count, 0);
+    std::vector<int> stack;
+    struct Frame {
+        int node;
+        std::vector<int> next;
+        size_t i;
+    };
+    std::vector<Frame> calls;
+    int counter = 0;
+    compCount = 0;
+    for (int root: roots) {
+        if (index[root] >= 0) {
+            continue;
+        }
+        calls.push_back({root, edges(root), 0});
+        index[root] = low[root] = counter++;
+        stack.push_back(root);
+        onStack[root] = 1;
+        while (!calls.empty()) {
+            Frame& f = calls.back();
+            if (f.i < f.next.size()) {
+                int to = f.next[f.i++];
+                if (index[to] < 0) {
+                    index[to] = low[to] = counter++;
+                    stack.push_back(to);
+                    onStack[to] = 1;
+                    calls.push_back({to, edges(to), 0});
+                } else if (onStack[to]) {
+                    low[f.node] = std::min(low[f.node], index[to]);
+                }
+                continue;
+            }
+            int node = f.node;
+            if (low[node] == index[node]) {
+                for (;;) {
+                    int top = stack.back();
+                    stack.pop_back();
+                    onStack[top] = 0;
+                    comp[top] = compCount;
+                    if (top == node) {
+                        break;
+                    }
+                }
+                compCount++;
+            }
+            calls.pop_back();
+            if (!calls.empty()) {
+                int parent = calls.back().node;
+                low[parent] = std::min(low[parent], low[node]);
+            }
+        }
+    }
+    return comp;
+}
+
+SIMREX_INLINE void add_finding(RexRiskReport& report, RexRisk risk, RexRiskKind kind, size_t pos) {
+    for (const auto& f: report.findings) {
+        if (f.pos == pos && f.risk >= risk) {
+            return;
+        }
+    }
+    report.findings.push_back({risk, kind, pos});
+    report.risk = std::max(report.risk, risk);
+}
+
+// Анализ неоднозначности автомата Глушкова.
+SIMREX_INLINE void analyze_automaton(const Glushkov& g, RexRiskReport& report) {
+    const size_t n = g.positions.size();
+    if (n == 0) {
+        return;
+    }
+    std::vector<char> overlap(n * n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            overlap[i * n + j] = g.positions[i].set.intersects(g.positions[j].set);
+        }
+    }
+    // Произведение автомата на себя: пара состояний, достижимых по одному и тому же тексту.
+    auto pairEdges = [&](int node) {
+        std::vector<int> next;
+        size_t i = size_t(node) / n, j = size_t(node) % n;
+        for (int k: g.follow[i]) {
+            for (int l: g.follow[j]) {
+                if (overlap[size_t(k) * n + size_t(l)]) {
+                    next.push_back(int(size_t(k) * n + size_t(l)));
+                }
+            }
+        }
+        return next;
+    };
+    std::vector<int> roots;
+    for (size_t i = 0; i < n; i++) {
+        roots.push_back(int(i * n + i));
+    }
+    int pairComps;
+    std::vector<int> comp = strong_components(n * n, roots, pairEdges, pairComps);
+
+    // Компоненты, в которых есть циклы.
+    std::vector<char> cyclic(size_t(pairComps), 0);
+    std::vector<int> compSize(size_t(pairComps), 0);
+    for (size_t v = 0; v < n * n; v++) {
+        if (comp[v] >= 0) {
+            compSize[size_t(comp[v])]++;
+        }
+    }
+    for (size_t v = 0; v < n * n; v++) {
+        if (comp[v] < 0) {
+            continue;
+        }
+        if (compSize[size_t(comp[v])] > 1) {
+            cyclic[size_t(comp[v])] = 1;
+        } else {
+            for (int to: pairEdges(int(v))) {
+                if (size_t(to) == v) {
+                    cyclic[size_t(comp[v])] = 1;
+                }
+            }
+        }
+    }
+
+    // Экспоненциальная неоднозначность: диагональная пара (q, q) в одной компоненте с парой (p, p'), p != p'.
+    std::vector<char> hasOffDiagonal(size_t(pairComps), 0);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            int c = comp[i * n + j];
+            if (i != j && c >= 0) {
+                hasOffDiagonal[size_t(c)] = 1;
+            }
+        }
+    }
+    // Если в цикле участвуют состояния вложенного повторения, причина - вложенные квантификаторы.
+    std::vector<char> nested(size_t(pairComps), 0);
+    for (size_t q = 0; q < n; q++) {
+        int c = comp[q * n + q];
+        if (c >= 0 && g.positions[q].depth > 1) {
+            nested[size_t(c)] = 1;
+        }
+    }
+    for (size_t q = 0; q < n; q++) {
+        int c = comp[q * n + q];
+        if (c >= 0 && hasOffDiagonal[size_t(c)]) {
+            add_finding(report, RexRisk::Exponential, nested[size_t(c)] ? RexRiskKind::NestedQuantifier : RexRiskKind::OverlappingAlternation,
+                g.positions[q].loop);
+        }
+    }
+
+    // Полиномиальная неоднозначность: два разных цикла p и q, q достижим из p, и есть текст,
+    // по которому одновременно можно крутиться и в p, и в q.
+    int stateComps;
+    std::vector<int> allStates(n);
+    for (size_t i = 0; i < n; i++) {
+        allStates[i] = int(i);
+    }
+    std::vector<int> stateComp = strong_components(n, allStates, [&](int s) { return g.follow[size_t(s)]; }, stateComps);
+    std::vector<char> reach(n * n, 0);
+    for (size_t p = 0; p < n; p++) {
+        std::vector<int> queue{int(p)};
+        while (!queue.empty()) {
+            int s = queue.back();
+            queue.pop_back();
+            for (int to: g.follow[size_t(s)]) {
+                if (!reach[p * n + size_t(to)]) {
+                    reach[p * n + size_t(to)] = 1;
+                    queue.push_back(to);
+                }
+            }
+        }
+    }
+    // Два разных перехода между одними и теми же состояниями внутри цикла - тоже экспоненциальная неоднозначность.
+    for (const auto& [from, to]: g.parallel) {
+        if (from == to || reach[size_t(to) * n + size_t(from)]) {
+            add_finding(report, RexRisk::Exponential, RexRiskKind::NestedQuantifier, g.positions[size_t(from)].loop);
+        }
+    }
+    for (size_t p = 0; p < n; p++) {
+        for (size_t q = 0; q < n; q++) {
+            int c = comp[p * n + q];
+            if (p != q && c >= 0 && cyclic[size_t(c)] && stateComp[p] != stateComp[q] && reach[p * n + q]) {
+                add_finding(report, RexRisk::Polynomial, RexRiskKind::AdjacentQuantifiers, g.positions[q].loop);
+            }
+        }
+    }
+}
+
+// Собирает захватывающие группы, которые надо сделать незахватывающими: позиция открывающей скобки и длина
+// заголовка группы. plain - заодно собрать и обычные группы "(...)". Возвращает false, если в шаблоне есть
+// обратные ссылки, вызовы подвыражений или условные конструкции.
+template<typename K>
+bool dropped_groups(const RexNode& node, simple_str<K> pattern, std::span<const unsigned> keep, bool plain, std::vector<std::pair<size_t, size_t>>& cuts) {
+    const K* p = pattern.symbols() + node.pos;
+    if (node.kind == RexNode::Backref) {
+        return false;
+    }
+    if (node.kind == RexNode::Group) {
+        if (!node.capture && node.pos + 2 < pattern.length() && p[1] == '?' && p[2] == '(') {
+            // Условная конструкция (?(cond)...).
+            return false;
+        }
+        if (node.capture && std::find(keep.begin(), keep.end(), node.group) == keep.end()) {
+            size_t header = 1;
+            if (node.named) {
+                K close = p[2] == '\'' ? K('\'') : K('>');
+                while (p[header] != close) {
+                    header++;
+                }
+                header++;
+            }
+            cuts.emplace_back(node.pos, header);
+        } else if (plain && !node.capture && node.pos + 1 < pattern.length() && p[0] == '(' && p[1] != '?' && p[1] != '*') {
+            cuts.emplace_back(node.pos, 1);
+        }
+    }
+    for (const auto& child: node.children) {
+        if (!dropped_groups(child, pattern, keep, plain, cuts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace detail
+
+template<typename K>
+RexRiskReport OnigRegexp<K>::analyze_risk(str_type pattern) {
+    RexRiskReport report;
+    syntax::ParsedRex parsed = syntax::parse_rex(pattern);
+    if (!parsed.ok) {
+        report.complete = false;
+        return report;
+    }
+    detail::Glushkov automaton{parsed.root};
+    if (automaton.overflow) {
+        report.complete = false;
+        return report;
+    }
+    detail::analyze_automaton(automaton, report);
+    std::sort(report.findings.begin(), report.findings.end(), [](const auto& a, const auto& b) { return a.pos < b.pos; });
+    return report;
+}
+
+template<typename K>
+OnigRegexp<K> OnigRegexp<K>::capture_subset(str_type pattern, std::span<const unsigned> groups) {
+    syntax::ParsedRex parsed = syntax::parse_rex(pattern);
+    std::vector<std::pair<size_t, size_t>> cuts;
+    // Если убираются все именованные группы, обычные группы в новом шаблоне снова стали бы захватывающими,
+    // поэтому их тоже делаем незахватывающими.
+    bool plain = parsed.named && std::none_of(groups.begin(), groups.end(), [&](unsigned g) { return g >= 1 && g <= parsed.groups; });
+    if (!parsed.ok || !detail::dropped_groups(parsed.root, pattern, groups, plain, cuts)) {
+        return {};
+    }
+    std::sort(cuts.begin(), cuts.end());
+    std::basic_string<K> result;
+    result.reserve(pattern.length() + cuts.size() * 2);
+    size_t from = 0;
+    for (const auto& [pos, header]: cuts) {
+        result.append(pattern.symbols() + from, pos - from);
+        result += K('(');
+        result += K('?');
+        result += K(':');
+        from = pos + header;
+    }
+    result.append(pattern.symbols() + from, pattern.length() - from);
+    return OnigRegexp{str_type{result.data(), result.size()}};
+}
+
+} // namespace simrex
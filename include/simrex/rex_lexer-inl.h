@@ -0,0 +1,151 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация Lexer.
+* Подключается из src/rex_lexer.cpp, а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <simrex/rex_syntax.h>
+
+namespace simrex {
+
+namespace detail {
+
+using syntax::CharSet;
+using syntax::RexNode;
+
+constexpr size_t nonAscii = 128;
+
+// Собирает множество первых символов непустых совпадений узла. Возвращает true, если узел может совпасть с пустой строкой.
+SIMREX_INLINE bool first_chars(const RexNode& node, CharSet& out) {
+    switch (node.kind) {
+    case RexNode::Empty:
+        return true;
+    case RexNode::Set:
+        out.merge(node.set);
+        return false;
+    case RexNode::Concat:
+        for (const auto& child: node.children) {
+            if (!first_chars(child, out)) {
+                return false;
+            }
+        }
+        return true;
+    case RexNode::Alt: {
+        bool nullable = false;
+        for (const auto& child: node.children) {
+            nullable |= first_chars(child, out);
+        }
+        return nullable;
+    }
+    case RexNode::Repeat:
+        return first_chars(node.children[0], out) || node.min == 0 || node.max == 0;
+    case RexNode::Group:
+        return node.children.empty() || first_chars(node.children[0], out);
+    case RexNode::Backref:
+        break;
+    }
+    // Обратная ссылка может начинаться с чего угодно.
+    out.ascii.set();
+    out.cats = CharSet::All;
+    return true;
+}
+
+SIMREX_INLINE bool has_ascii_letters(const CharSet& set) {
+    for (uint32_t c = 'A'; c <= 'z'; c++) {
+        if (c <= 'Z' || c >= 'a') {
+            if (set.ascii.test(c)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Позиция следующего символа, с пропуском продолжений UTF-8 и младших суррогатов UTF-16.
+template<typename K>
+size_t next_char(const K* text, size_t pos, size_t length) {
+    pos++;
+    if constexpr (sizeof(K) == 1) {
+        while (pos < length && (static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80) {
+            pos++;
+        }
+    } else if constexpr (sizeof(K) == 2) {
+        if (pos < length && (uint16_t(text[pos]) & 0xFC00) == 0xDC00) {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+} // namespace detail
+
+template<typename K>
+Lexer<K>::Lexer(std::span<const std::pair<int, str_type>> rules) : dispatch_(detail::nonAscii + 1), valid_(true) {
+    ids_.reserve(rules.size());
+    rules_.reserve(rules.size());
+    for (const auto& [id, pattern]: rules) {
+        uint32_t idx = uint32_t(rules_.size());
+        ids_.push_back(id);
+        rules_.emplace_back(pattern);
+        if (!rules_.back().isValid()) {
+            valid_ = false;
+            continue;
+        }
+        detail::CharSet first;
+        syntax::ParsedRex parsed = syntax::parse_rex(pattern);
+        if (parsed.ok) {
+            detail::first_chars(parsed.root, first);
+        } else {
+            first.ascii.set();
+            first.cats = detail::CharSet::All;
+        }
+        for (size_t c = 0; c < detail::nonAscii; c++) {
+            if (first.ascii.test(c)) {
+                dispatch_[c].push_back(idx);
+            }
+        }
+        // Буквы при игнорировании регистра совпадают и с некоторыми не ASCII символами (k - K).
+        if (first.cats || detail::has_ascii_letters(first)) {
+            dispatch_[detail::nonAscii].push_back(idx);
+        }
+    }
+}
+
+template<typename K>
+std::pair<size_t, size_t> Lexer<K>::longest_at(str_type text, size_t pos) const {
+    using rt = RexTraits<K>;
+    std::make_unsigned_t<K> unit = text.symbols()[pos];
+    const auto& candidates = dispatch_[unit < detail::nonAscii ? unit : detail::nonAscii];
+    const OnigUChar *start = rt::toChar(text.symbols()), *end = start + rt::toLen(text.length()), *at = start + rt::toLen(pos);
+    std::pair<size_t, size_t> best{0, 0};
+    for (uint32_t idx: candidates) {
+        int len = onig_match(rules_[idx], start, end, at, nullptr, ONIG_OPTION_NONE);
+        if (len > 0 && rt::fromLen(len) > best.second) {
+            best = {idx, rt::fromLen(len)};
+        }
+    }
+    return best;
+}
+
+template<typename K>
+typename Lexer<K>::token_type Lexer<K>::token_at(str_type text, size_t pos) const {
+    const size_t length = text.length();
+    if (pos >= length) {
+        return {error, pos, {}};
+    }
+    if (dispatch_.empty()) {
+        return {error, pos, text(pos, length - pos)};
+    }
+    auto [rule, len] = longest_at(text, pos);
+    if (len) {
+        return {ids_[rule], pos, text(pos, len)};
+    }
+    size_t to = detail::next_char(text.symbols(), pos, length);
+    while (to < length && !longest_at(text, to).second) {
+        to = detail::next_char(text.symbols(), to, length);
+    }
+    return {error, pos, text(pos, to - pos)};
+}
+
+} // namespace simrex
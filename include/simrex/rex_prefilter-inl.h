@@ -0,0 +1,403 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация RexSet и его литерального префильтра.
+* Подключается из src/rex_prefilter.cpp, а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <simrex/rex_syntax.h>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <string>
+
+namespace simrex {
+
+namespace detail {
+
+using syntax::RexNode;
+
+// Максимальное количество альтернатив в наборе литералов.
+constexpr size_t maxAlternatives = 16;
+// Литералы длиннее этого обрезаются, чтобы не раздувать автомат.
+constexpr size_t maxLiteralLength = 32;
+// Множество символов не длиннее этого разворачивается в альтернативы.
+constexpr size_t maxSetExpand = 4;
+
+using Literal = std::u32string;
+
+/*
+ * Что известно о тексте, совпадающем с узлом шаблона.
+ * exact - узел совпадает ровно с одной из строк set.
+ * Иначе set - набор литералов, хотя бы один из которых обязательно входит в совпадение.
+ * Пустой set у неточного узла - обязательных литералов нет.
+ */
+struct LitInfo {
+    bool exact = false;
+    std::vector<Literal> set;
+
+    static LitInfo empty() {
+        return {true, {Literal{}}};
+    }
+    static LitInfo any() {
+        return {};
+    }
+};
+
+// Насколько хорошо набор отсекает тексты: чем длиннее самый короткий литерал, тем лучше.
+SIMREX_INLINE size_t quality(const std::vector<Literal>& set) {
+    if (set.empty()) {
+        return 0;
+    }
+    size_t minLen = size_t(-1);
+    for (const auto& lit: set) {
+        minLen = std::min(minLen, lit.size());
+    }
+    return minLen;
+}
+
+SIMREX_INLINE bool better(const std::vector<Literal>& a, const std::vector<Literal>& b) {
+    size_t qa = quality(a), qb = quality(b);
+    return qa != qb ? qa > qb : a.size() < b.size();
+}
+
+SIMREX_INLINE void dedup(std::vector<Literal>& set) {
+    std::sort(set.begin(), set.end());
+    set.erase(std::unique(set.begin(), set.end()), set.end());
+}
+
+SIMREX_INLINE std::vector<Literal> product(const std::vector<Literal>& left, const std::vector<Literal>& right) {
+    std::vector<Literal> result;
+    result.reserve(left.size() * right.size());
+    for (const auto& l: left) {
+        for (const auto& r: right) {
+            result.push_back(l + r);
+        }
+    }
+    dedup(result);
+    return result;
+}
+
+SIMREX_INLINE bool too_long(const std::vector<Literal>& set) {
+    return std::any_of(set.begin(), set.end(), [](const Literal& lit) { return lit.size() > maxLiteralLength; });
+}
+
+SIMREX_INLINE LitInfo set_info(const RexNode& node) {
+    if (node.literal) {
+        // Коды 0x80-0xFF могли прийти из \xHH, которые oniguruma понимает как байты, а не символы.
+        if (node.cp >= 0x80 && node.cp <= 0xFF) {
+            return LitInfo::any();
+        }
+        return {true, {Literal(1, char32_t(node.cp))}};
+    }
+    // Буквы без признака литерала появляются при игнорировании регистра, а у него в Unicode есть
+    // неочевидные пары (s - ſ, k - K, ss - ß), поэтому такие множества не разворачиваем.
+    if (node.set.cats || node.set.ascii.count() > maxSetExpand) {
+        return LitInfo::any();
+    }
+    LitInfo info{true, {}};
+    for (uint32_t c = 0; c < 128; c++) {
+        if (node.set.ascii.test(c)) {
+            if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+                return LitInfo::any();
+            }
+            info.set.emplace_back(1, char32_t(c));
+        }
+    }
+    return info.set.empty() ? LitInfo::any() : info;
+}
+
+SIMREX_INLINE LitInfo extract(const RexNode& node);
+
+SIMREX_INLINE LitInfo concat_info(const RexNode& node) {
+    LitInfo cur = LitInfo::empty();
+    std::vector<Literal> best;
+    bool allExact = true;
+    auto consider = [&](const std::vector<Literal>& set) {
+        if (quality(set) && (best.empty() || better(set, best))) {
+            best = set;
+        }
+    };
+    for (const auto& child: node.children) {
+        LitInfo c = extract(child);
+        if (c.exact) {
+            if (cur.set.size() * c.set.size() <= maxAlternatives) {
+                auto joined = product(cur.set, c.set);
+                if (!too_long(joined)) {
+                    cur.set = std::move(joined);
+                    continue;
+                }
+            }
+            // Точный участок стал слишком большим - запоминаем его и начинаем новый.
+            allExact = false;
+            consider(cur.set);
+            cur = std::move(c);
+        } else {
+            allExact = false;
+            consider(cur.set);
+            consider(c.set);
+            cur = LitInfo::empty();
+        }
+    }
+    if (allExact) {
+        return cur;
+    }
+    consider(cur.set);
+    return {false, std::move(best)};
+}
+
+SIMREX_INLINE LitInfo alt_info(const RexNode& node) {
+    LitInfo result{true, {}};
+    for (const auto& child: node.children) {
+        LitInfo c = extract(child);
+        if (!c.exact) {
+            result.exact = false;
+        }
+        if (!quality(c.set) && !c.exact) {
+            return LitInfo::any();
+        }
+        result.set.insert(result.set.end(), c.set.begin(), c.set.end());
+    }
+    dedup(result.set);
+    if (result.set.size() > maxAlternatives) {
+        return LitInfo::any();
+    }
+    if (!result.exact && !quality(result.set)) {
+        // Одна из альтернатив может совпасть с пустой строкой.
+        return LitInfo::any();
+    }
+    return result;
+}
+
+SIMREX_INLINE LitInfo repeat_info(const RexNode& node) {
+    if (node.max == 0) {
+        return LitInfo::empty();
+    }
+    LitInfo c = extract(node.children[0]);
+    if (node.min == 0) {
+        return LitInfo::any();
+    }
+    if (c.exact && node.min == node.max) {
+        LitInfo result = LitInfo::empty();
+        for (unsigned i = 0; i < node.min && result.exact; i++) {
+            if (result.set.size() * c.set.size() > maxAlternatives) {
+                result.exact = false;
+                break;
+            }
+            auto joined = product(result.set, c.set);
+            if (too_long(joined)) {
+                result.exact = false;
+                break;
+            }
+            result.set = std::move(joined);
+        }
+        if (result.exact) {
+            return result;
+        }
+    }
+    // Хотя бы одна копия тела обязательна.
+    return {false, quality(c.set) ? std::move(c.set) : std::vector<Literal>{}};
+}
+
+SIMREX_INLINE LitInfo extract(const RexNode& node) {
+    switch (node.kind) {
+    case RexNode::Empty:
+        // Якоря и проверки не потребляют символов, поэтому соседние литералы идут в тексте подряд.
+        return LitInfo::empty();
+    case RexNode::Set:
+        return set_info(node);
+    case RexNode::Concat:
+        return concat_info(node);
+    case RexNode::Alt:
+        return alt_info(node);
+    case RexNode::Repeat:
+        return repeat_info(node);
+    case RexNode::Group:
+        return node.children.empty() ? LitInfo::empty() : extract(node.children[0]);
+    case RexNode::Backref:
+        break;
+    }
+    return LitInfo::any();
+}
+
+// Литерал в кодовых единицах K, как он лежит в памяти текста.
+template<typename K>
+std::string encode(const Literal& lit) {
+    std::basic_string<K> units;
+    for (char32_t cp: lit) {
+        if constexpr (sizeof(K) == 1) {
+            if (cp < 0x80) {
+                units += K(cp);
+            } else if (cp < 0x800) {
+                units += K(0xC0 | (cp >> 6));
+                units += K(0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                units += K(0xE0 | (cp >> 12));
+                units += K(0x80 | ((cp >> 6) & 0x3F));
+                units += K(0x80 | (cp & 0x3F));
+            } else {
+                units += K(0xF0 | (cp >> 18));
+                units += K(0x80 | ((cp >> 12) & 0x3F));
+                units += K(0x80 | ((cp >> 6) & 0x3F));
+                units += K(0x80 | (cp & 0x3F));
+            }
+        } else if constexpr (sizeof(K) == 2) {
+            if (cp < 0x10000) {
+                units += K(cp);
+            } else {
+                cp -= 0x10000;
+                units += K(0xD800 | (cp >> 10));
+                units += K(0xDC00 | (cp & 0x3FF));
+            }
+        } else {
+            units += K(cp);
+        }
+    }
+    return std::string(reinterpret_cast<const char*>(units.data()), units.size() * sizeof(K));
+}
+
+} // namespace detail
+
+/*
+ * Автомат Ахо-Корасик по байтам текста. Байты, не встречающиеся в литералах, объединены в один класс,
+ * поэтому таблица переходов занимает состояния * классы, а не состояния * 256.
+ */
+struct RexPrefilter {
+    // Классов может быть 257: все 256 байтов в литералах и класс 0 для остальных, поэтому не uint8_t.
+    std::array<uint16_t, 256> classes{};
+    unsigned classCount = 1;
+    // next[state * classCount + class] - следующее состояние.
+    std::vector<uint32_t> next;
+    // Выражения, литерал которых заканчивается в состоянии.
+    std::vector<std::vector<uint32_t>> out;
+    // Ближайшее по суффиксным ссылкам состояние с непустым out, 0 - нет.
+    std::vector<uint32_t> outLink;
+    // Выражения без обязательных литералов, проверяются всегда.
+    std::vector<uint32_t> always;
+
+    void build(const std::vector<std::pair<std::string, uint32_t>>& literals) {
+        for (const auto& [lit, _]: literals) {
+            for (unsigned char c: lit) {
+                if (!classes[c]) {
+                    classes[c] = uint16_t(classCount++);
+                }
+            }
+        }
+        // Бор с разреженными переходами.
+        std::vector<std::map<uint16_t, uint32_t>> trie(1);
+        out.assign(1, {});
+        for (const auto& [lit, rex]: literals) {
+            uint32_t state = 0;
+            for (unsigned char c: lit) {
+                uint16_t cls = classes[c];
+                auto it = trie[state].find(cls);
+                if (it == trie[state].end()) {
+                    it = trie[state].emplace(cls, uint32_t(trie.size())).first;
+                    trie.emplace_back();
+                    out.emplace_back();
+                }
+                state = it->second;
+            }
+            out[state].push_back(rex);
+        }
+        // Обход в ширину: суффиксные ссылки и полная таблица переходов.
+        const size_t states = trie.size();
+        next.assign(states * classCount, 0);
+        outLink.assign(states, 0);
+        std::vector<uint32_t> fail(states, 0), queue;
+        queue.reserve(states);
+        for (const auto& [cls, to]: trie[0]) {
+            next[cls] = to;
+            queue.push_back(to);
+        }
+        for (size_t head = 0; head < queue.size(); head++) {
+            uint32_t state = queue[head];
+            uint32_t f = fail[state];
+            outLink[state] = out[f].empty() ? outLink[f] : f;
+            for (unsigned cls = 0; cls < classCount; cls++) {
+                next[state * classCount + cls] = next[f * classCount + cls];
+            }
+            for (const auto& [cls, to]: trie[state]) {
+                fail[to] = next[f * classCount + cls];
+                next[state * classCount + cls] = to;
+                queue.push_back(to);
+            }
+        }
+    }
+
+    // Отмечает выражения, литералы которых встретились в тексте.
+    void scan(const uint8_t* text, size_t length, std::vector<char>& hit) const {
+        if (next.empty()) {
+            return;
+        }
+        uint32_t state = 0;
+        for (size_t i = 0; i < length; i++) {
+            state = next[state * classCount + classes[text[i]]];
+            for (uint32_t s = out[state].empty() ? outLink[state] : state; s; s = outLink[s]) {
+                for (uint32_t rex: out[s]) {
+                    hit[rex] = 1;
+                }
+            }
+        }
+    }
+};
+
+SIMREX_INLINE void RexPrefilterDeleter::operator()(RexPrefilter* prefilter) const {
+    delete prefilter;
+}
+
+template<typename K>
+RexSet<K>::RexSet(std::span<const str_type> patterns) : prefilter_(new RexPrefilter) {
+    std::vector<std::pair<std::string, uint32_t>> literals;
+    regexps_.reserve(patterns.size());
+    for (const str_type& pattern: patterns) {
+        uint32_t idx = uint32_t(regexps_.size());
+        regexps_.emplace_back(pattern);
+        if (!regexps_.back().isValid()) {
+            continue;
+        }
+        syntax::ParsedRex parsed = syntax::parse_rex(pattern);
+        detail::LitInfo info = parsed.ok ? detail::extract(parsed.root) : detail::LitInfo::any();
+        if (!detail::quality(info.set)) {
+            prefilter_->always.push_back(idx);
+            continue;
+        }
+        for (const detail::Literal& lit: info.set) {
+            literals.emplace_back(detail::encode<K>(lit), idx);
+        }
+    }
+    prefilter_->build(literals);
+}
+
+template<typename K>
+std::vector<size_t> RexSet<K>::candidates(str_type text) const {
+    std::vector<size_t> result;
+    if (!prefilter_) {
+        return result;
+    }
+    std::vector<char> hit(regexps_.size(), 0);
+    for (uint32_t idx: prefilter_->always) {
+        hit[idx] = 1;
+    }
+    prefilter_->scan(reinterpret_cast<const uint8_t*>(text.symbols()), text.length() * sizeof(K), hit);
+    for (size_t idx = 0; idx < hit.size(); idx++) {
+        if (hit[idx]) {
+            result.push_back(idx);
+        }
+    }
+    return result;
+}
+
+template<typename K>
+std::vector<size_t> RexSet<K>::matching(str_type text) const {
+    std::vector<size_t> result = candidates(text);
+    std::erase_if(result, [&](size_t idx) { return regexps_[idx].search(text) == str::npos; });
+    return result;
+}
+
+template<typename K>
+size_t RexSet<K>::unfiltered() const {
+    return prefilter_ ? prefilter_->always.size() : 0;
+}
+
+} // namespace simrex
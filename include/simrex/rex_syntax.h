@@ -0,0 +1,1056 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Внутренний разборщик синтаксиса регулярных выражений oniguruma.
+* Строит упрощённое дерево шаблона, достаточное для статического анализа (оценка риска
+* катастрофического перебора, извлечение обязательных литералов). Сам поиск всегда выполняет oniguruma.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+namespace simrex::syntax {
+
+// Предельная глубина вложенности групп, классов символов и квантификаторов. Глубже разбор не идёт, чтобы
+// ни он, ни обходы дерева не переполнили стек: шаблон считается неразобранным. Уровень разбора и анализа
+// занимает около килобайта стека, поэтому предел меньше, чем у самой oniguruma (4096), и укладывается
+// в стек потока в 1 Мб.
+constexpr unsigned maxNesting = 256;
+// Наибольший номер обратной ссылки, который Oniguruma распознаёт в \NNN.
+constexpr unsigned maxBackrefNum = 1000;
+
+/*!
+ * @brief Множество символов.
+ * @details ASCII символы хранятся точно, остальные - грубо, по категориям: буквы и цифры, пробельные и прочие.
+ */
+struct CharSet {
+    enum Category : uint8_t {
+        Word = 1,
+        Space = 2,
+        Other = 4,
+        All = Word | Space | Other,
+    };
+    std::bitset<128> ascii;
+    uint8_t cats = 0;
+
+    static uint8_t classify(uint32_t cp) {
+        if (cp == 0x85 || cp == 0xA0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029 || cp == 0x202F
+            || cp == 0x205F || cp == 0x3000) {
+            return Space;
+        }
+        if ((cp >= 0xC0 && cp <= 0x24F && cp != 0xD7 && cp != 0xF7) || (cp >= 0x370 && cp <= 0x3FF) || (cp >= 0x400 && cp <= 0x52F)
+            || (cp >= 0x590 && cp <= 0x6FF) || (cp >= 0x3040 && cp <= 0x30FF) || (cp >= 0x4E00 && cp <= 0x9FFF)
+            || (cp >= 0xAC00 && cp <= 0xD7AF)) {
+            return Word;
+        }
+        return Word | Other;
+    }
+
+    void add(uint32_t cp) {
+        if (cp < 128) {
+            ascii.set(cp);
+        } else {
+            cats |= classify(cp);
+        }
+    }
+    void add_range(uint32_t from, uint32_t to) {
+        for (uint32_t c = from; c <= to && c < 128; c++) {
+            ascii.set(c);
+        }
+        if (to >= 128) {
+            from = std::max(from, 128u);
+            cats |= to - from > 0x100 ? uint8_t(All) : uint8_t(classify(from) | classify(to));
+        }
+    }
+    void merge(const CharSet& other) {
+        ascii |= other.ascii;
+        cats |= other.cats;
+    }
+    void intersect(const CharSet& other) {
+        ascii &= other.ascii;
+        cats &= other.cats;
+    }
+    void invert() {
+        ascii.flip();
+        cats = All & ~cats;
+    }
+    bool intersects(const CharSet& other) const {
+        return (ascii & other.ascii).any() || (cats & other.cats) != 0;
+    }
+    bool empty() const {
+        return ascii.none() && !cats;
+    }
+};
+
+struct RexNode {
+    enum Kind : uint8_t {
+        Empty,   // Пустая строка или конструкция, не потребляющая символов (якоря, lookaround).
+        Set,     // Один символ из множества.
+        Concat,
+        Alt,
+        Repeat,
+        Group,
+        Backref, // Обратная ссылка или вызов подвыражения.
+    };
+    static constexpr unsigned inf = unsigned(-1);
+
+    Kind kind = Empty;
+    // Для Set: узел - литерал (символ cp без игнорирования регистра).
+    bool literal = false;
+    // Для Group: захватывающая группа.
+    bool capture = false;
+    // Для Group и Backref: именованная группа или ссылка по имени.
+    bool named = false;
+    // Для Repeat и Group: атомарная конструкция (possessive квантификатор, (?>...)).
+    bool atomic = false;
+    // Для Empty: узел - проверка (lookaround, якорь), а не просто пустота.
+    bool assertion = false;
+    // Для Set: код символа литерала.
+    uint32_t cp = 0;
+    unsigned min = 0, max = 0;
+    // Для захватывающих групп и обратных ссылок - номер группы.
+    unsigned group = 0;
+    // Позиция конструкции в шаблоне, в кодовых единицах.
+    size_t pos = 0;
+    CharSet set;
+    std::vector<RexNode> children;
+};
+
+struct ParsedRex {
+    RexNode root;
+    bool ok = true;
+    size_t error_pos = 0;
+    unsigned groups = 0;
+    // Есть именованные группы: тогда нумеруются только они, а обычные группы не захватывающие.
+    bool named = false;
+};
+
+template<typename K>
+class RexParser {
+public:
+    RexParser(simple_str<K> pattern) : begin_(pattern.symbols()), p_(begin_), end_(begin_ + pattern.length()) {}
+
+    ParsedRex parse() {
+        ParsedRex result;
+        Flags flags;
+        result.root = parse_alt(flags);
+        if (ok_ && p_ < end_) {
+            // Лишняя закрывающая скобка.
+            fail();
+        }
+        if (named_ > 0) {
+            // При наличии именованных групп обычные группы в oniguruma не захватывающие.
+            renumber(result.root);
+        }
+        result.ok = ok_;
+        result.error_pos = error_pos_;
+        result.groups = named_ > 0 ? named_ : plain_;
+        result.named = named_ > 0;
+        return result;
+    }
+
+protected:
+    struct Flags {
+        bool icase = false;
+        bool extend = false;
+        bool dotall = false;
+    };
+
+    static uint32_t u(K k) {
+        if constexpr (sizeof(K) == 1) {
+            return (unsigned char)k;
+        } else {
+            return (uint32_t)k;
+        }
+    }
+
+    size_t pos() const {
+        return size_t(p_ - begin_);
+    }
+
+    void fail() {
+        if (ok_) {
+            ok_ = false;
+            error_pos_ = pos();
+        }
+        p_ = end_;
+    }
+
+    bool at(char c) const {
+        return p_ < end_ && u(*p_) == uint32_t((unsigned char)c);
+    }
+
+    static bool is_digit(uint32_t c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_alnum(uint32_t c) {
+        return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static int hex_value(uint32_t c) {
+        if (c >= '0' && c <= '9')
+            return int(c - '0');
+        if (c >= 'a' && c <= 'f')
+            return int(c - 'a' + 10);
+        if (c >= 'A' && c <= 'F')
+            return int(c - 'A' + 10);
+        return -1;
+    }
+
+    static void add_case(CharSet& set) {
+        for (uint32_t c = 'a'; c <= 'z'; c++) {
+            if (set.ascii.test(c) || set.ascii.test(c - 32)) {
+                set.ascii.set(c);
+                set.ascii.set(c - 32);
+            }
+        }
+    }
+
+    static CharSet word_set() {
+        CharSet s;
+        s.add_range('a', 'z');
+        s.add_range('A', 'Z');
+        s.add_range('0', '9');
+        s.add('_');
+        s.cats = CharSet::Word;
+        return s;
+    }
+    static CharSet digit_set() {
+        CharSet s;
+        s.add_range('0', '9');
+        s.cats = CharSet::Word;
+        return s;
+    }
+    static CharSet space_set() {
+        CharSet s;
+        s.add_range('\t', '\r');
+        s.add(' ');
+        s.cats = CharSet::Space;
+        return s;
+    }
+    static CharSet hex_set() {
+        CharSet s;
+        s.add_range('0', '9');
+        s.add_range('a', 'f');
+        s.add_range('A', 'F');
+        return s;
+    }
+    static CharSet any_set() {
+        CharSet s;
+        s.ascii.set();
+        s.cats = CharSet::All;
+        return s;
+    }
+
+    RexNode make_set(CharSet set, size_t at) {
+        RexNode node;
+        node.kind = RexNode::Set;
+        node.set = std::move(set);
+        node.pos = at;
+        return node;
+    }
+
+    RexNode make_char(uint32_t cp, const Flags& flags, size_t at) {
+        RexNode node;
+        node.kind = RexNode::Set;
+        node.pos = at;
+        node.cp = cp;
+        node.set.add(cp);
+        if (flags.icase && (cp >= 128 || ((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z'))) {
+            add_case(node.set);
+        } else {
+            node.literal = true;
+        }
+        return node;
+    }
+
+    RexNode make_empty(size_t at, bool assertion) {
+        RexNode node;
+        node.pos = at;
+        node.assertion = assertion;
+        return node;
+    }
+
+    static RexNode make_repeat(RexNode body, unsigned min, unsigned max, size_t at) {
+        RexNode rep;
+        rep.kind = RexNode::Repeat;
+        rep.pos = at;
+        rep.min = min;
+        rep.max = max;
+        rep.children.emplace_back(std::move(body));
+        return rep;
+    }
+
+    void skip_extended() {
+        while (p_ < end_) {
+            uint32_t c = u(*p_);
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+                p_++;
+            } else if (c == '#') {
+                while (p_ < end_ && u(*p_) != '\n') {
+                    p_++;
+                }
+            } else {
+                break;
+            }
+        }
+    }
+
+    // Читает один символ шаблона, декодируя UTF-8 и UTF-16.
+    uint32_t read_char() {
+        uint32_t c = u(*p_++);
+        if constexpr (sizeof(K) == 1) {
+            if (c >= 0x80) {
+                int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+                c &= 0x3F >> extra;
+                for (; extra > 0 && p_ < end_ && (u(*p_) & 0xC0) == 0x80; extra--) {
+                    c = (c << 6) | (u(*p_++) & 0x3F);
+                }
+            }
+        } else if constexpr (sizeof(K) == 2) {
+            if (c >= 0xD800 && c < 0xDC00 && p_ < end_ && u(*p_) >= 0xDC00 && u(*p_) < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (u(*p_++) - 0xDC00);
+            }
+        }
+        return c;
+    }
+
+    // Учёт глубины вложенности на время разбора вложенной конструкции.
+    struct Nesting {
+        RexParser& parser;
+        bool ok;
+        explicit Nesting(RexParser& parser_) : parser(parser_), ok(++parser_.depth_ <= maxNesting) {
+            if (!ok) {
+                parser.fail();
+            }
+        }
+        ~Nesting() {
+            parser.depth_--;
+        }
+    };
+
+    RexNode parse_alt(Flags& flags) {
+        Nesting nesting{*this};
+        if (!nesting.ok) {
+            return make_empty(pos(), false);
+        }
+        RexNode alt;
+        alt.kind = RexNode::Alt;
+        alt.pos = pos();
+        alt.children.emplace_back(parse_concat(flags));
+        while (ok_ && at('|')) {
+            p_++;
+            alt.children.emplace_back(parse_concat(flags));
+        }
+        if (alt.children.size() == 1) {
+            return std::move(alt.children[0]);
+        }
+        return alt;
+    }
+
+    RexNode parse_concat(Flags& flags) {
+        RexNode cat;
+        cat.kind = RexNode::Concat;
+        cat.pos = pos();
+        for (;;) {
+            if (flags.extend) {
+                skip_extended();
+            }
+            if (!ok_ || p_ >= end_ || at('|') || at(')')) {
+                break;
+            }
+            if (at('(') && p_ + 1 < end_ && u(p_[1]) == '?' && is_inline_options()) {
+                // (?imx) без двоеточия действует до конца текущей группы, включая следующие альтернативы.
+                Flags inner = flags;
+                parse_options(inner);
+                p_++; // ')'
+                cat.children.emplace_back(parse_alt(inner));
+                break;
+            }
+            RexNode atom = parse_atom(flags);
+            parse_quantifiers(atom, flags);
+            cat.children.emplace_back(std::move(atom));
+        }
+        if (cat.children.size() == 1) {
+            return std::move(cat.children[0]);
+        }
+        if (cat.children.empty()) {
+            cat.kind = RexNode::Empty;
+        }
+        return cat;
+    }
+
+    // Проверяет, что с текущей позиции "(?" идёт группа опций без двоеточия, вида (?im-x).
+    bool is_inline_options() const {
+        for (const K* s = p_ + 2; s < end_; s++) {
+            uint32_t c = u(*s);
+            if (c == ')') {
+                return s > p_ + 2;
+            }
+            if (c != '-' && c != 'i' && c != 'm' && c != 'x' && c != 'W' && c != 'D' && c != 'S' && c != 'P' && c != 'a' && c != 'L'
+                && c != 'I') {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Разбирает флаги опций после "(?" и останавливается на ':' или ')'.
+    void parse_options(Flags& flags) {
+        p_ += 2;
+        bool on = true;
+        while (p_ < end_ && !at(':') && !at(')')) {
+            switch (u(*p_)) {
+            case '-':
+                on = false;
+                break;
+            case 'i':
+                flags.icase = on;
+                break;
+            case 'x':
+                flags.extend = on;
+                break;
+            case 'm':
+                flags.dotall = on;
+                break;
+            default:
+                break;
+            }
+            p_++;
+        }
+        if (p_ >= end_) {
+            fail();
+        }
+    }
+
+    void parse_quantifiers(RexNode& atom, const Flags& flags) {
+        // Каждый квантификатор подряд, как в a{2}{3}{4}, добавляет узлу уровень вложенности.
+        for (unsigned stacked = depth_;; stacked++) {
+            if (flags.extend) {
+                skip_extended();
+            }
+            if (!ok_ || p_ >= end_) {
+                return;
+            }
+            size_t at_pos = pos();
+            unsigned min, max;
+            bool interval = false;
+            uint32_t c = u(*p_);
+            if (c == '*') {
+                min = 0, max = RexNode::inf;
+            } else if (c == '+') {
+                min = 1, max = RexNode::inf;
+            } else if (c == '?') {
+                min = 0, max = 1;
+            } else if (c == '{' && parse_interval(min, max)) {
+                interval = true;
+            } else {
+                return;
+            }
+            if (!interval) {
+                p_++;
+            }
+            if (stacked >= maxNesting) {
+                fail();
+                return;
+            }
+            atom = make_repeat(std::move(atom), min, max, at_pos);
+            if (at('?')) {
+                p_++;
+            } else if (!interval && at('+')) {
+                // Possessive квантификатор: возврат внутрь не делается.
+                atom.atomic = true;
+                p_++;
+            }
+        }
+    }
+
+    // Разбор {n}, {n,}, {,m}, {n,m}. Если это не интервал, '{' считается обычным символом.
+    bool parse_interval(unsigned& min, unsigned& max) {
+        const K* s = p_ + 1;
+        auto read_num = [&](unsigned& value) {
+            const K* start = s;
+            value = 0;
+            while (s < end_ && is_digit(u(*s))) {
+                value = std::min(value * 10 + (u(*s) - '0'), 100000u);
+                s++;
+            }
+            return s > start;
+        };
+        bool hasMin = read_num(min);
+        if (s < end_ && u(*s) == ',') {
+            s++;
+            if (!read_num(max)) {
+                max = RexNode::inf;
+            }
+            if (!hasMin) {
+                min = 0;
+                if (max == RexNode::inf) {
+                    return false;
+                }
+            }
+        } else {
+            if (!hasMin) {
+                return false;
+            }
+            max = min;
+        }
+        if (s >= end_ || u(*s) != '}') {
+            return false;
+        }
+        p_ = s + 1;
+        return true;
+    }
+
+    RexNode parse_group(Flags& flags) {
+        size_t at_pos = pos();
+        RexNode group;
+        group.kind = RexNode::Group;
+        group.pos = at_pos;
+        Flags inner = flags;
+        bool conditional = false;
+        if (p_ + 1 < end_ && u(p_[1]) == '?') {
+            if (p_ + 2 >= end_) {
+                fail();
+                return group;
+            }
+            uint32_t c = u(p_[2]);
+            if (c == '#') {
+                while (p_ < end_ && !at(')')) {
+                    p_++;
+                }
+                close_group();
+                return make_empty(at_pos, false);
+            }
+            if (c == ':') {
+                p_ += 3;
+            } else if (c == '>') {
+                group.atomic = true;
+                p_ += 3;
+            } else if (c == '=' || c == '!') {
+                p_ += 3;
+                parse_alt(inner);
+                close_group();
+                return make_empty(at_pos, true);
+            } else if (c == '<' && p_ + 3 < end_ && (u(p_[3]) == '=' || u(p_[3]) == '!')) {
+                p_ += 4;
+                parse_alt(inner);
+                close_group();
+                return make_empty(at_pos, true);
+            } else if (c == '<' || c == '\'' || c == 'P') {
+                // Именованная группа (?<name>...), (?'name'...), (?P<name>...).
+                p_ += c == 'P' ? 4 : 3;
+                uint32_t close = c == '\'' ? '\'' : '>';
+                const K* nameStart = p_;
+                while (p_ < end_ && u(*p_) != close) {
+                    p_++;
+                }
+                if (p_ >= end_) {
+                    fail();
+                    return group;
+                }
+                names_.emplace_back(simple_str<K>{nameStart, size_t(p_ - nameStart)}, ++named_);
+                p_++;
+                group.capture = true;
+                group.named = true;
+                group.group = named_;
+            } else if (c == '~') {
+                // Absent operator (?~...) - считаем, что он совпадает с чем угодно.
+                p_ += 3;
+                parse_alt(inner);
+                close_group();
+                return make_repeat(make_set(any_set(), at_pos), 0, RexNode::inf, at_pos);
+            } else if (c == '(') {
+                // Условная конструкция (?(cond)yes|no).
+                p_ += 3;
+                while (p_ < end_ && !at(')')) {
+                    p_++;
+                }
+                close_group();
+                conditional = true;
+            } else {
+                parse_options(inner);
+                if (p_ < end_) {
+                    p_++; // ':'
+                }
+            }
+        } else {
+            p_++;
+            group.capture = true;
+            group.group = ++plain_;
+        }
+        group.children.emplace_back(parse_alt(inner));
+        if (conditional && group.children[0].kind != RexNode::Alt) {
+            // Без ветки "нет" при невыполненном условии конструкция совпадает с пустой строкой.
+            RexNode alt;
+            alt.kind = RexNode::Alt;
+            alt.pos = at_pos;
+            alt.children.emplace_back(std::move(group.children[0]));
+            alt.children.emplace_back(make_empty(at_pos, false));
+            group.children[0] = std::move(alt);
+        }
+        close_group();
+        return group;
+    }
+
+    void close_group() {
+        if (at(')')) {
+            p_++;
+        } else {
+            fail();
+        }
+    }
+
+    // Разбор числового кода символа после \x, \u, \0.
+    uint32_t read_code(unsigned base, int maxDigits) {
+        uint32_t value = 0;
+        for (int i = 0; i < maxDigits && p_ < end_; i++) {
+            int d = hex_value(u(*p_));
+            if (d < 0 || unsigned(d) >= base) {
+                break;
+            }
+            value = value * base + unsigned(d);
+            p_++;
+        }
+        return value;
+    }
+
+    uint32_t read_braced_code(unsigned base) {
+        p_++; // '{'
+        uint32_t value = read_code(base, 8);
+        while (p_ < end_ && !at('}')) {
+            p_++;
+        }
+        if (p_ < end_) {
+            p_++;
+        }
+        return value;
+    }
+
+    // Классы символов вида \w, \d, \p{...}. Возвращает false, если это не класс.
+    bool parse_class_escape(uint32_t c, CharSet& set) {
+        switch (c) {
+        case 'w':
+            set = word_set();
+            return true;
+        case 'W':
+            set = word_set(), set.invert();
+            return true;
+        case 'd':
+            set = digit_set();
+            return true;
+        case 'D':
+            set = digit_set(), set.invert();
+            return true;
+        case 's':
+            set = space_set();
+            return true;
+        case 'S':
+            set = space_set(), set.invert();
+            return true;
+        case 'h':
+            set = hex_set();
+            return true;
+        case 'H':
+            set = hex_set(), set.invert();
+            return true;
+        case 'p':
+        case 'P':
+            if (at('{')) {
+                while (p_ < end_ && !at('}')) {
+                    p_++;
+                }
+                if (p_ < end_) {
+                    p_++;
+                }
+            }
+            set = any_set();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Байт, заданный через \xHH или восьмеричный код. Oniguruma вставляет его в шаблон как есть,
+    // поэтому отдельным символом он является только в однобайтовой записи и только для ASCII.
+    static uint32_t raw_byte(uint32_t value) {
+        return sizeof(K) == 1 && value < 0x80 ? value : unknown;
+    }
+
+    // \cX, \C-X, \M-X, в том числе вложенные (\C-\M-x). Точно вычисляется только управляющий
+    // ASCII символ, для остального возвращается unknown.
+    uint32_t read_control(uint32_t kind) {
+        Nesting nesting{*this};
+        if (!nesting.ok) {
+            return unknown;
+        }
+        if (kind != 'c') {
+            if (!at('-')) {
+                return unknown;
+            }
+            p_++;
+        }
+        if (p_ >= end_) {
+            fail();
+            return unknown;
+        }
+        uint32_t c = read_char();
+        if (c == '\\') {
+            if (p_ >= end_) {
+                fail();
+                return unknown;
+            }
+            uint32_t inner = read_char();
+            c = inner == 'c' || inner == 'C' || inner == 'M' ? read_control(inner) : unknown;
+        } else if (c == '?' && kind != 'M') {
+            return 0x7F;
+        }
+        if (c >= 0x80 || kind == 'M') {
+            return unknown;
+        }
+        return c & 0x9F;
+    }
+
+    // Escape-последовательность, обозначающая один символ. Возвращает unknown, если её значение
+    // анализ определить не может - такой символ не должен попасть в обязательные литералы.
+    uint32_t parse_char_escape(uint32_t c) {
+        switch (c) {
+        case 't':
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 'f':
+            return '\f';
+        case 'v':
+            return '\v';
+        case 'a':
+            return 7;
+        case 'e':
+            return 27;
+        case 'b':
+            // Вне класса \b - граница слова и сюда не попадает, внутри класса это backspace.
+            return 8;
+        case 'x':
+            return at('{') ? read_braced_code(16) : raw_byte(read_code(16, 2));
+        case 'u':
+            return read_code(16, 4);
+        case '0':
+            return raw_byte(read_code(8, 2));
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+            p_--;
+            return raw_byte(read_code(8, 3));
+        case '8':
+        case '9':
+            return c;
+        case 'o':
+            return at('{') ? read_braced_code(8) : unknown;
+        case 'c':
+        case 'C':
+        case 'M':
+            return read_control(c);
+        default:
+            if (c >= 0x80) {
+                // Экранированный не-ASCII символ, дочитываем его целиком.
+                p_--;
+                return read_char();
+            }
+            // Прочие буквы и цифры Oniguruma может трактовать по-своему, знаки препинания означают сами себя.
+            return is_alnum(c) ? unknown : c;
+        }
+    }
+
+    // Разбирает тело класса [...] после открывающей скобки, останавливается после ']'.
+    CharSet parse_class_body(const Flags& flags) {
+        CharSet set;
+        Nesting nesting{*this};
+        if (!nesting.ok) {
+            return set;
+        }
+        bool negate = false;
+        if (at('^')) {
+            negate = true;
+            p_++;
+        }
+        bool first = true;
+        for (;;) {
+            if (p_ >= end_) {
+                fail();
+                return set;
+            }
+            if (at(']') && !first) {
+                p_++;
+                break;
+            }
+            first = false;
+            if (at('[')) {
+                p_++;
+                if (at(':')) {
+                    // POSIX класс [:alpha:] - приближённо любой видимый символ.
+                    while (p_ + 1 < end_ && !(at(':') && u(p_[1]) == ']')) {
+                        p_++;
+                    }
+                    p_ = end_ - p_ > 2 ? p_ + 2 : end_;
+                    CharSet posix;
+                    posix.add_range(0x21, 0x7E);
+                    posix.cats = CharSet::All;
+                    set.merge(posix);
+                } else {
+                    set.merge(parse_class_body(flags));
+                }
+                continue;
+            }
+            if (at('&') && p_ + 1 < end_ && u(p_[1]) == '&') {
+                // Правая часть пересечения разбирается как самостоятельный класс до конца текущего.
+                p_ += 2;
+                set.intersect(parse_class_body(flags));
+                break;
+            }
+            CharSet item;
+            uint32_t from;
+            if (!parse_class_item(item, from)) {
+                set.merge(item);
+                continue;
+            }
+            if (at('-') && p_ + 1 < end_ && u(p_[1]) != ']') {
+                p_++;
+                CharSet next;
+                uint32_t to;
+                if (parse_class_item(next, to) && to >= from) {
+                    set.add_range(from, to);
+                } else {
+                    set.merge(item);
+                    set.add('-');
+                    set.merge(next);
+                }
+            } else {
+                set.merge(item);
+            }
+        }
+        if (flags.icase) {
+            add_case(set);
+        }
+        if (negate) {
+            set.invert();
+        }
+        return set;
+    }
+
+    // Один элемент класса. Возвращает true, если это одиночный символ (может быть началом диапазона).
+    bool parse_class_item(CharSet& item, uint32_t& cp) {
+        if (at('\\')) {
+            p_++;
+            if (p_ >= end_) {
+                fail();
+                return false;
+            }
+            uint32_t c = u(*p_++);
+            if (parse_class_escape(c, item)) {
+                return false;
+            }
+            cp = parse_char_escape(c);
+            if (cp == unknown) {
+                item = any_set();
+                return false;
+            }
+        } else {
+            cp = read_char();
+        }
+        item.add(cp);
+        return true;
+    }
+
+    RexNode parse_escape(const Flags& flags) {
+        size_t at_pos = pos();
+        p_++;
+        if (p_ >= end_) {
+            fail();
+            return make_empty(at_pos, false);
+        }
+        uint32_t c = u(*p_++);
+        CharSet set;
+        if (parse_class_escape(c, set)) {
+            return make_set(std::move(set), at_pos);
+        }
+        switch (c) {
+        case 'A':
+        case 'z':
+        case 'Z':
+        case 'b':
+        case 'B':
+        case 'G':
+        case 'K':
+        case 'y':
+        case 'Y':
+            return make_empty(at_pos, true);
+        case 'R':
+        case 'X': {
+            // Перевод строки или графема: один или несколько символов.
+            RexNode rep = make_repeat(make_set(c == 'R' ? space_set() : any_set(), at_pos), 1, 2, at_pos);
+            rep.atomic = true;
+            return rep;
+        }
+        case 'N':
+        case 'O': {
+            CharSet any = any_set();
+            if (c == 'N') {
+                any.ascii.reset('\n');
+            }
+            return make_set(std::move(any), at_pos);
+        }
+        case 'k':
+        case 'g':
+            return parse_reference(at_pos);
+        default:
+            break;
+        }
+        if (c >= '1' && c <= '9') {
+            // Как в Oniguruma: число - обратная ссылка, если оно не больше 9 или числа уже открытых
+            // групп, иначе это восьмеричный код символа, а \8 и \9 означают сами цифры.
+            const K* digits = p_;
+            unsigned num = c - '0';
+            while (p_ < end_ && is_digit(u(*p_)) && num <= maxBackrefNum) {
+                num = num * 10 + (u(*p_++) - '0');
+            }
+            if (num <= maxBackrefNum && (num <= 9 || num <= plain_ + named_)) {
+                RexNode ref;
+                ref.kind = RexNode::Backref;
+                ref.pos = at_pos;
+                ref.group = num;
+                return ref;
+            }
+            p_ = digits;
+        }
+        uint32_t cp = parse_char_escape(c);
+        if (cp == unknown) {
+            return make_set(any_set(), at_pos);
+        }
+        return make_char(cp, flags, at_pos);
+    }
+
+    // \k<name>, \k<1>, \g<name> и т.п.
+    RexNode parse_reference(size_t at_pos) {
+        RexNode ref;
+        ref.kind = RexNode::Backref;
+        ref.pos = at_pos;
+        if (!at('<') && !at('\'')) {
+            fail();
+            return ref;
+        }
+        uint32_t close = at('<') ? '>' : '\'';
+        p_++;
+        const K* nameStart = p_;
+        while (p_ < end_ && u(*p_) != close) {
+            p_++;
+        }
+        if (p_ >= end_) {
+            fail();
+            return ref;
+        }
+        simple_str<K> name{nameStart, size_t(p_ - nameStart)};
+        p_++;
+        unsigned num = 0;
+        bool numeric = name.length() > 0;
+        for (size_t i = 0; i < name.length(); i++) {
+            uint32_t c = u(name.symbols()[i]);
+            if (!is_digit(c)) {
+                numeric = false;
+                break;
+            }
+            num = num * 10 + (c - '0');
+        }
+        if (numeric) {
+            ref.group = num;
+            return ref;
+        }
+        for (const auto& [n, idx]: names_) {
+            if (n.length() == name.length() && std::equal(n.begin(), n.end(), name.begin())) {
+                ref.group = idx;
+                ref.named = true;
+                return ref;
+            }
+        }
+        // Ссылка вперёд или на неизвестное имя - анализ её не учитывает.
+        return ref;
+    }
+
+    RexNode parse_atom(Flags& flags) {
+        size_t at_pos = pos();
+        uint32_t c = u(*p_);
+        switch (c) {
+        case '(':
+            return parse_group(flags);
+        case '[':
+            p_++;
+            return make_set(parse_class_body(flags), at_pos);
+        case '.': {
+            p_++;
+            CharSet any = any_set();
+            if (!flags.dotall) {
+                any.ascii.reset('\n');
+            }
+            return make_set(std::move(any), at_pos);
+        }
+        case '^':
+        case '$':
+            p_++;
+            return make_empty(at_pos, true);
+        case '\\':
+            return parse_escape(flags);
+        case '*':
+        case '+':
+        case '?':
+            // Квантификатор без операнда.
+            fail();
+            return make_empty(at_pos, false);
+        default:
+            break;
+        }
+        return make_char(read_char(), flags, at_pos);
+    }
+
+    // При наличии именованных групп обычные группы перестают быть захватывающими.
+    static void renumber(RexNode& root) {
+        std::vector<RexNode*> stack{&root};
+        while (!stack.empty()) {
+            RexNode& node = *stack.back();
+            stack.pop_back();
+            if (node.kind == RexNode::Group && node.capture && !node.named) {
+                node.capture = false;
+                node.group = 0;
+            }
+            for (auto& child: node.children) {
+                stack.push_back(&child);
+            }
+        }
+    }
+
+    // Значение escape-последовательности, которое анализ не может определить точно.
+    static constexpr uint32_t unknown = uint32_t(-1);
+
+    const K* begin_;
+    const K* p_;
+    const K* end_;
+    bool ok_ = true;
+    size_t error_pos_ = 0;
+    unsigned depth_ = 0;
+    unsigned plain_ = 0;
+    unsigned named_ = 0;
+    std::vector<std::pair<simple_str<K>, unsigned>> names_;
+};
+
+template<typename K>
+ParsedRex parse_rex(simple_str<K> pattern) {
+    return RexParser<K>{pattern}.parse();
+}
+
+} // namespace simrex::syntax
@@ -0,0 +1,316 @@
+﻿/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Реализация TrigramIndex: построение, запрос по обязательным литералам шаблона, сохранение и загрузка из файла.
+* Использует извлечение литералов префильтра RexSet, поэтому подключается вместе с ним из src/rex_prefilter.cpp,
+* а в режиме SIMREX_HEADER_ONLY - из simrex/onig.h.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <simrex/rex_prefilter-inl.h>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+namespace simrex {
+
+namespace detail {
+
+// Заголовок файла индекса. За ним идут ключи триграмм, выровненные до 8 байт, смещения их списков
+// (на одно больше ключей) и списки номеров документов.
+struct TrigramFileHeader {
+    char magic[8];
+    uint32_t unitSize;
+    uint32_t documents;
+    uint64_t keys;
+    uint64_t postings;
+};
+
+constexpr char trigramMagic[8] = {'S', 'R', 'X', 'T', 'R', 'I', '0', '1'};
+
+// Ключ тройки символов. Для однобайтовых символов точный, для остальных - хэш: коллизии только добавляют
+// лишних кандидатов.
+template<typename K>
+uint32_t trigram_key(const K* units) {
+    if constexpr (sizeof(K) == 1) {
+        return uint32_t(uint8_t(units[0])) << 16 | uint32_t(uint8_t(units[1])) << 8 | uint8_t(units[2]);
+    } else {
+        uint32_t key = uint32_t(units[0]) * 0x9E3779B1u;
+        key = (key ^ uint32_t(units[1])) * 0x85EBCA77u;
+        return (key ^ uint32_t(units[2])) * 0xC2B2AE3Du;
+    }
+}
+
+SIMREX_INLINE std::vector<size_t> all_documents(size_t count) {
+    std::vector<size_t> result(count);
+    for (size_t idx = 0; idx < count; idx++) {
+        result[idx] = idx;
+    }
+    return result;
+}
+
+} // namespace detail
+
+/*
+ * Данные индекса: отсортированные ключи триграмм, смещения их списков документов и сами списки.
+ * Массивы либо принадлежат индексу, либо указывают в отображённый файл.
+ */
+struct TrigramData {
+    uint32_t unitSize = 0;
+    uint32_t documents = 0;
+    std::span<const uint32_t> keys;
+    std::span<const uint64_t> offsets;
+    std::span<const uint32_t> postings;
+
+    std::vector<uint32_t> ownKeys;
+    std::vector<uint64_t> ownOffsets;
+    std::vector<uint32_t> ownPostings;
+    detail::MappedFile file;
+
+    std::span<const uint32_t> documents_of(uint32_t key) const {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        if (it == keys.end() || *it != key) {
+            return {};
+        }
+        size_t idx = size_t(it - keys.begin());
+        return postings.subspan(offsets[idx], offsets[idx + 1] - offsets[idx]);
+    }
+
+    // Документы, в которых есть все триграммы литерала. false - литерал короче триграммы и не отсекает ничего.
+    template<typename K>
+    bool containing(const std::basic_string<K>& literal, std::vector<size_t>& result) const {
+        if (literal.size() < 3) {
+            return false;
+        }
+        std::vector<uint32_t> lits;
+        for (size_t i = 0; i + 3 <= literal.size(); i++) {
+            lits.push_back(detail::trigram_key(literal.data() + i));
+        }
+        std::sort(lits.begin(), lits.end());
+        lits.erase(std::unique(lits.begin(), lits.end()), lits.end());
+        std::vector<std::span<const uint32_t>> lists;
+        for (uint32_t key: lits) {
+            lists.push_back(documents_of(key));
+            if (lists.back().empty()) {
+                result.clear();
+                return true;
+            }
+        }
+        // Пересекаем, начиная с самого короткого списка.
+        std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+        std::vector<uint32_t> current(lists[0].begin(), lists[0].end()), next;
+        for (size_t l = 1; l < lists.size() && !current.empty(); l++) {
+            next.clear();
+            std::set_intersection(current.begin(), current.end(), lists[l].begin(), lists[l].end(), std::back_inserter(next));
+            current.swap(next);
+        }
+        result.assign(current.begin(), current.end());
+        return true;
+    }
+};
+
+SIMREX_INLINE void TrigramDataDeleter::operator()(TrigramData* data) const {
+    delete data;
+}
+
+template<typename K>
+TrigramIndex<K>::TrigramIndex(std::span<const str_type> docs, const ParallelOptions& options) {
+    // Номер документа идёт в младшие 32 бита пары (триграмма, документ) и в списки документов.
+    if (docs.size() > maxDocuments) {
+        return;
+    }
+    data_.reset(new TrigramData);
+    data_->unitSize = sizeof(K);
+    data_->documents = uint32_t(docs.size());
+    size_t total = 0;
+    for (const str_type& doc: docs) {
+        total += doc.length();
+    }
+    unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = unsigned(std::clamp<size_t>(total / std::max<size_t>(options.minChunk, 1), 1, threads));
+
+    // Каждый поток собирает отсортированные пары (триграмма, документ) для своей доли документов.
+    std::vector<size_t> bounds{0};
+    for (size_t t = 1, taken = 0, idx = 0; t < threads; t++) {
+        for (size_t until = total / threads * t; idx < docs.size() && taken < until; idx++) {
+            taken += docs[idx].length();
+        }
+        bounds.push_back(std::max(idx, bounds.back()));
+    }
+    bounds.push_back(docs.size());
+    const size_t chunks = bounds.size() - 1;
+    std::vector<std::vector<uint64_t>> runs(chunks);
+
+    auto process = [&](size_t chunk) {
+        std::vector<uint64_t>& pairs = runs[chunk];
+        std::vector<uint32_t> keys;
+        for (size_t idx = bounds[chunk]; idx < bounds[chunk + 1]; idx++) {
+            const K* units = docs[idx].symbols();
+            const size_t length = docs[idx].length();
+            keys.clear();
+            for (size_t i = 0; i + 3 <= length; i++) {
+                keys.push_back(detail::trigram_key(units + i));
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            for (uint32_t key: keys) {
+                pairs.push_back(uint64_t(key) << 32 | idx);
+            }
+        }
+        std::sort(pairs.begin(), pairs.end());
+    };
+
+    if (chunks > 1) {
+        std::vector<std::thread> workers;
+        workers.reserve(chunks - 1);
+        for (size_t idx = 1; idx < chunks; idx++) {
+            workers.emplace_back(process, idx);
+        }
+        process(0);
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    } else {
+        process(0);
+    }
+
+    // Сливаем отсортированные доли попарно.
+    std::vector<uint64_t> pairs;
+    std::vector<size_t> runBounds{0};
+    for (auto& run: runs) {
+        pairs.insert(pairs.end(), run.begin(), run.end());
+        runBounds.push_back(pairs.size());
+        std::vector<uint64_t>().swap(run);
+    }
+    while (runBounds.size() > 2) {
+        std::vector<size_t> merged{0};
+        for (size_t r = 0; r + 1 < runBounds.size(); r += 2) {
+            if (r + 2 < runBounds.size()) {
+                std::inplace_merge(pairs.begin() + runBounds[r], pairs.begin() + runBounds[r + 1], pairs.begin() + runBounds[r + 2]);
+                merged.push_back(runBounds[r + 2]);
+            } else {
+                merged.push_back(runBounds[r + 1]);
+            }
+        }
+        runBounds.swap(merged);
+    }
+
+    data_->ownPostings.reserve(pairs.size());
+    for (uint64_t pair: pairs) {
+        uint32_t key = uint32_t(pair >> 32);
+        if (data_->ownKeys.empty() || data_->ownKeys.back() != key) {
+            data_->ownKeys.push_back(key);
+            data_->ownOffsets.push_back(data_->ownPostings.size());
+        }
+        data_->ownPostings.push_back(uint32_t(pair));
+    }
+    data_->ownOffsets.push_back(data_->ownPostings.size());
+    data_->keys = data_->ownKeys;
+    data_->offsets = data_->ownOffsets;
+    data_->postings = data_->ownPostings;
+}
+
+template<typename K>
+size_t TrigramIndex<K>::documents() const {
+    return data_ ? data_->documents : 0;
+}
+
+template<typename K>
+size_t TrigramIndex<K>::trigrams() const {
+    return data_ ? data_->keys.size() : 0;
+}
+
+template<typename K>
+std::vector<size_t> TrigramIndex<K>::candidates(str_type pattern) const {
+    if (!data_) {
+        return {};
+    }
+    syntax::ParsedRex parsed = syntax::parse_rex(pattern);
+    detail::LitInfo info = parsed.ok ? detail::extract(parsed.root) : detail::LitInfo::any();
+    if (!detail::quality(info.set)) {
+        return detail::all_documents(data_->documents);
+    }
+    // Совпадение содержит хотя бы один из литералов - объединяем документы по всем литералам.
+    std::vector<size_t> result, docs;
+    for (const detail::Literal& lit: info.set) {
+        std::string bytes = detail::encode<K>(lit);
+        std::basic_string<K> units(reinterpret_cast<const K*>(bytes.data()), bytes.size() / sizeof(K));
+        if (!data_->containing(units, docs)) {
+            return detail::all_documents(data_->documents);
+        }
+        std::vector<size_t> joined;
+        std::set_union(result.begin(), result.end(), docs.begin(), docs.end(), std::back_inserter(joined));
+        result.swap(joined);
+    }
+    return result;
+}
+
+template<typename K>
+std::vector<size_t> TrigramIndex<K>::matching(const OnigRegexp<K>& rex, str_type pattern, std::span<const str_type> docs) const {
+    std::vector<size_t> result = candidates(pattern);
+    std::erase_if(result, [&](size_t idx) { return idx >= docs.size() || rex.search(docs[idx]) == str::npos; });
+    return result;
+}
+
+template<typename K>
+bool TrigramIndex<K>::save(const std::filesystem::path& path) const {
+    TrigramData empty;
+    const TrigramData& data = data_ ? *data_ : empty;
+    detail::TrigramFileHeader header{};
+    std::memcpy(header.magic, detail::trigramMagic, sizeof(header.magic));
+    header.unitSize = sizeof(K);
+    header.documents = data.documents;
+    header.keys = data.keys.size();
+    header.postings = data.postings.size();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(data.keys.data()), std::streamsize(data.keys.size_bytes()));
+    if (data.keys.size() & 1) {
+        const uint32_t pad = 0;
+        out.write(reinterpret_cast<const char*>(&pad), sizeof(pad));
+    }
+    if (data.offsets.empty()) {
+        const uint64_t zero = 0;
+        out.write(reinterpret_cast<const char*>(&zero), sizeof(zero));
+    } else {
+        out.write(reinterpret_cast<const char*>(data.offsets.data()), std::streamsize(data.offsets.size_bytes()));
+    }
+    out.write(reinterpret_cast<const char*>(data.postings.data()), std::streamsize(data.postings.size_bytes()));
+    out.close();
+    return bool(out);
+}
+
+template<typename K>
+bool TrigramIndex<K>::load(const std::filesystem::path& path) {
+    std::unique_ptr<TrigramData, TrigramDataDeleter> data{new TrigramData};
+    if (!data->file.open(path)) {
+        return false;
+    }
+    const uint8_t* bytes = data->file.data();
+    const size_t size = data->file.size();
+    detail::TrigramFileHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, detail::trigramMagic, sizeof(header.magic)) || header.unitSize != sizeof(K)) {
+        return false;
+    }
+    const uint64_t keysBytes = (header.keys + (header.keys & 1)) * sizeof(uint32_t);
+    const uint64_t offsetsBytes = (header.keys + 1) * sizeof(uint64_t);
+    if (header.keys > size || header.postings > size || sizeof(header) + keysBytes + offsetsBytes + header.postings * sizeof(uint32_t) != size) {
+        return false;
+    }
+    data->unitSize = header.unitSize;
+    data->documents = header.documents;
+    data->keys = {reinterpret_cast<const uint32_t*>(bytes + sizeof(header)), size_t(header.keys)};
+    data->offsets = {reinterpret_cast<const uint64_t*>(bytes + sizeof(header) + keysBytes), size_t(header.keys + 1)};
+    data->postings = {reinterpret_cast<const uint32_t*>(bytes + sizeof(header) + keysBytes + offsetsBytes), size_t(header.postings)};
+    if (data->offsets.front() != 0 || data->offsets.back() != header.postings
+        || !std::is_sorted(data->offsets.begin(), data->offsets.end())) {
+        return false;
+    }
+    data_ = std::move(data);
+    return true;
+}
+
+} // namespace simrex
@@ -0,0 +1,249 @@
+/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Наборы правил "регэксп - замена" с горячей заменой без блокировки читателей.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace simrex {
+
+/*!
+ * @brief Ячейка с неизменяемым значением, которое можно заменять, не останавливая читателей (RCU).
+ * @tparam T - тип значения.
+ * @details Читатель берёт значение через read() и держит полученный reader, пока работает с ним. Чтение не
+ *      блокируется и не ждёт писателей: это увеличение одного из двух счётчиков читателей и загрузка указателя.
+ *      Писатель публикует новое значение атомарной заменой указателя, переключает эпоху и ждёт, пока уйдут
+ *      читатели прежней эпохи, после чего удаляет старое значение. Писатели выполняются по одному.
+ *      Читатели должны держать reader недолго: пока он жив, писатель не может освободить старое значение.
+ */
+template<typename T>
+class RcuCell {
+public:
+    /// Доступ читателя к значению. Значение не освобождается, пока объект жив.
+    class reader {
+    public:
+        reader(reader&& other) noexcept : value_(std::exchange(other.value_, nullptr)), counter_(std::exchange(other.counter_, nullptr)) {}
+        reader& operator=(reader&& other) noexcept {
+            if (this != &other) {
+                release();
+                value_ = std::exchange(other.value_, nullptr);
+                counter_ = std::exchange(other.counter_, nullptr);
+            }
+            return *this;
+        }
+        ~reader() {
+            release();
+        }
+
+        explicit operator bool() const {
+            return value_ != nullptr;
+        }
+        const T& operator*() const {
+            return *value_;
+        }
+        const T* operator->() const {
+            return value_;
+        }
+        const T* get() const {
+            return value_;
+        }
+
+    protected:
+        friend class RcuCell;
+        reader(const T* value, std::atomic<size_t>* counter) : value_(value), counter_(counter) {}
+
+        void release() {
+            if (counter_) {
+                counter_->fetch_sub(1);
+                counter_ = nullptr;
+            }
+        }
+
+        const T* value_;
+        std::atomic<size_t>* counter_;
+    };
+
+    RcuCell() = default;
+    explicit RcuCell(std::unique_ptr<T> value) : current_(value.release()) {}
+    RcuCell(const RcuCell&) = delete;
+    RcuCell& operator=(const RcuCell&) = delete;
+    ~RcuCell() {
+        delete current_.load();
+    }
+
+    /*!
+     * @brief Получить текущее значение для чтения.
+     * @return reader - доступ к значению, пустой, если значение ещё не опубликовано.
+     */
+    reader read() const {
+        for (;;) {
+            uint64_t epoch = epoch_.load();
+            std::atomic<size_t>& counter = readers_[epoch & 1].count;
+            counter.fetch_add(1);
+            // Если эпоха сменилась, писатель мог уже не ждать этот счётчик - регистрируемся заново.
+            if (epoch_.load() == epoch) {
+                return {current_.load(), &counter};
+            }
+            counter.fetch_sub(1);
+        }
+    }
+
+    /*!
+     * @brief Опубликовать новое значение.
+     * @param value - новое значение, обычно подготовленное заранее в фоновом потоке.
+     * @return uint64_t - номер версии опубликованного значения.
+     * @details Новые читатели сразу получают новое значение. Вызов возвращается после того, как все читатели
+     *      старого значения его отпустили и оно удалено.
+     */
+    uint64_t publish(std::unique_ptr<T> value) {
+        std::lock_guard lock{writer_};
+        T* old = current_.exchange(value.release());
+        uint64_t result = version_.fetch_add(1) + 1;
+        uint64_t epoch = epoch_.fetch_add(1);
+        std::atomic<size_t>& counter = readers_[epoch & 1].count;
+        while (counter.load()) {
+            std::this_thread::yield();
+        }
+        delete old;
+        return result;
+    }
+
+    /// Создать значение из аргументов и опубликовать его.
+    template<typename... Args>
+    uint64_t emplace(Args&&... args) {
+        return publish(std::make_unique<T>(std::forward<Args>(args)...));
+    }
+
+    /// Номер версии текущего значения, 0 - значение задано в конструкторе или не задано.
+    uint64_t version() const {
+        return version_.load();
+    }
+
+protected:
+    // Счётчики на разных линиях кэша, чтобы читатели двух эпох не мешали друг другу.
+    struct alignas(64) Readers {
+        std::atomic<size_t> count{0};
+    };
+
+    std::atomic<T*> current_{nullptr};
+    mutable Readers readers_[2];
+    std::atomic<uint64_t> epoch_{0};
+    std::atomic<uint64_t> version_{0};
+    std::mutex writer_;
+};
+
+/*!
+ * @brief Упорядоченный набор правил "регулярное выражение - текст замены".
+ * @tparam K - тип символов
+ * @details Набор собирается один раз, а затем только читается: все const методы можно одновременно вызывать
+ *      из любого количества потоков. Для замены набора на лету без блокировки читателей храните его в
+ *      RcuCell<RuleSet<K>> (алиас LiveRuleSet<K>).
+ */
+template<typename K>
+class RuleSet {
+public:
+    using str_type = simple_str<K>;
+
+    RuleSet() = default;
+    /*!
+     * @brief Создаёт набор правил.
+     * @param rules - пары "регулярное выражение - текст замены" в порядке применения.
+     */
+    RuleSet(std::span<const std::pair<str_type, str_type>> rules) {
+        for (const auto& [pattern, replText]: rules) {
+            add(pattern, replText);
+        }
+    }
+    RuleSet(std::initializer_list<std::pair<str_type, str_type>> rules) : RuleSet(std::span<const std::pair<str_type, str_type>>{rules.begin(), rules.size()}) {}
+    RuleSet(RuleSet&&) noexcept = default;
+    RuleSet& operator=(RuleSet&&) noexcept = default;
+
+    /*!
+     * @brief Добавить правило.
+     * @param pattern - регулярное выражение.
+     * @param replText - текст замены, с подстановкой подгрупп как в OnigRegexp::replace.
+     * @return bool - false, если выражение не скомпилировалось. Правило всё равно добавляется, чтобы номера
+     *      правил не сдвигались, но ни с чем не совпадает.
+     */
+    bool add(str_type pattern, str_type replText = {}) {
+        auto& rule = rules_.emplace_back(Rule{OnigRegexp<K>{pattern}, std::vector<K>(replText.symbols(), replText.symbols() + replText.length())});
+        valid_ = valid_ && rule.regexp.isValid();
+        return rule.regexp.isValid();
+    }
+
+    /// true, если все выражения скомпилировались.
+    bool isValid() const {
+        return valid_;
+    }
+
+    /// Количество правил.
+    size_t size() const {
+        return rules_.size();
+    }
+
+    /// Регулярное выражение правила.
+    const OnigRegexp<K>& regexp(size_t rule) const {
+        return rules_[rule].regexp;
+    }
+
+    /// Текст замены правила.
+    str_type replacement(size_t rule) const {
+        return {rules_[rule].replText.data(), rules_[rule].replText.size()};
+    }
+
+    /*!
+     * @brief Найти первое по порядку правило, выражение которого встречается в тексте.
+     * @param text - текст.
+     * @return size_t - номер правила, или -1, если ни одно не совпало.
+     */
+    size_t first_matching(str_type text) const {
+        for (size_t idx = 0; idx < rules_.size(); idx++) {
+            if (rules_[idx].regexp.search(text) != str::npos) {
+                return idx;
+            }
+        }
+        return -1;
+    }
+
+    /*!
+     * @brief Применить к тексту замены всех правил по порядку.
+     * @tparam T - тип результата, строка, владеющая текстом (sstring, lstring).
+     * @param text - исходный текст.
+     * @return T - текст после замен. Каждое правило применяется к результату предыдущего.
+     */
+    template<typename T> requires storable_str<T, K>
+    T apply(str_type text) const {
+        T result = text;
+        for (const Rule& rule: rules_) {
+            result = rule.regexp.replace(result, str_type{rule.replText.data(), rule.replText.size()});
+        }
+        return result;
+    }
+
+protected:
+    struct Rule {
+        OnigRegexp<K> regexp;
+        std::vector<K> replText;
+    };
+
+    std::vector<Rule> rules_;
+    bool valid_ = true;
+};
+
+template<typename K>
+using LiveRuleSet = RcuCell<RuleSet<K>>;
+
+using RuleSetA = RuleSet<u8s>;
+using RuleSetW = RuleSet<uws>;
+using RuleSetU = RuleSet<u16s>;
+using RuleSetUU = RuleSet<u32s>;
+
+} // namespace simrex
@@ -0,0 +1,413 @@
+/*
+* (c) Проект "SimRex", Александр Орефков orefkov@gmail.com
+* Поиск в потоке текста, который поступает блоками, например, при распаковке сжатых логов.
+* Блоки читаются в отдельном потоке через ограниченную очередь, поэтому распаковка идёт одновременно с поиском,
+* а память не зависит от размера потока: очередь блоков плюс окно переноса между ними.
+* Источники для gzip (SIMREX_WITH_ZLIB) и zstd (SIMREX_WITH_ZSTD) подключаются, если при сборке найдены библиотеки.
+*/
+#pragma once
+#include <simrex/onig.h>
+#include <concepts>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <istream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#ifdef SIMREX_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SIMREX_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace simrex {
+
+/*!
+ * @brief Источник блоков текста: заполняет переданный буфер и возвращает количество записанных символов.
+ *      0 - поток закончился. Буфер заполняется целиком везде, кроме конца потока.
+ */
+template<typename S, typename K>
+concept RexBlockSource = requires(S& source, std::span<K> buffer) {
+    { source(buffer) } -> std::convertible_to<size_t>;
+};
+
+/// Параметры поиска в потоке.
+struct StreamOptions {
+    /// Размер блока в символах.
+    size_t blockSize = 65536;
+    /// Окно переноса в символах. Вхождение, пересекающее границу блоков, находится так же, как в склеенном тексте,
+    /// если оно вместе с проверяемым контекстом (просмотр вперёд и назад, \\b) не длиннее window.
+    size_t window = 256;
+    /// Количество прочитанных блоков, ожидающих поиска. 0 - читать блоки в потоке поиска.
+    unsigned queue = 2;
+};
+
+namespace detail {
+
+// Подача блоков из источника, в отдельном потоке или напрямую.
+template<typename K, typename S>
+class RexBlockPipe {
+public:
+    RexBlockPipe(S& source, const StreamOptions& options) : source_(source), blockSize_(std::max<size_t>(options.blockSize, 1)) {
+        buffers_.resize(options.queue ? options.queue + 1 : 1);
+        for (auto& buffer: buffers_) {
+            buffer.resize(blockSize_);
+        }
+        if (options.queue) {
+            for (size_t idx = 1; idx < buffers_.size(); idx++) {
+                free_.push_back(idx);
+            }
+            producer_ = std::thread([this] { produce(); });
+        }
+    }
+    ~RexBlockPipe() {
+        if (producer_.joinable()) {
+            {
+                std::lock_guard lock{mutex_};
+                stop_ = true;
+            }
+            cv_.notify_all();
+            producer_.join();
+        }
+    }
+
+    // Следующий блок, действителен до следующего вызова. Пустой - поток закончился.
+    std::span<const K> next() {
+        if (!producer_.joinable()) {
+            return {buffers_[0].data(), size_t(source_(std::span<K>{buffers_[0]}))};
+        }
+        std::unique_lock lock{mutex_};
+        if (held_ != size_t(-1)) {
+            free_.push_back(held_);
+            held_ = size_t(-1);
+            cv_.notify_all();
+        }
+        cv_.wait(lock, [this] { return !ready_.empty(); });
+        auto [idx, length] = ready_.front();
+        ready_.pop_front();
+        if (!length) {
+            if (error_) {
+                std::rethrow_exception(std::exchange(error_, nullptr));
+            }
+            ready_.emplace_front(idx, length);
+            return {};
+        }
+        held_ = idx;
+        return {buffers_[idx].data(), length};
+    }
+
+protected:
+    void produce() {
+        for (;;) {
+            size_t idx;
+            {
+                std::unique_lock lock{mutex_};
+                cv_.wait(lock, [this] { return stop_ || !free_.empty(); });
+                if (stop_) {
+                    return;
+                }
+                idx = free_.front();
+                free_.pop_front();
+            }
+            size_t length = 0;
+            std::exception_ptr error;
+            try {
+                length = source_(std::span<K>{buffers_[idx]});
+            } catch (...) {
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard lock{mutex_};
+                error_ = error;
+                ready_.emplace_back(idx, length);
+            }
+            cv_.notify_all();
+            if (!length) {
+                return;
+            }
+        }
+    }
+
+    S& source_;
+    size_t blockSize_;
+    std::vector<std::vector<K>> buffers_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<size_t> free_;
+    std::deque<std::pair<size_t, size_t>> ready_;
+    size_t held_ = size_t(-1);
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread producer_;
+};
+
+} // namespace detail
+
+/*!
+ * @brief Найти все вхождения в потоке текста, поступающем блоками.
+ * @param rex - регулярное выражение.
+ * @param source - источник блоков, см. RexBlockSource. При options.queue > 0 вызывается из отдельного потока.
+ * @param onMatch - вызывается для каждого вхождения с аргументами (std::span<const MatchSpan> groups, simple_str<K> match):
+ *      groups - groups_count() элементов, всё вхождение и подгруппы, с положениями от начала потока;
+ *      match - текст вхождения, действителен только во время вызова.
+ * @param options - размер блока, окно переноса и длина очереди блоков.
+ * @param maxCount - максимальное количество для ограничения поиска.
+ * @return size_t - количество найденных вхождений.
+ * @details Вхождения те же, что нашёл бы OnigRegexp::all_matches в склеенном тексте, с теми же ограничениями, что
+ *      у all_matches_segments. Исключение из источника пробрасывается вызывающему.
+ */
+template<typename K, typename S, typename F>
+    requires RexBlockSource<std::remove_cvref_t<S>, K> && std::invocable<F&, std::span<const MatchSpan>, simple_str<K>>
+size_t stream_matches(const OnigRegexp<K>& rex, S&& source, F&& onMatch, const StreamOptions& options = {}, size_t maxCount = -1) {
+    if (!rex.isValid() || !maxCount) {
+        return 0;
+    }
+    const size_t window = std::max<size_t>(options.window, 1);
+    const size_t stride = rex.groups_count();
+    detail::RexBlockPipe<K, std::remove_reference_t<S>> pipe{source, options};
+    std::vector<MatchSpan> spans(stride);
+    // text - окно потока, text[0] находится в потоке на позиции base. pos - откуда ищется следующее вхождение.
+    std::basic_string<K> text;
+    size_t base = 0, pos = 0, count = 0;
+    for (bool eof = false, done = false; !done;) {
+        std::span<const K> block = pipe.next();
+        eof = block.empty();
+        text.append(block.data(), block.size());
+        const size_t textEnd = base + text.length(), tail = textEnd > window ? textEnd - window : 0;
+        for (;;) {
+            if (count >= maxCount) {
+                done = true;
+                break;
+            }
+            size_t found;
+            rex.all_matches_into(simple_str<K>{text.data(), text.length()}, spans, found, pos - base, 1);
+            if (!found) {
+                done = eof;
+                pos = std::max(pos, tail);
+                break;
+            }
+            const MatchSpan match{spans[0].begin + base, spans[0].end + base};
+            // Вхождение у конца окна может продолжиться в следующем блоке - ждём его, если вхождение не длиннее окна.
+            if (!eof && match.end + window > textEnd && match.begin + 2 * window > textEnd) {
+                pos = std::max(pos, std::min(match.begin, tail));
+                break;
+            }
+            for (MatchSpan& span: spans) {
+                if (span.matched()) {
+                    span.begin += base;
+                    span.end += base;
+                }
+            }
+            onMatch(std::span<const MatchSpan>{spans}, simple_str<K>{text.data() + match.begin - base, match.length()});
+            count++;
+            // Как и all_matches, останавливаемся на пустом вхождении и на вхождении до конца текста.
+            if (match.end <= pos || (eof && match.end >= textEnd)) {
+                done = true;
+                break;
+            }
+            pos = match.end;
+        }
+        if (!done && eof) {
+            break;
+        }
+        // Оставляем окно контекста перед pos для просмотра назад.
+        size_t keep = pos > base + window ? pos - window : base;
+        text.erase(0, keep - base);
+        base = keep;
+    }
+    return count;
+}
+
+/*!
+ * @brief Найти все вхождения в потоке текста, поступающем блоками.
+ * @return std::vector<MatchSpan> - по groups_count() элементов на совпадение: всё вхождение, затем подгруппы.
+ *      Положения отсчитываются от начала потока.
+ * @details Параметры как у stream_matches.
+ */
+template<typename K, typename S> requires RexBlockSource<std::remove_cvref_t<S>, K>
+std::vector<MatchSpan> stream_all_matches(const OnigRegexp<K>& rex, S&& source, const StreamOptions& options = {}, size_t maxCount = -1) {
+    std::vector<MatchSpan> result;
+    stream_matches(rex, source, [&](std::span<const MatchSpan> groups, simple_str<K>) {
+        result.insert(result.end(), groups.begin(), groups.end());
+    }, options, maxCount);
+    return result;
+}
+
+/*!
+ * @brief Количество вхождений в потоке текста, поступающем блоками, как OnigRegexp::count_of.
+ * @details Параметры как у stream_matches.
+ */
+template<typename K, typename S> requires RexBlockSource<std::remove_cvref_t<S>, K>
+size_t stream_count(const OnigRegexp<K>& rex, S&& source, const StreamOptions& options = {}, size_t maxCount = -1) {
+    return stream_matches(rex, source, [](std::span<const MatchSpan>, simple_str<K>) {}, options, maxCount);
+}
+
+/*!
+ * @brief Источник блоков из std::istream, без распаковки.
+ * @tparam K - тип символов. Байты потока считаются символами K в порядке байтов платформы.
+ */
+template<typename K = u8s>
+class RexIstreamSource {
+public:
+    explicit RexIstreamSource(std::istream& in) : in_(in) {}
+
+    size_t operator()(std::span<K> buffer) {
+        in_.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(buffer.size_bytes()));
+        return size_t(in_.gcount()) / sizeof(K);
+    }
+
+protected:
+    std::istream& in_;
+};
+
+#ifdef SIMREX_WITH_ZLIB
+/*!
+ * @brief Источник блоков из файла gzip. Несжатый файл читается как есть.
+ * @tparam K - тип символов. Распакованные байты считаются символами K в порядке байтов платформы.
+ * @details При ошибке распаковки или обрезанном файле поток заканчивается, а failed() возвращает true.
+ */
+template<typename K = u8s>
+class RexGzipSource {
+public:
+    explicit RexGzipSource(const std::filesystem::path& path) {
+#ifdef _WIN32
+        file_ = gzopen_w(path.c_str(), "rb");
+#else
+        file_ = gzopen(path.c_str(), "rb");
+#endif
+        if (file_) {
+            gzbuffer(file_, 1 << 17);
+        }
+    }
+    RexGzipSource(const RexGzipSource&) = delete;
+    RexGzipSource& operator=(const RexGzipSource&) = delete;
+    ~RexGzipSource() {
+        if (file_) {
+            gzclose(file_);
+        }
+    }
+
+    /// Файл открылся.
+    explicit operator bool() const {
+        return file_ != nullptr;
+    }
+    /// Файл не открылся или данные повреждены.
+    bool failed() const {
+        return failed_;
+    }
+
+    size_t operator()(std::span<K> buffer) {
+        if (!file_) {
+            failed_ = true;
+            return 0;
+        }
+        // gzread читает не больше INT_MAX байт за вызов.
+        const size_t bytes = std::min<size_t>(buffer.size_bytes(), (size_t(1) << 30)) / sizeof(K) * sizeof(K);
+        int read = gzread(file_, buffer.data(), unsigned(bytes));
+        // Обрезанный файл gzread не считает ошибкой чтения: отдаёт то, что успел распаковать, и запоминает
+        // Z_BUF_ERROR, который виден только через gzerror.
+        int error = Z_OK;
+        gzerror(file_, &error);
+        if (read < 0 || error != Z_OK) {
+            failed_ = true;
+        }
+        return read < 0 ? 0 : size_t(read) / sizeof(K);
+    }
+
+protected:
+    gzFile file_ = nullptr;
+    bool failed_ = false;
+};
+#endif
+
+#ifdef SIMREX_WITH_ZSTD
+/*!
+ * @brief Источник блоков из файла zstd.
+ * @tparam K - тип символов. Распакованные байты считаются символами K в порядке байтов платформы.
+ * @details При ошибке распаковки или обрезанном файле поток заканчивается, а failed() возвращает true.
+ */
+template<typename K = u8s>
+class RexZstdSource {
+public:
+    explicit RexZstdSource(const std::filesystem::path& path) : input_(ZSTD_DStreamInSize()) {
+#ifdef _WIN32
+        file_ = _wfopen(path.c_str(), L"rb");
+#else
+        file_ = std::fopen(path.c_str(), "rb");
+#endif
+        if (file_) {
+            stream_ = ZSTD_createDStream();
+        }
+    }
+    RexZstdSource(const RexZstdSource&) = delete;
+    RexZstdSource& operator=(const RexZstdSource&) = delete;
+    ~RexZstdSource() {
+        if (stream_) {
+            ZSTD_freeDStream(stream_);
+        }
+        if (file_) {
+            std::fclose(file_);
+        }
+    }
+
+    /// Файл открылся.
+    explicit operator bool() const {
+        return stream_ != nullptr;
+    }
+    /// Файл не открылся или данные повреждены.
+    bool failed() const {
+        return failed_;
+    }
+
+    size_t operator()(std::span<K> buffer) {
+        if (!stream_) {
+            failed_ = true;
+            return 0;
+        }
+        ZSTD_outBuffer out{buffer.data(), buffer.size_bytes(), 0};
+        while (out.pos < out.size) {
+            if (in_.pos == in_.size) {
+                size_t read = eof_ ? 0 : std::fread(input_.data(), 1, input_.size(), file_);
+                if (read) {
+                    in_ = {input_.data(), read, 0};
+                } else {
+                    eof_ = true;
+                    if (!pending_) {
+                        break;
+                    }
+                }
+            }
+            const size_t before = out.pos;
+            pending_ = ZSTD_decompressStream(stream_, &out, &in_);
+            if (ZSTD_isError(pending_)) {
+                failed_ = true;
+                return 0;
+            }
+            // Входа больше нет, а декодер не может ничего выдать и не закончил кадр - файл обрезан.
+            if (eof_ && out.pos == before) {
+                if (pending_) {
+                    failed_ = true;
+                }
+                break;
+            }
+        }
+        return out.pos / sizeof(K);
+    }
+
+protected:
+    std::FILE* file_ = nullptr;
+    ZSTD_DStream* stream_ = nullptr;
+    std::vector<char> input_;
+    ZSTD_inBuffer in_{nullptr, 0, 0};
+    // Последний ответ ZSTD_decompressStream: не 0 - кадр не закончен или не всё выдано.
+    size_t pending_ = 0;
+    bool eof_ = false;
+    bool failed_ = false;
+};
+#endif
+
+} // namespace simrex
@@ -0,0 +1 @@
+﻿#include <simrex/mapped_file-inl.h>
@@ -0,0 +1,156 @@
+﻿/*
+ * Учёт и перенаправление памяти oniguruma. Собирается в библиотеку simrex_onig_alloc только с опцией CMake
+ * SIMREX_ONIG_ALLOCATOR, без неё функции учёта - заглушки из simrex/onig-inl.h.
+ */
+#include <simrex/onig.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+namespace simrex {
+
+namespace {
+
+// Перед каждым блоком хранится его размер. Заголовок занимает alignof(max_align_t), чтобы не нарушать выравнивание.
+constexpr size_t headerSize = alignof(std::max_align_t);
+
+void* default_allocate(size_t size, void*) {
+    return std::malloc(size);
+}
+
+void* default_reallocate(void* ptr, size_t size, void*) {
+    return std::realloc(ptr, size);
+}
+
+void default_deallocate(void* ptr, void*) {
+    std::free(ptr);
+}
+
+OnigAllocator current{default_allocate, default_reallocate, default_deallocate, nullptr};
+
+std::atomic<size_t> liveBytes{0}, liveBlocks{0}, peakBytes{0};
+thread_local ptrdiff_t threadBytes = 0;
+
+// Значение счётчика блоков, пока set_onig_allocator меняет функции выделения.
+constexpr size_t swapping = size_t(-1);
+
+// Блок учитывается до вызова функции выделения, а снимается с учёта после освобождения: пока хоть один
+// блок жив или выделяется, функции выделения не поменяются и блок вернётся в те же функции.
+void reserve_block() {
+    size_t blocks = liveBlocks.load(std::memory_order_relaxed);
+    for (;;) {
+        if (blocks == swapping) {
+            std::this_thread::yield();
+            blocks = liveBlocks.load(std::memory_order_relaxed);
+        } else if (liveBlocks.compare_exchange_weak(blocks, blocks + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+void release_block() {
+    liveBlocks.fetch_sub(1, std::memory_order_release);
+}
+
+void on_alloc(size_t size) {
+    size_t now = liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+    threadBytes += ptrdiff_t(size);
+    size_t peak = peakBytes.load(std::memory_order_relaxed);
+    while (now > peak && !peakBytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+}
+
+void on_free(size_t size) {
+    liveBytes.fetch_sub(size, std::memory_order_relaxed);
+    threadBytes -= ptrdiff_t(size);
+}
+
+size_t& block_size(void* block) {
+    return *static_cast<size_t*>(block);
+}
+
+} // namespace
+
+bool set_onig_allocator(const OnigAllocator& allocator) {
+    // Занимаем счётчик блоков: пока он равен swapping, новые блоки ждут окончания замены.
+    size_t blocks = 0;
+    if (!liveBlocks.compare_exchange_strong(blocks, swapping, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return false;
+    }
+    if (allocator.allocate && allocator.reallocate && allocator.deallocate) {
+        current = allocator;
+    } else {
+        current = {default_allocate, default_reallocate, default_deallocate, nullptr};
+    }
+    liveBlocks.store(0, std::memory_order_release);
+    return true;
+}
+
+OnigMemoryStats onig_memory_stats() {
+    size_t blocks = liveBlocks.load(std::memory_order_relaxed);
+    return {liveBytes.load(std::memory_order_relaxed), blocks == swapping ? 0 : blocks,
+        peakBytes.load(std::memory_order_relaxed), threadBytes};
+}
+
+} // namespace simrex
+
+/*
+ * При опции SIMREX_ONIG_ALLOCATOR исходники oniguruma компилируются с malloc, realloc, calloc и free,
+ * заменёнными макросами на эти функции.
+ */
+extern "C" {
+
+SIMREX_ALLOC_API void* simrex_onig_malloc(size_t size) {
+    using namespace simrex;
+    reserve_block();
+    void* block = current.allocate(size + headerSize, current.context);
+    if (!block) {
+        release_block();
+        return nullptr;
+    }
+    block_size(block) = size;
+    on_alloc(size);
+    return static_cast<char*>(block) + headerSize;
+}
+
+SIMREX_ALLOC_API void* simrex_onig_calloc(size_t count, size_t size) {
+    if (size && count > size_t(-1) / size) {
+        return nullptr;
+    }
+    void* ptr = simrex_onig_malloc(count * size);
+    if (ptr) {
+        std::memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+SIMREX_ALLOC_API void simrex_onig_free(void* ptr) {
+    using namespace simrex;
+    if (ptr) {
+        void* block = static_cast<char*>(ptr) - headerSize;
+        on_free(block_size(block));
+        current.deallocate(block, current.context);
+        release_block();
+    }
+}
+
+SIMREX_ALLOC_API void* simrex_onig_realloc(void* ptr, size_t size) {
+    using namespace simrex;
+    if (!ptr) {
+        return simrex_onig_malloc(size);
+    }
+    void* block = static_cast<char*>(ptr) - headerSize;
+    size_t old = block_size(block);
+    void* moved = current.reallocate(block, size + headerSize, current.context);
+    if (!moved) {
+        return nullptr;
+    }
+    on_free(old);
+    block_size(moved) = size;
+    on_alloc(size);
+    return static_cast<char*>(moved) + headerSize;
+}
+
+} // extern "C"
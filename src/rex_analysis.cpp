@@ -0,0 +1,14 @@
+﻿#include <simrex/rex_analysis-inl.h>
+
+namespace simrex {
+
+template RexRiskReport OnigRegexp<u8s>::analyze_risk(simple_str<u8s>);
+template RexRiskReport OnigRegexp<u16s>::analyze_risk(simple_str<u16s>);
+template RexRiskReport OnigRegexp<u32s>::analyze_risk(simple_str<u32s>);
+template RexRiskReport OnigRegexp<wchar_t>::analyze_risk(simple_str<wchar_t>);
+template OnigRegexp<u8s> OnigRegexp<u8s>::capture_subset(simple_str<u8s>, std::span<const unsigned>);
+template OnigRegexp<u16s> OnigRegexp<u16s>::capture_subset(simple_str<u16s>, std::span<const unsigned>);
+template OnigRegexp<u32s> OnigRegexp<u32s>::capture_subset(simple_str<u32s>, std::span<const unsigned>);
+template OnigRegexp<wchar_t> OnigRegexp<wchar_t>::capture_subset(simple_str<wchar_t>, std::span<const unsigned>);
+
+} // namespace simrex
@@ -0,0 +1,10 @@
+﻿#include <simrex/rex_lexer-inl.h>
+
+namespace simrex {
+
+template class Lexer<u8s>;
+template class Lexer<u16s>;
+template class Lexer<u32s>;
+template class Lexer<wchar_t>;
+
+} // namespace simrex
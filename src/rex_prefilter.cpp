@@ -0,0 +1,16 @@
+﻿#include <simrex/rex_prefilter-inl.h>
+#include <simrex/rex_trigram-inl.h>
+
+namespace simrex {
+
+template class RexSet<u8s>;
+template class RexSet<u16s>;
+template class RexSet<u32s>;
+template class RexSet<wchar_t>;
+
+template class TrigramIndex<u8s>;
+template class TrigramIndex<u16s>;
+template class TrigramIndex<u32s>;
+template class TrigramIndex<wchar_t>;
+
+} // namespace simrex
@@ -1,4 +1,10 @@
 ﻿#include <simrex/onig.h>
+#include <simrex/async.h>
+#include <simrex/rules.h>
+#include <simrex/stream.h>
+#include <atomic>
+#include <sstream>
+#include <thread>
 #define re_registers posix_re_registers
 #include <gtest/gtest.h>
 namespace simrex::testing {
@@ -491,4 +497,1060 @@ TEST(SimRex, ReplaceCb) {
         EXPECT_NE(v.c_str(), r.c_str());
     }
 }
+
+TEST(SimRex, SharedRex) {
+    OnigRexShared empty;
+    EXPECT_FALSE(empty.isValid());
+    EXPECT_EQ(empty->search("aaa"), -1);
+
+    OnigRexShared rex{"b(a+)"};
+    EXPECT_TRUE(rex.isValid());
+    OnigRexShared copy = rex;
+    EXPECT_EQ(rex.use_count(), 2);
+    EXPECT_EQ(&copy.get(), &rex.get());
+    EXPECT_EQ(copy->count_of("bbbaabbbabbaaa"), 3u);
+
+    OnigRexSharedU rexu{OnigRexU{u"b(a+)"}};
+    EXPECT_TRUE(rexu.isValid());
+    EXPECT_EQ(rexu->first_founded(u"bbbaabbbabbaaa"), u"baa");
+}
+
+TEST(SimRex, SharedRexMultiThread) {
+    OnigRexShared rex{"(\\w+)@(\\w+)\\.com"};
+    std::string buffer;
+    for (int i = 0; i < 200; i++) {
+        buffer += "user" + std::to_string(i) + "@host.com, ";
+    }
+    ssa text{buffer.data(), buffer.size()};
+    const auto expected = rex->all_matches(text);
+    ASSERT_EQ(expected.size(), 200u);
+
+    std::atomic<int> errors{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([rex, text, &expected, &errors] {
+            for (int iter = 0; iter < 50; iter++) {
+                if (rex->count_of(text) != 200 || rex->search(text) != 0) {
+                    errors++;
+                }
+                auto matches = rex->all_matches(text);
+                if (matches.size() != expected.size()) {
+                    errors++;
+                    continue;
+                }
+                for (size_t i = 0; i < matches.size(); i++) {
+                    if (matches[i][0].first != expected[i][0].first || !(matches[i][2].second == expected[i][2].second)) {
+                        errors++;
+                    }
+                }
+                stringa replaced = rex->replace<stringa>(text, "$2");
+                if (replaced.length() != 200 * 6) {
+                    errors++;
+                }
+            }
+        });
+    }
+    for (auto& t: threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors, 0);
+}
+
+TEST(SimRex, RiskAnalysis) {
+    EXPECT_EQ(OnigRex::analyze_risk("(a+)+$").risk, RexRisk::Exponential);
+    EXPECT_EQ(OnigRex::analyze_risk("(a|aa)+c").risk, RexRisk::Exponential);
+    EXPECT_EQ(OnigRex::analyze_risk("(\\w+\\s?)+$").risk, RexRisk::Exponential);
+    EXPECT_EQ(OnigRex::analyze_risk("(a*)*b").risk, RexRisk::Exponential);
+    EXPECT_EQ(OnigRex::analyze_risk("\\d+\\d+x").risk, RexRisk::Polynomial);
+    EXPECT_EQ(OnigRex::analyze_risk(".*.*=.*").risk, RexRisk::Polynomial);
+    EXPECT_EQ(OnigRex::analyze_risk("a+b+").risk, RexRisk::None);
+    EXPECT_EQ(OnigRex::analyze_risk("(ab+)+c").risk, RexRisk::None);
+    EXPECT_EQ(OnigRex::analyze_risk("\\w+\\s+\\w+").risk, RexRisk::None);
+    EXPECT_EQ(OnigRex::analyze_risk("^(\\d+)-(\\d+)$").risk, RexRisk::None);
+    EXPECT_EQ(OnigRexU::analyze_risk(u"(a|a)*b").risk, RexRisk::Exponential);
+    EXPECT_EQ(OnigRexUU::analyze_risk(U"[a-z]+@[a-z]+\\.com").risk, RexRisk::None);
+
+    auto report = OnigRex::analyze_risk("x(a+)+$");
+    ASSERT_EQ(report.findings.size(), 2u);
+    EXPECT_EQ(report.findings[0].kind, RexRiskKind::NestedQuantifier);
+    EXPECT_EQ(report.findings[0].pos, 3u);
+    EXPECT_TRUE(report.complete);
+
+    EXPECT_FALSE(OnigRex::analyze_risk("(a").complete);
+
+    // Слишком глубокая вложенность не разбирается, вместо переполнения стека отчёт неполный.
+    std::string deep = std::string(100000, '(') + "a" + std::string(100000, ')');
+    EXPECT_FALSE(OnigRex::analyze_risk(deep).complete);
+    deep = "a" + std::string(100000, '?');
+    EXPECT_FALSE(OnigRex::analyze_risk(deep).complete);
+    deep = std::string(100000, '[') + "a" + std::string(100000, ']');
+    EXPECT_FALSE(OnigRex::analyze_risk(deep).complete);
+    deep = std::string(200, '(') + "a+" + std::string(200, ')') + "+$";
+    report = OnigRex::analyze_risk(deep);
+    EXPECT_TRUE(report.complete);
+    EXPECT_EQ(report.risk, RexRisk::Exponential);
+    EXPECT_FALSE(OnigRex::analyze_risk("[[:alpha").complete);
+
+    RexRiskReport r;
+    OnigRex rejected{"(a+)+$", r};
+    EXPECT_FALSE(rejected.isValid());
+    EXPECT_EQ(r.risk, RexRisk::Exponential);
+
+    OnigRex accepted{"\\d+\\d+x", r};
+    EXPECT_TRUE(accepted.isValid());
+    EXPECT_EQ(r.risk, RexRisk::Polynomial);
+
+    OnigRex strict{"\\d+\\d+x", r, RexRisk::None};
+    EXPECT_FALSE(strict.isValid());
+}
+
+TEST(SimRex, PmrResults) {
+    OnigRex rex{"b(a+)"};
+    alignas(std::max_align_t) char buffer[4096];
+    // Без upstream ресурса любое выделение мимо буфера приведёт к исключению.
+    std::pmr::monotonic_buffer_resource arena{buffer, sizeof(buffer), std::pmr::null_memory_resource()};
+
+    auto founded = rex.all_founded(&arena, "bbbaabbbabbaaa");
+    ASSERT_EQ(founded.size(), 3u);
+    EXPECT_EQ(founded[2], "baaa");
+    EXPECT_EQ(founded.get_allocator().resource(), &arena);
+
+    auto texts = rex.texts_in_first_match(&arena, "bbbaabbbabbaaa", 4);
+    ASSERT_EQ(texts.size(), 2u);
+    EXPECT_EQ(texts[0], "ba");
+    EXPECT_EQ(texts[1], "a");
+
+    auto allTexts = rex.texts_in_all_matches(&arena, "bbbaabbbabbaaa");
+    ASSERT_EQ(allTexts.size(), 3u);
+    EXPECT_EQ(allTexts[1][1], "a");
+    EXPECT_EQ(allTexts[1].get_allocator().resource(), &arena);
+
+    auto first = rex.first_match(&arena, "bbbbaaba");
+    ASSERT_EQ(first.size(), 2u);
+    EXPECT_EQ(first[0].first, 3u);
+    EXPECT_EQ(first[1].second, "aa");
+
+    auto all = rex.all_matches(&arena, "bbbaabbbabbaaa", 0, 2);
+    ASSERT_EQ(all.size(), 2u);
+    EXPECT_EQ(all[1][0].first, 7u);
+    EXPECT_EQ(all[1][0].second, "ba");
+    EXPECT_EQ(all[1].get_allocator().resource(), &arena);
+
+    auto owned = rex.all_matches<stringa>(&arena, "bbbaabbbabbaaa");
+    ASSERT_EQ(owned.size(), 3u);
+    EXPECT_EQ(owned[2][1].second, "aaa");
+}
+
+TEST(SimRex, SpanOutput) {
+    OnigRex rex{"b(a+)|(c)"};
+    EXPECT_EQ(rex.groups_count(), 3u);
+
+    MatchSpan groups[3];
+    EXPECT_EQ(rex.first_match_into("xxbaac", groups), 3u);
+    EXPECT_EQ(groups[0].begin, 2u);
+    EXPECT_EQ(groups[0].end, 5u);
+    EXPECT_EQ(groups[1].begin, 3u);
+    EXPECT_EQ(groups[1].length(), 2u);
+    EXPECT_FALSE(groups[2].matched());
+    EXPECT_EQ(rex.first_match_into("xxx", groups), 0u);
+    // Буфер меньше количества групп - записывается только то, что поместилось.
+    EXPECT_EQ(rex.first_match_into("xxbaac", std::span{groups, 1}, 3), 3u);
+    EXPECT_EQ(groups[0].begin, 5u);
+
+    ssa text = "babaacbaaa";
+    MatchSpan buf[6];
+    std::vector<size_t> starts;
+    size_t count = 0, at = 0, calls = 0;
+    while (at != MatchSpan::npos) {
+        at = rex.all_matches_into(text, buf, count, at);
+        calls++;
+        for (size_t i = 0; i < count; i++) {
+            starts.push_back(buf[i * 3].begin);
+        }
+    }
+    EXPECT_EQ(calls, 2u);
+    EXPECT_EQ(starts, (std::vector<size_t>{0, 2, 5, 6}));
+    EXPECT_EQ(buf[3].begin, 6u);
+    EXPECT_EQ(buf[4].end, 10u);
+
+    at = rex.all_matches_into(text, buf, count, 0, 1);
+    EXPECT_EQ(at, MatchSpan::npos);
+    EXPECT_EQ(count, 1u);
+    // Буфер меньше одного совпадения - поиск завершается, а не просит продолжения с той же позиции.
+    at = rex.all_matches_into(text, std::span{buf, 2}, count);
+    EXPECT_EQ(at, MatchSpan::npos);
+    EXPECT_EQ(count, 0u);
+}
+
+TEST(SimRex, GrepLines) {
+    OnigRex rex{"err(or)?"};
+    ssa log = "info: start\nerror: disk\nwarn: err low\ninfo: stop\nerr\n";
+
+    auto lines = rex.grep_lines(log, {.lineNumbers = true});
+    ASSERT_EQ(lines.size(), 3u);
+    EXPECT_EQ(lines[0].number, 2u);
+    EXPECT_EQ(lines[0].pos, 12u);
+    EXPECT_EQ(lines[0].text, "error: disk");
+    EXPECT_EQ(lines[1].number, 3u);
+    EXPECT_EQ(lines[1].text, "warn: err low");
+    EXPECT_EQ(lines[2].number, 5u);
+    EXPECT_EQ(lines[2].text, "err");
+
+    auto first = rex.grep_lines(log, {.maxCount = 1});
+    ASSERT_EQ(first.size(), 1u);
+    EXPECT_EQ(first[0].number, 0u);
+    EXPECT_EQ(first[0].text, "error: disk");
+
+    auto inverted = rex.grep_lines(log, {.invert = true, .lineNumbers = true});
+    ASSERT_EQ(inverted.size(), 2u);
+    EXPECT_EQ(inverted[0].number, 1u);
+    EXPECT_EQ(inverted[0].text, "info: start");
+    EXPECT_EQ(inverted[1].number, 4u);
+    EXPECT_EQ(inverted[1].text, "info: stop");
+
+    // Последняя строка без перевода строки и функтор вместо вектора.
+    std::vector<ssa> texts;
+    size_t count = OnigRex{"^$|a"}.grep_lines("a\n\nb\nca", {}, [&](const GrepLine<u8s>& line) {
+        texts.push_back(line.text);
+    });
+    EXPECT_EQ(count, 3u);
+    EXPECT_EQ(texts, (std::vector<ssa>{"a", "", "ca"}));
+    EXPECT_TRUE(OnigRex{"x"}.grep_lines("").empty());
+
+    // Пустое совпадение в конце текста относится к последней строке без перевода строки.
+    auto ends = OnigRex{"$"}.grep_lines("abc");
+    ASSERT_EQ(ends.size(), 1u);
+    EXPECT_EQ(ends[0].text, "abc");
+    EXPECT_TRUE(OnigRex{"$"}.grep_lines("abc", {.invert = true}).empty());
+    ends = OnigRex{"$"}.grep_lines("abc\nxyz", {.lineNumbers = true});
+    ASSERT_EQ(ends.size(), 2u);
+    EXPECT_EQ(ends[1].number, 2u);
+    EXPECT_EQ(ends[1].text, "xyz");
+    for (ssa pattern: {ssa{"\\z"}, ssa{"\\Z"}}) {
+        ends = OnigRex{pattern}.grep_lines("abc\nxyz");
+        ASSERT_EQ(ends.size(), 1u) << pattern;
+        EXPECT_EQ(ends[0].text, "xyz");
+        auto rest = OnigRex{pattern}.grep_lines("abc\nxyz", {.invert = true});
+        ASSERT_EQ(rest.size(), 1u) << pattern;
+        EXPECT_EQ(rest[0].text, "abc");
+    }
+    // После завершающего перевода строки строк нет.
+    EXPECT_TRUE(OnigRex{"\\z"}.grep_lines("abc\n").empty());
+    EXPECT_EQ(OnigRex{"\\z"}.grep_lines("abc\n", {.invert = true}).size(), 1u);
+}
+
+TEST(SimRex, MultiReplace) {
+    MultiReplacerA redact{
+        {"\\d{4}-\\d{4}", "####-####"},
+        {"(\\w+)@(\\w+)\\.com", "<$1 at ${2}>"},
+        {"\\d+", "N"},
+        {"secret", "$$"},
+    };
+    EXPECT_EQ(redact.size(), 4u);
+    EXPECT_FALSE(redact.add("(", "x"));
+    EXPECT_EQ(redact.size(), 4u);
+
+    EXPECT_EQ(redact.replace<stringa>("card 1234-5678, mail bob@mail.com, 42 secret"),
+        "card ####-####, mail <bob at mail>, N $");
+    // Левее всех - правило \d+, хотя оно добавлено после почты.
+    EXPECT_EQ(redact.replace<stringa>("7 bob@x.com"), "N <bob at x>");
+    // При совпадении позиций побеждает правило, добавленное раньше.
+    EXPECT_EQ(redact.replace<stringa>("1111-2222"), "####-####");
+    EXPECT_EQ(redact.replace<stringa>("1 2 3", 0, 2), "N N 3");
+    EXPECT_EQ(redact.replace<stringa>("1 2 3", 2), "1 N N");
+    EXPECT_EQ(redact.replace<stringa>("nothing here"), "nothing here");
+
+    MultiReplacerA empty;
+    EXPECT_EQ(empty.replace<stringa>("text"), "text");
+
+    MultiReplacerU wide{{u"a+", u"<$0>"}, {u"b", u"-"}};
+    EXPECT_EQ(wide.replace<stringu>(u"caabab"), u"c<aa>-<a>-");
+}
+
+TEST(SimRex, IncrementalIndex) {
+    OnigRex rex{"b(a+)|(c)"};
+    MatchIndex<u8s> index{rex, 1};
+    std::string text = "xbaa yc zba cc baaa";
+    index.build(ssa{text});
+    ASSERT_EQ(index.size(), 6u);
+    EXPECT_EQ(index[0][1].begin, 2u);
+    EXPECT_FALSE(index[0][2].matched());
+
+    auto check = [&] {
+        auto full = rex.all_matches(ssa{text});
+        ASSERT_EQ(index.size(), full.size());
+        for (size_t m = 0; m < full.size(); m++) {
+            for (size_t g = 0; g < full[m].size(); g++) {
+                if (index[m][g].matched()) {
+                    EXPECT_EQ(index[m][g].begin, full[m][g].first);
+                    EXPECT_EQ(index[m][g].length(), full[m][g].second.length());
+                } else {
+                    EXPECT_EQ(full[m][g].second.length(), 0u);
+                }
+            }
+        }
+    };
+
+    // Вставка в середину меняет одно совпадение, остальные сдвигаются.
+    text.insert(10, "aa");
+    auto upd = index.edit(ssa{text}, 10, 0, 2);
+    check();
+    EXPECT_EQ(upd.first, 2u);
+    EXPECT_EQ(upd.removed, 1u);
+    EXPECT_EQ(upd.inserted, 1u);
+
+    // Случайные правки сверяем с полным поиском.
+    unsigned seed = 12345;
+    auto rnd = [&](unsigned n) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % n;
+    };
+    const char alphabet[] = "abcx ";
+    for (int step = 0; step < 300; step++) {
+        size_t pos = rnd(unsigned(text.size() + 1));
+        size_t removed = std::min<size_t>(rnd(4), text.size() - pos);
+        std::string ins;
+        for (unsigned k = rnd(4); k--;) {
+            ins += alphabet[rnd(5)];
+        }
+        text.replace(pos, removed, ins);
+        index.edit(ssa{text}, pos, removed, ins.size());
+        check();
+        if (HasFailure()) {
+            break;
+        }
+    }
+}
+
+TEST(SimRex, ResultCache) {
+    OnigRex rex{"(\\w+)/(\\d+)\\.(\\d+)"};
+    EXPECT_EQ(rex.cache_stats().capacity, 0u);
+    rex.enable_cache(64);
+
+    ssa agent = "Mozilla/5.0 (X11; Linux x86_64)";
+    for (int i = 0; i < 3; i++) {
+        auto match = rex.first_match(agent);
+        ASSERT_EQ(match.size(), 4u);
+        EXPECT_EQ(match[1].second, "Mozilla");
+        EXPECT_EQ(match[3].first, 10u);
+    }
+    // Смещение поиска - часть ключа, отсутствие вхождения тоже кэшируется.
+    EXPECT_EQ(rex.search(agent, 1), 1u);
+    EXPECT_EQ(rex.search(agent, 20), str::npos);
+    EXPECT_EQ(rex.search(agent, 20), str::npos);
+    EXPECT_EQ(rex.texts_in_first_match(agent)[2], "5");
+
+    auto stats = rex.cache_stats();
+    EXPECT_EQ(stats.misses, 3u);
+    EXPECT_EQ(stats.hits, 4u);
+    EXPECT_EQ(stats.size, 3u);
+    EXPECT_NEAR(stats.hit_rate(), 4.0 / 7.0, 1e-9);
+
+    // Многопоточный доступ с вытеснением.
+    rex.enable_cache(16);
+    std::vector<std::string> texts;
+    for (int i = 0; i < 40; i++) {
+        texts.push_back("agent" + std::to_string(i) + "/" + std::to_string(i) + ".1 tail");
+    }
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (int k = 0; k < 500; k++) {
+                const std::string& text = texts[size_t(k * (t + 1)) % texts.size()];
+                if (rex.first_founded(ssa{text}).length() != text.size() - 5) {
+                    wrong++;
+                }
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    EXPECT_EQ(wrong, 0);
+    stats = rex.cache_stats();
+    EXPECT_EQ(stats.hits + stats.misses, 2000u);
+    EXPECT_LE(stats.size, stats.capacity);
+
+    // Разделяемый хэндл получает кэш при создании, все копии работают с одним кэшем.
+    OnigRexShared shared{"(\\w+)/(\\d+)\\.(\\d+)", 32};
+    OnigRexShared copy = shared;
+    EXPECT_EQ(shared->first_founded(agent), "Mozilla/5.0");
+    EXPECT_EQ(copy->first_founded(agent), "Mozilla/5.0");
+    stats = shared->cache_stats();
+    EXPECT_EQ(stats.capacity, 32u);
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 1u);
+}
+
+TEST(SimRex, ReverseSearch) {
+    OnigRex rex{"(\\d\\d):(\\d\\d)"};
+    ssa log = "10:15 start\n10:20 work\n10:25 stop\n";
+    EXPECT_EQ(rex.search_last(log), 23u);
+    EXPECT_EQ(rex.last_founded(log), "10:25");
+    EXPECT_EQ(rex.search_last(log, 22), 12u);
+    EXPECT_EQ(rex.search_last(log, 17), 12u);
+    EXPECT_EQ(rex.search_last(log, 16), 0u);
+    EXPECT_EQ(rex.last_founded<stringa>(log, 11), "10:15");
+    EXPECT_EQ(rex.search_last(log, 4), str::npos);
+    EXPECT_EQ(rex.search_last("no time"), str::npos);
+    EXPECT_EQ(rex.last_founded("no time"), "");
+
+    auto match = rex.last_match(log);
+    ASSERT_EQ(match.size(), 3u);
+    EXPECT_EQ(match[0].first, 23u);
+    EXPECT_EQ(match[2].first, 26u);
+    EXPECT_EQ(match[2].second, "25");
+    EXPECT_EQ(rex.last_match(log, 5)[1].second, "10");
+    EXPECT_TRUE(OnigRex{"x"}.last_match(log).empty());
+
+    // Последняя позиция начала, а не последнее из вхождений all_founded.
+    OnigRex plus{"a+"};
+    EXPECT_EQ(plus.all_founded("xaaa").back(), "aaa");
+    EXPECT_EQ(plus.last_founded("xaaa"), "a");
+    EXPECT_EQ(plus.search_last("xaaa"), 3u);
+
+    OnigRexU urex{u"б+"};
+    EXPECT_EQ(urex.search_last(u"абвбб"), 4u);
+}
+
+TEST(SimRex, ColumnarExtraction) {
+    OnigRex rex{"^(\\w+)=(\\d+)(?:;(\\w+))?$"};
+    ssa text = "a=1;x\nbad line\nbb=22\nccc=333;yy\n";
+    auto res = rex.extract_columns(text);
+    ASSERT_EQ(res.rows, 4u);
+    ASSERT_EQ(res.columns.size(), 4u);
+    EXPECT_TRUE(res.matched(0));
+    EXPECT_FALSE(res.matched(1));
+    EXPECT_TRUE(res.matched(3));
+    EXPECT_EQ(res.columns[1][2].begin, 15u);
+    EXPECT_EQ(res.columns[2][3].length(), 3u);
+    EXPECT_FALSE(res.columns[1][1].matched());
+    EXPECT_FALSE(res.columns[3][2].matched());
+
+    auto names = res.string_column(text, 1);
+    ASSERT_EQ(names.size(), 4u);
+    EXPECT_EQ(names[0], "a");
+    EXPECT_EQ(names[1], "");
+    EXPECT_EQ(names[3], "ccc");
+    EXPECT_EQ(names.arena.size(), 6u);
+    auto tails = res.string_column(text, 3);
+    EXPECT_EQ(tails[0], "x");
+    EXPECT_EQ(tails[3], "yy");
+
+    // Записи и битовая карта больше 64 строк.
+    std::vector<std::string> storage;
+    for (int i = 0; i < 100; i++) {
+        storage.push_back(i % 3 ? "k" + std::to_string(i) + "=" + std::to_string(i * 2) : "skip");
+    }
+    std::vector<ssa> records(storage.begin(), storage.end());
+    auto rec = rex.extract_columns(std::span<const ssa>{records});
+    ASSERT_EQ(rec.rows, 100u);
+    EXPECT_EQ(rec.unmatched.size(), 2u);
+    EXPECT_FALSE(rec.matched(99));
+    EXPECT_TRUE(rec.matched(98));
+    EXPECT_EQ(rec.string_column(std::span<const ssa>{records}, 2)[98], "196");
+    EXPECT_EQ(rec.columns[0][98].begin, 0u);
+}
+
+TEST(SimRex, RexSetPrefilter) {
+    RexSetA rules{
+        "GET /api/(\\w+)",          // 0: литерал "GET /api/"
+        "(?:error|fatal): \\d+",    // 1: "error: " или "fatal: "
+        "user=\\w+@\\w+\\.com",     // 2: "user="
+        "\\d{3}-\\d{4}",            // 3: "-"
+        "(?i)timeout",              // 4: без литералов из-за игнорирования регистра
+        "a(b",                      // 5: ошибочное
+        "(a)?(?(1)bc)x",            // 6: "x", ветка условия не обязательна
+        "привет|мир",               // 7
+    };
+    EXPECT_EQ(rules.size(), 8u);
+    EXPECT_FALSE(rules[5].isValid());
+    EXPECT_EQ(rules.unfiltered(), 1u);
+
+    EXPECT_EQ(rules.candidates("nothing interesting"), (std::vector<size_t>{4}));
+    EXPECT_TRUE(rules.matching("nothing interesting").empty());
+    EXPECT_EQ(rules.candidates("GET /api/users error: 500"), (std::vector<size_t>{0, 1, 4}));
+    EXPECT_EQ(rules.matching("GET /api/users error: 500"), (std::vector<size_t>{0, 1}));
+    // Литерал есть, но совпадения нет.
+    EXPECT_EQ(rules.candidates("fatal: none"), (std::vector<size_t>{1, 4}));
+    EXPECT_TRUE(rules.matching("fatal: none").empty());
+    EXPECT_EQ(rules.matching("call 555-1234 TimeOut"), (std::vector<size_t>{3, 4}));
+    EXPECT_EQ(rules.matching("user=bob@mail.com"), (std::vector<size_t>{2}));
+    EXPECT_EQ(rules.matching("box"), (std::vector<size_t>{6}));
+    EXPECT_EQ(rules.matching("здравствуй, мир"), (std::vector<size_t>{7}));
+
+    RexSetU wide{u"мир\\d", u"(ab|cd)+e"};
+    EXPECT_EQ(wide.unfiltered(), 0u);
+    EXPECT_EQ(wide.candidates(u"xxcy"), (std::vector<size_t>{}));
+    EXPECT_EQ(wide.candidates(u"xxcdy"), (std::vector<size_t>{1}));
+    EXPECT_EQ(wide.matching(u"мир5 ababe"), (std::vector<size_t>{0, 1}));
+
+    // Литералы используют все 256 значений байта: последнее не должно слиться с классом "нет в литералах".
+    std::vector<stringuu> allBytes;
+    for (char32_t b = 0; b < 256; b++) {
+        allBytes.emplace_back(std::u32string(1, char32_t(0x100 + b)));
+    }
+    allBytes.emplace_back(U"\u01FF\u01FF");
+    std::vector<ssuu> allBytesPatterns(allBytes.begin(), allBytes.end());
+    RexSetUU bytes{std::span<const ssuu>{allBytesPatterns}};
+    EXPECT_EQ(bytes.unfiltered(), 0u);
+    EXPECT_EQ(bytes.candidates(U"x\u01FF\u01FFx"), (std::vector<size_t>{255, 256}));
+    EXPECT_EQ(bytes.candidates(U"\u0100"), (std::vector<size_t>{0}));
+
+    // Результат с префильтром совпадает с поиском всеми выражениями.
+    std::vector<ssa> patterns{"ab+c", "x(y|z){2}w", "\\bfoo\\b", "[0-9]+-[0-9]+", "q.*q", "(?:mm|nn)+o"};
+    RexSetA set{std::span<const ssa>{patterns}};
+    const char alphabet[] = "abcxyzwfoq0-mn ";
+    unsigned seed = 7;
+    for (int step = 0; step < 500; step++) {
+        std::string text;
+        for (int k = 0; k < 12; k++) {
+            seed = seed * 1103515245 + 12345;
+            text += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        std::vector<size_t> expected;
+        for (size_t idx = 0; idx < set.size(); idx++) {
+            if (set[idx].search(ssa{text}) != str::npos) {
+                expected.push_back(idx);
+            }
+        }
+        ASSERT_EQ(set.matching(ssa{text}), expected) << text;
+    }
+
+    // Восьмеричные коды, управляющие и прочие escape не должны давать ложных литералов.
+    std::vector<ssa> escapes{"\\141", "x\\C-ay", "x\\cay", "(a)\\101b", "q\\M-ar", "[\\141]bc", "[\\b]z", "\\x41\\x42c", "\\1(a)"};
+    RexSetA escaped{std::span<const ssa>{escapes}};
+    EXPECT_EQ(escaped.matching("xay"), (std::vector<size_t>{0}));
+    EXPECT_EQ(escaped.matching("x\x01y"), (std::vector<size_t>{1, 2}));
+    EXPECT_EQ(escaped.matching("aAb abc"), (std::vector<size_t>{0, 3, 5}));
+    for (const char* text: {"q\xC3\xA1r", "\bz", "ABc", "ab", "qar"}) {
+        std::vector<size_t> expected;
+        for (size_t idx = 0; idx < escaped.size(); idx++) {
+            if (escaped[idx].search(ssa{text}) != str::npos) {
+                expected.push_back(idx);
+            }
+        }
+        EXPECT_EQ(escaped.matching(ssa{text}), expected) << text;
+    }
+}
+
+TEST(SimRex, ReplaceInPlace) {
+    OnigRex rex{"b(a+)"};
+    lstringa<40> buffer = "bbbaabbbabbaaa";
+    EXPECT_TRUE(rex.replace_in(buffer, "<$1>"));
+    EXPECT_EQ(buffer, "bb<aa>bb<a>b<aaa>");
+
+    // Без вхождений строка остаётся нетронутой.
+    const char* before = buffer.c_str();
+    EXPECT_FALSE(rex.replace_in(buffer, "-"));
+    EXPECT_EQ(buffer.c_str(), before);
+    EXPECT_EQ(buffer, "bb<aa>bb<a>b<aaa>");
+
+    lstringa<8> small = "ba ba ba ba ba ba";
+    EXPECT_TRUE(rex.replace_in(small, "$0$0$0", 0, 2));
+    EXPECT_EQ(small, "bababa bababa ba ba ba ba");
+    // Результат меньше - память строки переиспользуется.
+    size_t capacity = small.capacity();
+    EXPECT_TRUE(rex.replace_in(small, "", 6));
+    EXPECT_EQ(small, "bababa     ");
+    EXPECT_EQ(small.capacity(), capacity);
+
+    lstringa<40> cb = "bbbaabbbabbaaa";
+    EXPECT_TRUE(rex.replace_cb_in(cb, [](const auto& match) -> stringa {
+        return "<" + match[1].second + ">";
+    }));
+    EXPECT_EQ(cb, "bb<aa>bb<a>b<aaa>");
+    EXPECT_FALSE(rex.replace_cb_in(cb, [](const auto&) { return stringa{}; }, 16));
+
+    // Замены длиннее, короче и вперемешку, с подгруппами из самой строки - результат как у replace.
+    ssa text = "xbaay ba bbaaaaz baaaaaaaaaaa end";
+    for (ssa repl: {ssa{"$1$1$1"}, ssa{"<$1>"}, ssa{"$1"}, ssa{""}, ssa{"-"}}) {
+        lstringa<16> target = text;
+        EXPECT_TRUE(rex.replace_in(target, repl));
+        EXPECT_EQ(ssa{target}, ssa{rex.replace<stringa>(text, repl)}) << repl;
+    }
+    lstringa<16> mixed = text;
+    EXPECT_TRUE(rex.replace_cb_in(mixed, [](const auto& match) -> stringa {
+        return match[1].second.length() > 2 ? stringa{"#"} : "[" + match[0].second + "]";
+    }));
+    EXPECT_EQ(mixed, "x[baa]y [ba] b#z # end");
+}
+
+TEST(SimRex, ParallelReplace) {
+    std::string text;
+    unsigned seed = 99;
+    const char alphabet[] = "abcd12 \n";
+    for (int k = 0; k < 20000; k++) {
+        seed = seed * 1103515245 + 12345;
+        text += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    ParallelOptions options{.threads = 4, .minChunk = 1000};
+    for (const char* pattern: {"b(a+)", "^(\\w)", "\\d+$", "(?<=c)d", "a|b", "c[^\\n]*\\n"}) {
+        OnigRex rex{ssa{pattern, strlen(pattern)}};
+        stringa expected = rex.replace<stringa>(ssa{text}, "<$1>");
+        stringa parallel = rex.replace_parallel<stringa>(ssa{text}, "<$1>", '\n', options);
+        EXPECT_EQ(parallel, expected) << pattern;
+    }
+    // Пустые совпадения и вхождения через разделитель - последовательная обработка с тем же результатом.
+    for (const char* pattern: {"x*", "d\\n+a"}) {
+        OnigRex rex{ssa{pattern, strlen(pattern)}};
+        EXPECT_EQ(rex.replace_parallel<stringa>(ssa{text}, "-", '\n', options), rex.replace<stringa>(ssa{text}, "-")) << pattern;
+    }
+
+    OnigRex rex{"q"};
+    stringa noMatch = ssa{text};
+    stringa same = rex.replace_parallel(noMatch, "-", '\n', options);
+    EXPECT_EQ(same.c_str(), noMatch.c_str());
+    EXPECT_EQ(OnigRex{"a"}.replace_parallel<stringa>("banana", "o"), "bonono");
+    EXPECT_EQ(OnigRex{"a"}.replace_parallel<stringa>("", "o"), "");
+}
+
+TEST(SimRex, Lexer) {
+    enum { Kw = 1, Ident, Number, Space, Op };
+    LexerA lexer{{Kw, "if|else|while"}, {Ident, "[a-z_]\\w*"}, {Number, "\\d+(?:\\.\\d+)?"}, {Space, "\\s+"}, {Op, "[-+*/=<>]=?"}};
+    ASSERT_TRUE(lexer.isValid());
+
+    std::vector<std::pair<int, stringa>> tokens;
+    for (const auto& token: lexer.tokens("if iffy<=3.14 # else")) {
+        tokens.emplace_back(token.id, token.text);
+    }
+    std::vector<std::pair<int, stringa>> expected = {
+        {Kw, "if"}, {Space, " "}, {Ident, "iffy"}, {Op, "<="}, {Number, "3.14"}, {Space, " "},
+        {LexerA::error, "#"}, {Space, " "}, {Kw, "else"},
+    };
+    EXPECT_EQ(tokens, expected);
+
+    // Нераспознанный текст собирается в один токен до позиции, с которой начинается токен.
+    auto bad = lexer.token_at("x @@Ж! y", 2);
+    EXPECT_EQ(bad.id, LexerA::error);
+    EXPECT_EQ(bad.pos, 2u);
+    EXPECT_EQ(bad.text, "@@Ж!");
+    EXPECT_EQ(lexer.token_at("x @@Ж! y", 0).id, Ident);
+
+    // Правила, не подходящие по первому символу, не мешают правилам с нулевой длиной и обратными ссылками.
+    LexerA quoted{{1, "(['\"]).*?\\1"}, {2, "a*"}, {3, "."}};
+    auto q = quoted.token_at("'it\"s'", 0);
+    EXPECT_EQ(q.id, 1);
+    EXPECT_EQ(q.text, "'it\"s'");
+    EXPECT_EQ(quoted.token_at("bcd", 0).id, 3);
+
+    LexerA invalid{{1, "a"}, {2, "(b"}};
+    EXPECT_FALSE(invalid.isValid());
+    EXPECT_EQ(invalid.token_at("ab", 0).id, 1);
+    EXPECT_EQ(invalid.token_at("ab", 1).id, LexerA::error);
+
+    LexerU lexer16{{1, u"\\p{L}+"}, {2, u"\\s+"}};
+    std::vector<int> ids;
+    for (const auto& token: lexer16.tokens(u"Привет 😀 мир")) {
+        ids.push_back(token.id);
+    }
+    EXPECT_EQ(ids, (std::vector<int>{1, 2, LexerU::error, 2, 1}));
+}
+
+TEST(SimRex, GroupSubset) {
+    OnigRex rex{"(\\w+)=(\\d+)(?:,(x))?(;)?"};
+    const unsigned groups[] = {2, 0, 3, 7};
+    auto all = rex.groups_in_all_matches(" a=1,x; bb=22 c=z", groups);
+    ASSERT_EQ(all.size(), 2u);
+    EXPECT_EQ(all[0], (std::vector<ssa>{"1", "a=1,x;", "x", ""}));
+    EXPECT_EQ(all[1], (std::vector<ssa>{"22", "bb=22", "", ""}));
+
+    auto pairs = rex.groups_in_all_matches<1, 2>(" a=1,x; bb=22 c=z");
+    ASSERT_EQ(pairs.size(), 2u);
+    EXPECT_EQ(pairs[1][0], "bb");
+    EXPECT_EQ(pairs[1][1], "22");
+    const unsigned key[] = {1};
+    auto owned = rex.groups_in_all_matches<stringa>("k=5", key);
+    ASSERT_EQ(owned.size(), 1u);
+    EXPECT_EQ(owned[0][0], "k");
+
+    auto first = rex.groups_in_first_match<1>("x y=3", 2);
+    ASSERT_TRUE(first);
+    EXPECT_EQ((*first)[0], "y");
+    EXPECT_FALSE(rex.groups_in_first_match<1>("nothing"));
+    EXPECT_EQ(rex.groups_in_first_match(" q=7;", groups), (std::vector<ssa>{"7", "q=7;", "", ""}));
+
+    // Лишние группы становятся незахватывающими, оставшиеся нумеруются заново.
+    const unsigned keep[] = {2, 4};
+    OnigRex subset = OnigRex::capture_subset("(\\w+)=(\\d+)(?:,(x))?(;)?", keep);
+    ASSERT_TRUE(subset.isValid());
+    EXPECT_EQ(subset.groups_count(), 3u);
+    EXPECT_EQ(subset.texts_in_first_match(" a=1,x;"), (std::vector<ssa>{"a=1,x;", "1", ";"}));
+
+    const unsigned keepNamed[] = {2};
+    OnigRex named = OnigRex::capture_subset("(?<k>\\w+)(:)(?'v'\\d+)", keepNamed);
+    ASSERT_TRUE(named.isValid());
+    EXPECT_EQ(named.texts_in_first_match("ab:12"), (std::vector<ssa>{"ab:12", "12"}));
+    // Без оставшихся именованных групп обычные группы не должны снова стать захватывающими.
+    OnigRex noNamed = OnigRex::capture_subset("(?<k>\\w+)(:)", {});
+    ASSERT_TRUE(noNamed.isValid());
+    EXPECT_EQ(noNamed.groups_count(), 1u);
+    EXPECT_EQ(noNamed.texts_in_first_match("ab:12"), (std::vector<ssa>{"ab:"}));
+    EXPECT_FALSE(OnigRex::capture_subset("(?<k>a)(?<v>b)\\k<k>", keepNamed).isValid());
+
+    EXPECT_FALSE(OnigRex::capture_subset("(a)(b)\\1", keep).isValid());
+    EXPECT_FALSE(OnigRex::capture_subset("(a)?(b)(?(1)c|d)", keep).isValid());
+}
+
+TEST(SimRex, SegmentedSearch) {
+    std::string text;
+    unsigned seed = 7;
+    const char alphabet[] = "abc12 ";
+    for (int k = 0; k < 3000; k++) {
+        seed = seed * 1103515245 + 12345;
+        text += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    // Куски разной длины, в том числе пустые и короче окна.
+    std::vector<ssa> segments;
+    for (size_t pos = 0; pos < text.size();) {
+        seed = seed * 1103515245 + 12345;
+        size_t len = std::min<size_t>((seed >> 16) % 70, text.size() - pos);
+        segments.emplace_back(text.data() + pos, len);
+        pos += len;
+    }
+    for (const char* pattern: {"b(a+)|(c)", "\\b\\d+\\b", "(?<=1)a", "c\\s?c", "^a|2$", "\\w{3,6}"}) {
+        OnigRex rex{ssa{pattern, strlen(pattern)}};
+        std::vector<MatchSpan> expected;
+        for (const auto& match: rex.all_matches(ssa{text})) {
+            for (const auto& [pos, group]: match) {
+                expected.push_back(group.symbols() < text.data() ? MatchSpan{} : MatchSpan{pos, pos + group.length()});
+            }
+        }
+        auto found = rex.all_matches_segments(segments, 16);
+        ASSERT_EQ(found.size(), expected.size()) << pattern;
+        for (size_t i = 0; i < found.size(); i++) {
+            EXPECT_EQ(found[i].begin, expected[i].begin) << pattern << " " << i;
+            EXPECT_EQ(found[i].end, expected[i].end) << pattern << " " << i;
+        }
+    }
+
+    // Вхождения длиннее окна не обрываются на границе куска, а конец куска не считается концом текста.
+    std::string longRun = "x" + std::string(30, 'a');
+    std::vector<ssa> longParts = {ssa{longRun.data(), longRun.size()}, "aaay", "a", "ab"};
+    auto runs = OnigRex{"a+"}.all_matches_segments(longParts, 16);
+    ASSERT_EQ(runs.size(), 2u);
+    EXPECT_EQ(runs[0].begin, 1u);
+    EXPECT_EQ(runs[0].end, 34u);
+    EXPECT_EQ(runs[1].begin, 35u);
+    EXPECT_EQ(runs[1].end, 37u);
+    EXPECT_TRUE(OnigRex{"a+$"}.all_matches_segments(longParts, 16).empty());
+    EXPECT_EQ(OnigRex{"a+\\b"}.all_matches_segments(longParts, 16).size(), 0u);
+    std::string longText = longRun + "aaayaab";
+    for (size_t window: {1, 4, 16}) {
+        auto all = OnigRex{"[ay]+"}.all_matches_segments(longParts, window);
+        ASSERT_EQ(all.size(), 1u) << window;
+        EXPECT_EQ(all[0].begin, 1u);
+        EXPECT_EQ(all[0].end, longText.size() - 1);
+    }
+
+    OnigRex rex{"needle"};
+    std::vector<ssa> parts = {"xx ne", "", "e", "dle needle"};
+    EXPECT_EQ(rex.search_segments(parts), 3u);
+    EXPECT_EQ(rex.search_segments(parts, 256, 4), 10u);
+    EXPECT_EQ(rex.search_segments(parts, 256, 11), size_t(-1));
+    EXPECT_EQ(rex.all_matches_segments(parts, 256, 0, 1).size(), 1u);
+    EXPECT_EQ(rex.search_segments({}), size_t(-1));
+}
+
+TEST(SimRex, AsyncSearch) {
+    std::string text;
+    for (int k = 0; k < 500; k++) {
+        text += "key" + std::to_string(k) + "=val" + std::to_string(k * 7) + "; ";
+    }
+    OnigRex rex{"(\\w+)=(\\w+)(!)?"};
+    RexRunQueue queue;
+    auto matches = sync_wait(all_matches_async(queue, rex, ssa{text}, {}, 16), queue);
+    ASSERT_TRUE(matches);
+    auto expected = rex.all_matches(ssa{text});
+    ASSERT_EQ(matches->size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        for (size_t g = 0; g < 3; g++) {
+            EXPECT_EQ((*matches)[i][g], expected[i][g]);
+        }
+        EXPECT_EQ((*matches)[i][3].first, MatchSpan::npos);
+    }
+
+    auto replaced = sync_wait(replace_async<stringa>(queue, rex, ssa{text}, "$2:$1", {}, 64), queue);
+    ASSERT_TRUE(replaced);
+    EXPECT_EQ(*replaced, rex.replace<stringa>(ssa{text}, "$2:$1"));
+    EXPECT_EQ(*sync_wait(replace_async<stringa>(queue, rex, "no matches", "x"), queue), "no matches");
+
+    // Исполнитель в других потоках.
+    struct ThreadExecutor {
+        void post(std::coroutine_handle<> handle) {
+            std::thread([handle] { handle.resume(); }).detach();
+        }
+    } threads;
+    auto limited = sync_wait(all_matches_async(threads, rex, ssa{text}, {}, 100, 0, 250));
+    ASSERT_TRUE(limited);
+    EXPECT_EQ(limited->size(), 250u);
+
+    // Отмена после нескольких порций.
+    struct CancelAfter {
+        RexRunQueue& queue;
+        std::stop_source& source;
+        int left;
+        void post(std::coroutine_handle<> handle) {
+            if (--left == 0) {
+                source.request_stop();
+            }
+            queue.post(handle);
+        }
+    };
+    std::stop_source source;
+    CancelAfter cancel{queue, source, 3};
+    auto cancelled = sync_wait(all_matches_async(cancel, rex, ssa{text}, source.get_token(), 16), queue);
+    EXPECT_FALSE(cancelled);
+    EXPECT_EQ(cancel.left, 0);
+}
+
+TEST(SimRex, OnigMemory) {
+    OnigRex rex{"(\\w+)@(\\w+)\\.com"};
+    auto stats = onig_memory_stats();
+    if (stats.blocks) {
+        // oniguruma собрана с перенаправлением памяти (SIMREX_ONIG_ALLOCATOR).
+        EXPECT_GT(rex.memory_usage(), 0u);
+        EXPECT_GE(stats.bytes, rex.memory_usage());
+        EXPECT_GE(stats.peak, stats.bytes);
+        OnigRex other{"(\\w+)@(\\w+)\\.com"};
+        EXPECT_EQ(other.memory_usage(), rex.memory_usage());
+        EXPECT_GT(onig_memory_stats().bytes, stats.bytes);
+    } else {
+        EXPECT_EQ(rex.memory_usage(), 0u);
+        EXPECT_EQ(stats.bytes, 0u);
+    }
+    // Пока есть выделенные блоки или без перенаправления памяти функции поменять нельзя.
+    EXPECT_FALSE(set_onig_allocator({}));
+}
+
+TEST(SimRex, CodePointOffsets) {
+    ssa text = "Жук ест: ёж, 😀 и ёлка. ё";
+    OnigRex rex{"ё(\\w)|(😀)"};
+    auto matches = rex.all_matches_cp(text);
+    ASSERT_EQ(matches.size(), 3u);
+    EXPECT_EQ(matches[0][0].first, 9u);
+    EXPECT_EQ(matches[0][1].first, 10u);
+    EXPECT_EQ(matches[0][1].second, "ж");
+    EXPECT_EQ(matches[0][2].first, MatchSpan::npos);
+    EXPECT_EQ(matches[1][0].first, 13u);
+    EXPECT_EQ(matches[1][2].first, 13u);
+    EXPECT_EQ(matches[2][0].first, 17u);
+    auto first = rex.first_match_cp(text, 26);
+    ASSERT_EQ(first.size(), 3u);
+    EXPECT_EQ(first[0].first, 17u);
+
+    // Совпадает с пересчётом от начала текста, и для UTF-16.
+    std::u16string wide = u"😀ab😀cab😀😀ab";
+    OnigRegexp<u16s> rex16{u"a(b)"};
+    CodePointIndex<u16s> index{ssu{wide}, 3};
+    for (const auto& match: rex16.all_matches_cp(ssu{wide})) {
+        size_t unit = match[0].second.symbols() - wide.data();
+        EXPECT_EQ(match[0].first, CodePointCounter<u16s>::count(wide.data(), wide.data() + unit));
+        EXPECT_EQ(index.to_cp(unit), match[0].first);
+        EXPECT_EQ(index.to_unit(match[0].first), unit);
+    }
+    EXPECT_EQ(index.to_cp(wide.size()), 11u);
+    EXPECT_EQ(index.to_unit(11), wide.size());
+    EXPECT_EQ(index.to_unit(100), wide.size());
+
+    CodePointCounter<u8s> counter{text};
+    EXPECT_EQ(counter.to_cp(text.length()), 24u);
+    EXPECT_EQ(counter.to_cp(2), 1u);
+}
+
+TEST(SimRex, RuleSetHotReload) {
+    RuleSetA rules{{"\\d+", "<num>"}, {"(\\w+)@(\\w+)", "$2 at $1"}};
+    ASSERT_TRUE(rules.isValid());
+    EXPECT_EQ(rules.size(), 2u);
+    EXPECT_EQ(rules.apply<stringa>("mail bob@host 42 times"), "mail host at bob <num> times");
+    EXPECT_EQ(rules.first_matching("x@y"), 1u);
+    EXPECT_EQ(rules.first_matching("none"), size_t(-1));
+    EXPECT_EQ(rules.replacement(0), "<num>");
+    RuleSetA broken;
+    EXPECT_FALSE(broken.add("(a"));
+    EXPECT_FALSE(broken.isValid());
+
+    LiveRuleSet<u8s> live;
+    EXPECT_FALSE(live.read());
+    EXPECT_EQ(live.emplace(std::move(rules)), 1u);
+
+    // Читатели работают, пока писатель публикует новые версии. Каждая версия заменяет цифры на свой номер.
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> reads{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&] {
+            size_t lastVersion = 0;
+            while (!stop) {
+                auto rules = live.read();
+                ASSERT_TRUE(rules);
+                stringa result = rules->apply<stringa>("v 7");
+                ASSERT_TRUE(result == "v <num>" || (ssa{result.symbols(), 3} == "v [")) << result;
+                size_t version = live.version();
+                EXPECT_GE(version, lastVersion);
+                lastVersion = version;
+                reads++;
+            }
+        });
+    }
+    for (int v = 2; v <= 50; v++) {
+        // Даём читателям поработать со старой версией.
+        for (size_t until = reads + 4; reads < until;) {
+            std::this_thread::yield();
+        }
+        std::string repl = "[" + std::to_string(v) + "]";
+        auto next = std::make_unique<RuleSetA>();
+        next->add("\\d+", ssa{repl.data(), repl.size()});
+        EXPECT_EQ(live.publish(std::move(next)), uint64_t(v));
+    }
+    stop = true;
+    for (auto& thread: readers) {
+        thread.join();
+    }
+    EXPECT_GT(reads.load(), 0u);
+    EXPECT_EQ(live.read()->apply<stringa>("v 7"), "v [50]");
+}
+
+TEST(SimRex, TrigramIndex) {
+    std::vector<std::string> storage;
+    for (int i = 0; i < 400; i++) {
+        storage.push_back("doc " + std::to_string(i) + (i % 7 ? " plain text" : " ERROR: disk full") + (i % 50 ? "" : " GET /api/users"));
+    }
+    std::vector<ssa> docs;
+    for (const auto& doc: storage) {
+        docs.emplace_back(doc.data(), doc.size());
+    }
+    TrigramIndexA index{docs, {.threads = 4, .minChunk = 16}};
+    EXPECT_TRUE(index.isValid());
+    EXPECT_EQ(index.documents(), 400u);
+    EXPECT_GT(index.trigrams(), 0u);
+
+    auto check = [&](const TrigramIndexA& index, ssa pattern) {
+        OnigRex rex{pattern};
+        std::vector<size_t> expected;
+        for (size_t i = 0; i < docs.size(); i++) {
+            if (rex.search(docs[i]) != str::npos) {
+                expected.push_back(i);
+            }
+        }
+        EXPECT_EQ(index.matching(rex, pattern, docs), expected) << pattern;
+        return index.candidates(pattern).size();
+    };
+    // Кандидаты отбираются точно по литералу.
+    EXPECT_EQ(check(index, "ERROR: (\\w+)"), 58u);
+    EXPECT_EQ(check(index, "GET /api/\\w+|disk full"), 64u);
+    EXPECT_EQ(check(index, "nothing like this"), 0u);
+    // Без литералов от трёх символов кандидаты - все документы.
+    EXPECT_EQ(check(index, "\\d+"), 400u);
+    EXPECT_EQ(check(index, "(?i)error"), 400u);
+
+    auto path = std::filesystem::temp_directory_path() / "simrex_trigram_test.idx";
+    ASSERT_TRUE(index.save(path));
+    TrigramIndexA loaded;
+    EXPECT_FALSE(loaded.isValid());
+    ASSERT_TRUE(loaded.load(path));
+    EXPECT_TRUE(loaded.isValid());
+    EXPECT_EQ(loaded.documents(), 400u);
+    EXPECT_EQ(loaded.trigrams(), index.trigrams());
+    EXPECT_EQ(check(loaded, "ERROR: (\\w+)"), 58u);
+    EXPECT_EQ(check(loaded, "GET /api/\\w+"), 8u);
+    // Индекс другого типа символов не загружается.
+    TrigramIndexU wide;
+    EXPECT_FALSE(wide.load(path));
+    loaded = TrigramIndexA{};
+    std::filesystem::remove(path);
+
+    std::vector<stringu> wstorage{u"first ошибка here", u"second line", u"третья ошибка"};
+    std::vector<ssu> wdocs(wstorage.begin(), wstorage.end());
+    TrigramIndexU windex{wdocs};
+    EXPECT_EQ(windex.candidates(u"третья\\s+\\w+"), (std::vector<size_t>{2}));
+    EXPECT_EQ(windex.matching(OnigRexU{u"ошибка"}, u"ошибка", wdocs), (std::vector<size_t>{0, 2}));
+
+    // Управляющий символ и восьмеричный код входят в триграммы своим значением.
+    std::vector<ssa> cdocs{ssa{"x\x01y"}, ssa{"xay"}, ssa{"x-y"}};
+    TrigramIndexA cindex{cdocs};
+    EXPECT_EQ(cindex.candidates("x\\C-ay"), (std::vector<size_t>{0}));
+    EXPECT_EQ(cindex.candidates("x\\cay"), (std::vector<size_t>{0}));
+    EXPECT_EQ(cindex.candidates("x\\141y"), (std::vector<size_t>{1}));
+    EXPECT_EQ(cindex.candidates("x\\M-ay"), (std::vector<size_t>{0, 1, 2}));
+    EXPECT_EQ(cindex.matching(OnigRex{"x\\C-ay"}, "x\\C-ay", cdocs), (std::vector<size_t>{0}));
+}
+
+TEST(SimRex, StreamSearch) {
+    std::string text;
+    for (int k = 0; k < 300; k++) {
+        text += "ts=" + std::to_string(k * 13) + " level=" + (k % 3 ? "info" : "error") + " msg=\"request " + std::to_string(k) + "\"\n";
+    }
+    ssa full{text.data(), text.size()};
+    OnigRex rex{"level=(error) msg=\"(\\w+) (\\d+)\"$"};
+    std::vector<MatchSpan> expected;
+    for (const auto& match: rex.all_matches(full)) {
+        for (const auto& [at, group]: match) {
+            expected.push_back(at == str::npos ? MatchSpan{} : MatchSpan{at, at + group.length()});
+        }
+    }
+    ASSERT_EQ(expected.size(), 100u * 4);
+
+    // Источник отдаёт текст блоками, не больше запрошенного размера.
+    auto source = [&, at = size_t(0)](std::span<u8s> buffer) mutable {
+        size_t len = std::min(buffer.size(), text.size() - at);
+        std::copy_n(text.data() + at, len, buffer.data());
+        at += len;
+        return len;
+    };
+    for (unsigned queue: {0u, 3u}) {
+        StreamOptions options{.blockSize = 37, .window = 64, .queue = queue};
+        auto found = stream_all_matches(rex, decltype(source){source}, options);
+        ASSERT_EQ(found.size(), expected.size()) << queue;
+        for (size_t i = 0; i < found.size(); i++) {
+            EXPECT_EQ(found[i].begin, expected[i].begin) << queue << " " << i;
+            EXPECT_EQ(found[i].end, expected[i].end) << queue << " " << i;
+        }
+        EXPECT_EQ(stream_count(rex, decltype(source){source}, options), 100u);
+        EXPECT_EQ(stream_count(rex, decltype(source){source}, options, 5), 5u);
+    }
+    // Тексты вхождений, в том числе разрезанных границами блоков.
+    std::vector<std::string> texts;
+    stream_matches(OnigRex{"request \\d+"}, decltype(source){source}, [&](std::span<const MatchSpan> groups, ssa match) {
+        EXPECT_EQ(match, full(groups[0].begin, groups[0].length()));
+        texts.emplace_back(match.symbols(), match.length());
+    }, {.blockSize = 10, .window = 32});
+    ASSERT_EQ(texts.size(), 300u);
+    EXPECT_EQ(texts[299], "request 299");
+
+    std::istringstream in{text};
+    EXPECT_EQ(stream_count(rex, RexIstreamSource<u8s>{in}), 100u);
+
+    // Исключение источника выходит из потока чтения к вызывающему.
+    auto failing = [n = 0](std::span<u8s> buffer) mutable -> size_t {
+        if (++n > 3) {
+            throw std::runtime_error("read error");
+        }
+        std::fill(buffer.begin(), buffer.end(), 'a');
+        return buffer.size();
+    };
+    EXPECT_THROW(stream_count(OnigRex{"a+"}, failing, {.blockSize = 16}), std::runtime_error);
+
+#ifdef SIMREX_WITH_ZLIB
+    auto path = std::filesystem::temp_directory_path() / "simrex_stream_test.gz";
+    gzFile gz = gzopen(path.string().c_str(), "wb");
+    ASSERT_TRUE(gz);
+    for (int rep = 0; rep < 20; rep++) {
+        gzwrite(gz, text.data(), unsigned(text.size()));
+    }
+    gzclose(gz);
+    RexGzipSource<u8s> gzSource{path};
+    ASSERT_TRUE(gzSource);
+    EXPECT_EQ(stream_count(rex, gzSource, {.blockSize = 4096}), 2000u);
+    EXPECT_FALSE(gzSource.failed());
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 20);
+    RexGzipSource<u8s> truncated{path};
+    ASSERT_TRUE(truncated);
+    EXPECT_LT(stream_count(rex, truncated, {.blockSize = 4096}), 2000u);
+    EXPECT_TRUE(truncated.failed());
+    std::filesystem::remove(path);
+#endif
+}
+
 } // namespace simrex::testing